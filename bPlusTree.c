@@ -0,0 +1,1898 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multimap.h"
+#include "mmsort.h"
+#include "mmvalues.h"
+#include "mmarena.h"
+
+
+/*============================================================================
+README:
+    This is the B+ tree version of the multimap, meant to be compared with
+    the plain b-tree in bTree.c (which it borrows most of its ideas and
+    naming from, so read that README first). The differences:
+        1) Where the values live --- In bTree.c every node holds key_nodes,
+            so the values for a key might be anywhere in the tree, and a
+            traversal has to recurse through all of it. Here only the
+            leaves hold key_nodes. Internal nodes just hold separator keys
+            that steer a search towards the right leaf:
+
+                kids[i] holds keys k with keys[i - 1] <= k < keys[i]
+
+            so a search goes into kids[i] where i is the number of separators
+            <= the key, and a key equal to a separator lives to its right.
+        2) Leaf links --- Every leaf points to the leaf to its right (next),
+            so the leaves form a sorted linked list. (Internal nodes are
+            linked to their right neighbours the same way, see point 7.)
+            A full traversal finds the leftmost leaf and then just walks
+            that list, which is a linear, prefetch-friendly pass over the
+            leaves that never touches internal nodes again. Range scans
+            work the same way, starting from the leaf that holds the low
+            key.
+        3) Node sizes --- Leaves and internal nodes are the same number of
+            bytes (set with init_multimap_with_config), but since a kid
+            pointer is smaller than a key_node, internal nodes fit more
+            keys: mm->leafKeys and mm->innerKeys are worked out separately.
+        4) Splitting --- Insertion uses the same proactive, top-down
+            splitting as bTree.c. Splitting an internal node moves its
+            middle key up into the parent, as before. Splitting a leaf
+            instead *copies* the first key of the new right half up (the
+            key_node itself must stay in a leaf), and links the new leaf
+            into the leaf list.
+
+            For a visual representation, a small tree might look like:
+
+                                    mm->root
+                                    |
+                          -------------------------
+                          | isLeaf=0 | keys: 3  6 |
+                          | nKeys=2  |            |
+                          |----------|------------|
+                          | kids:    0    1    2  |
+                          -------------------------
+                                /     |       \
+                               /      |        \
+               -------------   -------------   -------------
+               | 1  2      |-->| 3  4  5   |-->| 6  7      |--> NULL
+               | kNodes... |   | kNodes... |   | kNodes... |
+               -------------   -------------   -------------
+
+        5) Removal --- Also top-down like bTree.c: every node stepped into is
+            first given more than its minimum number of keys (minLeafKeys
+            or minInnerKeys, the smaller half of a split) by borrowing from
+            or merging with a sibling. Borrowing between leaves moves a
+            key_node and resets the separator in the parent to the right
+            leaf's new first key; merging leaves also unlinks the right one
+            from the leaf list. Removing a key from a leaf leaves any copy
+            of it in the internal nodes alone, since it still separates
+            the same two kids correctly.
+        6) Bulk loading --- mm_bulk_load works like the one in bTree.c
+            (README point 5 there), except that every key goes into a
+            leaf: the leaves are filled and linked first, and each level
+            above separates its kids by the smallest key under each one.
+        7) B-link trees --- Every node also knows the separator to its
+            right in the level above, its high key: every key under it is
+            less than that (unless it is the rightmost node of its level,
+            which isn't bounded). With mm_config.concurrent set to
+            MM_CONCURRENT_BLINK, this is used the way Lehman and Yao do, so
+            that a split never holds more than one node latched:
+                - Every node has a reader-writer latch, and a walk down the
+                    tree latches one node at a time, letting go of the
+                    parent before latching the kid.
+                - A split only latches the node that is split: the new
+                    right half is linked in to its right and takes over its
+                    high key, and the node's high key becomes the
+                    separator. Then the node is let go, and the separator
+                    added to the parent (found again from the nodes walked
+                    through on the way down) with only the parent latched,
+                    splitting that in turn if it is full. Splitting the
+                    root latches the root pointer as well (mm->rootLock).
+                - Any walk that finds its key is not less than a node's
+                    high key, because the node split after the walk left
+                    the parent, just follows next to the right until it
+                    is.
+                - Nothing is ever merged or borrowed: a removal just takes
+                    the key out of its leaf, which may leave leaves with
+                    few keys or none (which the leaf walks skip over). So
+                    nodes are never freed, and a walk that has let go of a
+                    parent can always still latch its kid.
+            The other concurrent modes just lock the whole tree (see
+            lockTree), and in every mode the high keys and links are kept
+            up to date, by splits, merges, borrowing and bulk loading.
+ *============================================================================*/
+
+
+/*============================================================================
+ * TYPES
+ *
+ *   These types are defined in the implementation file so that they can
+ *   be kept hidden to code outside this source file.  This is not for any
+ *   security reason, but rather just so we can enforce that our testing
+ *   programs are generic and don't have any access to implementation details.
+ *============================================================================*/
+
+#define DEFAULT_NODE_SIZE (4096) /* bytes per node, one page by default */
+#define MIN_KEYS (3) /* the smallest node that still splits properly */
+#define MAX_DEPTH (64) /* deeper than any tree can get */
+
+typedef struct bp_node  /* see README */
+{
+    int isLeaf;     /* is this a leaf */
+    int nKeys;    /* how many keys does this node contain? */
+    int level;    /* how many levels above the leaves it is */
+    int bounded;  /* zero for the rightmost node of a level */
+    int highKey;  /* otherwise every key under it is < highKey (README 7) */
+    key_node *kNodes;  /* leaves only: kNodes[i] holds the values of keys[i] */
+    struct bp_node **kids;  /* internal only: nKeys + 1 kids, see README */
+    struct bp_node *next;  /* the next node to the right on its level */
+    pthread_rwlock_t latch; /* B-link trees only, see README point 7 */
+    int keys[];  /* sorted keys, followed by the kNodes or kids array */
+} bp_node;
+
+/* A position in the leaf list, see README point 2. */
+struct mm_cursor
+{
+    bp_node *leaf;  /* the leaf being walked, NULL once past the end */
+    int pos;        /* the key in it whose values are being handed out */
+    value_iter values; /* how far through that key's values it is (its
+                          kNode is NULL until it has started on them) */
+};
+
+/*
+ * Where the last key of a batch (see mm_add_values) went: its leaf, and the
+ * separator to the right of that leaf in the nearest ancestor that has one,
+ * which every key in the leaf is less than. Same as in bTree.c.
+ */
+typedef struct leaf_hint
+{
+    bp_node *leaf;
+    int bounded;      /* zero if the leaf is the rightmost one */
+    int bound;
+} leaf_hint;
+
+#define PROBE_GROUP (16) /* how many lookups mm_contains_pairs interleaves */
+#define PREFETCH_LINES (4) /* how much of a node to prefetch ahead of a search */
+
+/* One of the lookups mm_contains_pairs has in flight, as in bTree.c. */
+typedef struct probe_state
+{
+    enum { PROBE_IDLE, PROBE_NODE, PROBE_KNODE, PROBE_VALUES } stage;
+    size_t index;       /* which of the pairs this is */
+    bp_node *node;      /* PROBE_NODE: the node to search next */
+    key_node *kNode;    /* PROBE_KNODE, PROBE_VALUES: the key's key_node */
+} probe_state;
+
+/* The entry-point of the multimap data structure. */
+struct multimap
+{
+    bp_node *root;
+    int leafKeys;      /* how many keys fit in a leaf */
+    int innerKeys;     /* how many keys fit in an internal node */
+    int minLeafKeys;   /* how few keys a leaf (other than the root) may have */
+    int minInnerKeys;  /* ... and an internal node */
+    int fillLeafKeys;  /* how many keys mm_bulk_load puts in a leaf */
+    int fillInnerKeys; /* ... and in an internal node */
+    size_t nodeBytes;  /* the size of one node, header and arrays included */
+    node_arena nodes;  /* where its nodes come from (see mmarena.h) */
+    value_pool values; /* ... and its values arrays (see mmvalues.h) */
+    int concurrent;    /* the tree is locked (see lockTree), or latched as a
+                          B-link tree (README point 7) */
+    pthread_rwlock_t lock;
+    pthread_mutex_t rootLock;   /* B-link trees: changing root */
+    pthread_mutex_t nodesLock;  /* B-link trees: allocating nodes */
+    multimap *origin;  /* a snapshot's multimap, whose values it shares */
+};
+
+
+
+/*============================================================================
+ * HELPER FUNCTION DECLARATIONS
+ *
+ *   Declarations of helper functions that are local to this module.  Again,
+ *   these are not visible outside of this module.
+ *============================================================================*/
+
+/* where the array after keys[] starts, in a node that holds nKeys keys */
+size_t array_offset(int nKeys);
+
+/* allocate a single leaf or internal node */
+bp_node * alloc_node(multimap *mm, int isLeaf);
+
+/* lock and unlock a concurrent multimap (no-ops otherwise) */
+void lockTree(multimap *mm, int exclusive);
+void unlockTree(multimap *mm);
+
+/* is node full (for its kind)? */
+int node_full(multimap *mm, bp_node *node);
+
+/* index of the first key >= the argument key (where it is, in a leaf) */
+int lower_bound(bp_node *node, int key);
+
+/* index of the first key > the argument key (which kid to visit) */
+int upper_bound(bp_node *node, int key);
+
+/* split the full child parent->kids[pos] in two, see README point 4 */
+void splitNode(multimap *mm, bp_node *parent, int pos);
+
+/*
+ * split the full node elder, linking in the new right half (which is
+ * returned) and setting *sep to the separator between the two
+ */
+bp_node * splitInTwo(multimap *mm, bp_node *elder, int *sep);
+
+/* add the separator sep and the kid to its right at pos in parent */
+void insertKid(multimap *mm, bp_node *parent, int pos, int sep, bp_node *kid);
+
+/*
+ * the removal counterparts of splitNode: make sure parent->kids[pos] has
+ * more than its minimum number of keys, by borrowing from a sibling or
+ * merging with one, and return where that kid now is
+ */
+int fixChild(multimap *mm, bp_node *parent, int pos);
+void borrowFromLeft(bp_node *parent, int pos);
+void borrowFromRight(bp_node *parent, int pos);
+void mergeNodes(multimap *mm, bp_node *parent, int pos);
+
+/* the smallest number of keys node may be left with */
+int node_min(multimap *mm, bp_node *node);
+
+/*
+ * removes key (and its key_node, which is copied to removed) from the
+ * tree, rebalancing on the way down; returns zero if it wasn't there
+ */
+int removeKey(multimap *mm, int key, key_node *removed);
+
+/*
+ * finds the key_node for a key, possibly creating it (splitting nodes on
+ * the way down), or returns NULL; if hint isn't NULL, it is filled in with
+ * the leaf the key is (or would be) in
+ */
+key_node * find_node(multimap *mm, int key, int create_if_not_found,
+                     leaf_hint *hint);
+
+/* add a new, empty key_node for key at pos in a leaf that has room */
+key_node * insertInLeaf(multimap *mm, bp_node *node, int pos, int key);
+
+/* take the key at pos (and its key_node, copied to removed) out of a leaf */
+void removeFromLeaf(bp_node *node, int pos, key_node *removed);
+
+/* latch and unlatch a node of a B-link tree, see README point 7 */
+void latchNode(bp_node *node, int exclusive);
+void unlatchNode(bp_node *node);
+
+/*
+ * from the latched node, follow the links right (latching each node before
+ * letting go of the last) to the node of that level that key belongs in
+ */
+bp_node * moveRight(bp_node *node, int key, int exclusive);
+
+/*
+ * walk down a B-link tree, a latch at a time, to the node at level that key
+ * belongs in (or one to the left of it), and return it unlatched; the
+ * internal nodes passed through are pushed on path, if it isn't NULL
+ */
+bp_node * descendLink(multimap *mm, int key, int level, bp_node **path,
+                      int *depth);
+
+/*
+ * add the separator of a split of elder (younger being its new right half)
+ * to the level above, splitting up the tree as far as needed
+ */
+void addSeparator(multimap *mm, bp_node **path, int depth, bp_node *elder,
+                  int sep, bp_node *younger);
+
+/* mm_add_value, mm_remove_value (or mm_remove_key, if wholeKey is nonzero)
+ * and mm_contains_pair (or mm_contains_key, if checkValue is zero) for a
+ * B-link tree
+ */
+void add_value_link(multimap *mm, int key, int value);
+int remove_link(multimap *mm, int key, int value, int wholeKey);
+int contains_link(multimap *mm, int key, int value, int checkValue);
+
+/* returns the leftmost leaf of the tree */
+bp_node * first_leaf(multimap *mm);
+
+/* position a cursor at the first key >= key */
+void cursor_seek(mm_cursor *cursor, multimap *mm, int key);
+
+/* how many nodes a level of a bulk loaded tree is made of, see bTree.c */
+size_t level_width(size_t slots, int fillSlots, int maxSlots);
+
+/* hands out the next key of the sorted pairs, with all of its values */
+void take_key(multimap *mm, const mm_pair *pairs, size_t n, size_t *next,
+              int *key, key_node *kNode);
+
+/* links width nodes of a level, whose smallest keys are mins, left to right */
+void link_level(bp_node **nodes, const int *mins, size_t width);
+
+/* builds the tree from n pairs sorted by key, see README point 6 */
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n);
+
+/* start loading the start of a node (header and first keys) into cache */
+void prefetch_node(bp_node *node);
+
+/* free's the values of every key of a multimap */
+void free_multimap_values(multimap *mm);
+
+/*
+ * copy the subtree at node, depth levels below the root, into mm, linking
+ * each copy to the right of last[depth] (see mm_snapshot)
+ */
+bp_node * copy_subtree(multimap *mm, bp_node *node, int depth,
+                       bp_node **last);
+
+
+
+/*============================================================================
+ * FUNCTION IMPLEMENTATIONS
+ *============================================================================*/
+
+/*
+ * keys[] is padded out to a multiple of 8 bytes, so that the kNodes or kids
+ * array right after it is aligned for the pointers it holds.
+ */
+size_t array_offset(int nKeys)
+{
+    return sizeof(bp_node) + sizeof(int) * ((nKeys + 1) & ~1);
+}
+
+
+/*
+ * Allocates a node and zeros out its contents, then points it at the
+ * array (kNodes for a leaf, kids otherwise) that follows its keys. In a
+ * B-link tree, threads take turns at the arena, and the node gets a latch.
+ */
+bp_node * alloc_node(multimap *mm, int isLeaf)
+{
+    bp_node *node;
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        pthread_mutex_lock(&mm->nodesLock);
+        node = (bp_node *) arena_alloc(&mm->nodes);
+        pthread_mutex_unlock(&mm->nodesLock);
+        bzero(node, mm->nodeBytes);
+        pthread_rwlock_init(&node->latch, NULL);
+    }
+    else
+    {
+        node = (bp_node *) arena_alloc(&mm->nodes);
+        bzero(node, mm->nodeBytes);
+    }
+    node->isLeaf = isLeaf;
+    if (isLeaf)
+    {
+        node->kNodes = (key_node *) ((char *) node +
+                                     array_offset(mm->leafKeys));
+    }
+    else
+    {
+        node->kids = (bp_node **) ((char *) node +
+                                   array_offset(mm->innerKeys));
+    }
+    return node;
+}
+
+
+int node_full(multimap *mm, bp_node *node)
+{
+    return node->nKeys == (node->isLeaf ? mm->leafKeys : mm->innerKeys);
+}
+
+
+/*
+ * Branchless binary searches over the keys of a node (see the
+ * SEARCH_BINARY strategy in bTree.c for how these work). base ends up on
+ * the last key that is still "before" the query, or on keys[0].
+ */
+int lower_bound(bp_node *node, int key)
+{
+    const int *base = node->keys;
+    int n = node->nKeys;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    while (n > 1)
+    {
+        int half = n / 2;
+        base = (base[half] < key) ? base + half : base;
+        n -= half;
+    }
+    return (base - node->keys) + (*base < key);
+}
+
+
+int upper_bound(bp_node *node, int key)
+{
+    const int *base = node->keys;
+    int n = node->nKeys;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    while (n > 1)
+    {
+        int half = n / 2;
+        base = (base[half] <= key) ? base + half : base;
+        n -= half;
+    }
+    return (base - node->keys) + (*base <= key);
+}
+
+
+/*
+ * Splits the full node parent->kids[pos] in two (see splitInTwo), and adds
+ * the separator between the two to parent, which has room thanks to
+ * proactive splitting.
+ */
+void splitNode(multimap *mm, bp_node *parent, int pos)
+{
+    int sep;
+    bp_node *younger = splitInTwo(mm, parent->kids[pos], &sep);
+    insertKid(mm, parent, pos, sep, younger);
+}
+
+
+/*
+ * Splits the full node elder into itself (keeping the lower half) and a new
+ * younger node to its right. The younger node is linked in after elder and
+ * takes over its high key, and elder's high key becomes the separator.
+ */
+bp_node * splitInTwo(multimap *mm, bp_node *elder, int *sep)
+{
+    bp_node *younger = alloc_node(mm, elder->isLeaf);
+    int mid = elder->nKeys / 2;
+
+    if (elder->isLeaf)
+    {
+        /* The right half, including keys[mid], moves; keys[mid] is copied up */
+        younger->nKeys = elder->nKeys - mid;
+        memcpy(younger->keys, &elder->keys[mid], sizeof(int) * younger->nKeys);
+        memcpy(younger->kNodes, &elder->kNodes[mid],
+                                    sizeof(key_node) * younger->nKeys);
+        bzero(&elder->kNodes[mid], sizeof(key_node) * younger->nKeys);
+        *sep = younger->keys[0];
+    }
+    else
+    {
+        /* keys[mid] moves up, the keys and kids right of it move over */
+        younger->nKeys = elder->nKeys - (mid + 1);
+        memcpy(younger->keys, &elder->keys[mid + 1],
+                                    sizeof(int) * younger->nKeys);
+        memcpy(younger->kids, &elder->kids[mid + 1],
+                                    sizeof(bp_node *) * (younger->nKeys + 1));
+        bzero(&elder->kids[mid + 1], sizeof(bp_node *) * (younger->nKeys + 1));
+        *sep = elder->keys[mid];
+    }
+    elder->nKeys = mid;
+
+    younger->level = elder->level;
+    younger->bounded = elder->bounded;
+    younger->highKey = elder->highKey;
+    younger->next = elder->next;
+    elder->bounded = 1;
+    elder->highKey = *sep;
+    elder->next = younger;
+    return younger;
+}
+
+
+void insertKid(multimap *mm, bp_node *parent, int pos, int sep, bp_node *kid)
+{
+    /* make room in the parent for the separator and the new kid */
+    memmove(&parent->keys[pos + 1], &parent->keys[pos],
+                                    sizeof(int) * (parent->nKeys - pos));
+    memmove(&parent->kids[pos + 2], &parent->kids[pos + 1],
+                                    sizeof(bp_node *) * (parent->nKeys - pos));
+    parent->keys[pos] = sep;
+    parent->kids[pos + 1] = kid;
+    parent->nKeys++;
+    assert(!(parent->nKeys > mm->innerKeys));
+}
+
+
+/*
+ * Walks from the root down to the leaf that should hold key. If a key_node
+ * may be created, full nodes are split before they are entered (a full
+ * root grows the tree by one level), so the leaf always has room for the
+ * insert.
+ */
+key_node * find_node(multimap *mm, int key, int create_if_not_found,
+                     leaf_hint *hint)
+{
+    bp_node *node;
+    int pos;
+
+    if (mm->root == NULL)
+    {
+        if (!create_if_not_found)
+        {
+            return NULL;
+        }
+        mm->root = alloc_node(mm, /* isLeaf */ 1);
+    }
+
+    if (create_if_not_found && node_full(mm, mm->root))
+    {
+        node = alloc_node(mm, /* isLeaf */ 0);
+        node->level = mm->root->level + 1;
+        node->kids[0] = mm->root;
+        mm->root = node;
+        splitNode(mm, node, 0);
+    }
+
+    if (hint != NULL)
+    {
+        hint->bounded = 0;
+    }
+    node = mm->root;
+    while (!(node->isLeaf))
+    {
+        pos = upper_bound(node, key);
+        if (create_if_not_found && node_full(mm, node->kids[pos]))
+        {
+            splitNode(mm, node, pos);
+            pos = upper_bound(node, key); /* key may belong to the new kid */
+        }
+        if (hint != NULL && pos < node->nKeys)
+        {
+            hint->bounded = 1;
+            hint->bound = node->keys[pos];
+        }
+        node = node->kids[pos];
+    }
+    if (hint != NULL)
+    {
+        hint->leaf = node;
+    }
+
+    pos = lower_bound(node, key);
+    if (pos < node->nKeys && node->keys[pos] == key)
+    {
+        return &node->kNodes[pos];
+    }
+    if (!create_if_not_found)
+    {
+        return NULL;
+    }
+    return insertInLeaf(mm, node, pos, key);
+}
+
+
+key_node * insertInLeaf(multimap *mm, bp_node *node, int pos, int key)
+{
+    /* should have space cuz proactive splitting */
+    memmove(&node->keys[pos + 1], &node->keys[pos],
+                                    sizeof(int) * (node->nKeys - pos));
+    memmove(&node->kNodes[pos + 1], &node->kNodes[pos],
+                                    sizeof(key_node) * (node->nKeys - pos));
+    bzero(&node->kNodes[pos], sizeof(key_node));
+    node->keys[pos] = key;
+    node->nKeys++;
+    assert(!(node->nKeys > mm->leafKeys));
+    return &node->kNodes[pos];
+}
+
+
+void removeFromLeaf(bp_node *node, int pos, key_node *removed)
+{
+    *removed = node->kNodes[pos];
+    node->nKeys--;
+    memmove(&node->keys[pos], &node->keys[pos + 1],
+                                    sizeof(int) * (node->nKeys - pos));
+    memmove(&node->kNodes[pos], &node->kNodes[pos + 1],
+                                    sizeof(key_node) * (node->nKeys - pos));
+    bzero(&node->kNodes[node->nKeys], sizeof(key_node));
+}
+
+
+int node_min(multimap *mm, bp_node *node)
+{
+    return node->isLeaf ? mm->minLeafKeys : mm->minInnerKeys;
+}
+
+
+/*
+ * Makes sure parent->kids[pos] can lose a key: borrow one from the left or
+ * right sibling if they have some to spare, otherwise merge with one of
+ * them. Returns the position of the kid to carry on with (merging into the
+ * left sibling moves everything there).
+ */
+int fixChild(multimap *mm, bp_node *parent, int pos)
+{
+    bp_node *child = parent->kids[pos];
+
+    if (child->nKeys > node_min(mm, child))
+    {
+        return pos;
+    }
+    if (pos > 0 && parent->kids[pos - 1]->nKeys > node_min(mm, child))
+    {
+        borrowFromLeft(parent, pos);
+        return pos;
+    }
+    if (pos < parent->nKeys &&
+        parent->kids[pos + 1]->nKeys > node_min(mm, child))
+    {
+        borrowFromRight(parent, pos);
+        return pos;
+    }
+    if (pos < parent->nKeys)
+    {
+        mergeNodes(mm, parent, pos);
+        return pos;
+    }
+    mergeNodes(mm, parent, pos - 1);
+    return pos - 1;
+}
+
+
+/*
+ * Moves the last key of kids[pos - 1] over to kids[pos]. For leaves the
+ * key_node moves and the separator becomes the moved key; for internal
+ * nodes the key rotates through the parent, as in bTree.c.
+ */
+void borrowFromLeft(bp_node *parent, int pos)
+{
+    bp_node *child = parent->kids[pos];
+    bp_node *left = parent->kids[pos - 1];
+
+    memmove(&child->keys[1], &child->keys[0], sizeof(int) * child->nKeys);
+    left->nKeys--;
+    if (child->isLeaf)
+    {
+        memmove(&child->kNodes[1], &child->kNodes[0],
+                                    sizeof(key_node) * child->nKeys);
+        child->keys[0] = left->keys[left->nKeys];
+        child->kNodes[0] = left->kNodes[left->nKeys];
+        bzero(&left->kNodes[left->nKeys], sizeof(key_node));
+        parent->keys[pos - 1] = child->keys[0];
+    }
+    else
+    {
+        memmove(&child->kids[1], &child->kids[0],
+                                    sizeof(bp_node *) * (child->nKeys + 1));
+        child->keys[0] = parent->keys[pos - 1];
+        child->kids[0] = left->kids[left->nKeys + 1];
+        left->kids[left->nKeys + 1] = NULL;
+        parent->keys[pos - 1] = left->keys[left->nKeys];
+    }
+    child->nKeys++;
+    left->highKey = parent->keys[pos - 1];
+}
+
+
+/* The mirror image of borrowFromLeft. */
+void borrowFromRight(bp_node *parent, int pos)
+{
+    bp_node *child = parent->kids[pos];
+    bp_node *right = parent->kids[pos + 1];
+
+    if (child->isLeaf)
+    {
+        child->keys[child->nKeys] = right->keys[0];
+        child->kNodes[child->nKeys] = right->kNodes[0];
+        right->nKeys--;
+        memmove(&right->keys[0], &right->keys[1], sizeof(int) * right->nKeys);
+        memmove(&right->kNodes[0], &right->kNodes[1],
+                                    sizeof(key_node) * right->nKeys);
+        bzero(&right->kNodes[right->nKeys], sizeof(key_node));
+        parent->keys[pos] = right->keys[0];
+    }
+    else
+    {
+        child->keys[child->nKeys] = parent->keys[pos];
+        child->kids[child->nKeys + 1] = right->kids[0];
+        parent->keys[pos] = right->keys[0];
+        right->nKeys--;
+        memmove(&right->keys[0], &right->keys[1], sizeof(int) * right->nKeys);
+        memmove(&right->kids[0], &right->kids[1],
+                                    sizeof(bp_node *) * (right->nKeys + 1));
+        right->kids[right->nKeys + 1] = NULL;
+    }
+    child->nKeys++;
+    child->highKey = parent->keys[pos];
+}
+
+
+/*
+ * The opposite of splitNode: kids[pos + 1] is appended to kids[pos] (with
+ * the separator between them pulled down, for internal nodes), removed from
+ * the parent and freed.
+ */
+void mergeNodes(multimap *mm, bp_node *parent, int pos)
+{
+    bp_node *elder = parent->kids[pos];
+    bp_node *younger = parent->kids[pos + 1];
+    int n = elder->nKeys;
+
+    if (elder->isLeaf)
+    {
+        memcpy(&elder->keys[n], younger->keys, sizeof(int) * younger->nKeys);
+        memcpy(&elder->kNodes[n], younger->kNodes,
+                                    sizeof(key_node) * younger->nKeys);
+        elder->nKeys += younger->nKeys;
+        assert(!(elder->nKeys > mm->leafKeys));
+    }
+    else
+    {
+        elder->keys[n] = parent->keys[pos];
+        memcpy(&elder->keys[n + 1], younger->keys,
+                                    sizeof(int) * younger->nKeys);
+        memcpy(&elder->kids[n + 1], younger->kids,
+                                    sizeof(bp_node *) * (younger->nKeys + 1));
+        elder->nKeys += younger->nKeys + 1;
+        assert(!(elder->nKeys > mm->innerKeys));
+    }
+    elder->bounded = younger->bounded;
+    elder->highKey = younger->highKey;
+    elder->next = younger->next;
+
+    memmove(&parent->keys[pos], &parent->keys[pos + 1],
+                                    sizeof(int) * (parent->nKeys - pos - 1));
+    memmove(&parent->kids[pos + 1], &parent->kids[pos + 2],
+                                sizeof(bp_node *) * (parent->nKeys - pos - 1));
+    parent->nKeys--;
+    parent->kids[parent->nKeys + 1] = NULL;
+    arena_free(&mm->nodes, younger);
+}
+
+
+/*
+ * Walks down to the leaf that would hold key, fixing every kid before
+ * stepping into it, and removes key from that leaf if it is there. The
+ * removed key_node is copied into *removed. Afterwards an empty root is
+ * replaced by its only kid (or by nothing, if it was a leaf).
+ */
+int removeKey(multimap *mm, int key, key_node *removed)
+{
+    bp_node *node = mm->root;
+    int found = 0;
+    int pos;
+
+    if (node == NULL)
+    {
+        return 0;
+    }
+    while (!(node->isLeaf))
+    {
+        pos = fixChild(mm, node, upper_bound(node, key));
+        node = node->kids[pos];
+    }
+
+    pos = lower_bound(node, key);
+    if (pos < node->nKeys && node->keys[pos] == key)
+    {
+        found = 1;
+        removeFromLeaf(node, pos, removed);
+    }
+
+    node = mm->root;
+    if (node->nKeys == 0)
+    {
+        mm->root = node->isLeaf ? NULL : node->kids[0];
+        arena_free(&mm->nodes, node);
+    }
+    return found;
+}
+
+
+/* Follows kids[0] all the way down; NULL for an empty tree. */
+bp_node * first_leaf(multimap *mm)
+{
+    bp_node *node = mm->root;
+    while (node != NULL && !(node->isLeaf))
+    {
+        node = node->kids[0];
+    }
+    return node;
+}
+
+
+/*
+ * Descends to the leaf where key is or would be, and points at the first
+ * key there that is >= key; that may be past the leaf's last key, in which
+ * case mm_cursor_next will move on to the next leaf.
+ */
+void cursor_seek(mm_cursor *cursor, multimap *mm, int key)
+{
+    bp_node *node = mm->root;
+
+    while (node != NULL && !(node->isLeaf))
+    {
+        node = node->kids[upper_bound(node, key)];
+    }
+    cursor->leaf = node;
+    cursor->pos = (node == NULL) ? 0 : lower_bound(node, key);
+    cursor->values.kNode = NULL;
+}
+
+
+/*
+ * One node per fillSlots slots (rounding down), but never so few that a
+ * node would need more than maxSlots.
+ */
+size_t level_width(size_t slots, int fillSlots, int maxSlots)
+{
+    size_t width = slots / fillSlots;
+    size_t least = (slots + maxSlots - 1) / maxSlots;
+    if (width < least)
+    {
+        width = least;
+    }
+    return (width > 0) ? width : 1;
+}
+
+
+/* The values array is sized the way mm_add_value would have grown it. */
+void take_key(multimap *mm, const mm_pair *pairs, size_t n, size_t *next,
+              int *key, key_node *kNode)
+{
+    size_t first = *next;
+    size_t last = first + 1;
+    while (last < n && pairs[last].key == pairs[first].key)
+    {
+        last++;
+    }
+
+    bzero(kNode, sizeof(key_node));
+    kNode_add_values(&mm->values, kNode, &pairs[first], last - first);
+    *key = pairs[first].key;
+    *next = last;
+}
+
+
+/* Each node's high key is the smallest key under the one to its right. */
+void link_level(bp_node **nodes, const int *mins, size_t width)
+{
+    for (size_t i = 0; i + 1 < width; i++)
+    {
+        nodes[i]->next = nodes[i + 1];
+        nodes[i]->bounded = 1;
+        nodes[i]->highKey = mins[i + 1];
+    }
+}
+
+
+/*
+ * See README point 6. The nKeys keys are spread evenly over the leaves,
+ * and the kids of each level evenly over the nodes above them. mins[i] is
+ * the smallest key under nodes[i], which becomes the separator to its left
+ * in the level above. Each level overwrites nodes and mins in place, since
+ * it never writes past what it has already read.
+ */
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n)
+{
+    size_t nKeys = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == 0 || pairs[i].key != pairs[i - 1].key)
+        {
+            nKeys++;
+        }
+    }
+    if (nKeys == 0)
+    {
+        return;
+    }
+
+    size_t width = level_width(nKeys, mm->fillLeafKeys, mm->leafKeys);
+    bp_node **nodes = malloc(sizeof(bp_node *) * width);
+    int *mins = malloc(sizeof(int) * width);
+    size_t next = 0;
+
+    for (size_t i = 0; i < width; i++)
+    {
+        bp_node *leaf = alloc_node(mm, /* isLeaf */ 1);
+        leaf->nKeys = nKeys / width + (i < nKeys % width);
+        for (int j = 0; j < leaf->nKeys; j++)
+        {
+            take_key(mm, pairs, n, &next, &leaf->keys[j],
+                     &leaf->kNodes[j]);
+        }
+        nodes[i] = leaf;
+        mins[i] = leaf->keys[0];
+    }
+    assert(next == n);
+    link_level(nodes, mins, width);
+
+    while (width > 1)
+    {
+        size_t upper = level_width(width, mm->fillInnerKeys + 1,
+                                   mm->innerKeys + 1);
+        size_t kid = 0;
+
+        for (size_t i = 0; i < upper; i++)
+        {
+            bp_node *node = alloc_node(mm, /* isLeaf */ 0);
+            int min = mins[kid];
+
+            node->level = nodes[kid]->level + 1;
+            node->nKeys = width / upper + (i < width % upper) - 1;
+            node->kids[0] = nodes[kid++];
+            for (int j = 0; j < node->nKeys; j++)
+            {
+                node->keys[j] = mins[kid];
+                node->kids[j + 1] = nodes[kid++];
+            }
+            nodes[i] = node;
+            mins[i] = min;
+        }
+        assert(kid == width);
+        width = upper;
+        link_level(nodes, mins, width);
+    }
+
+    mm->root = nodes[0];
+    free(nodes);
+    free(mins);
+}
+
+
+/* Same as in bTree.c. */
+void prefetch_node(bp_node *node)
+{
+    const char *start = (const char *) node;
+    for (int i = 0; i < PREFETCH_LINES; i++)
+    {
+        __builtin_prefetch(start + i * LINE_SIZE);
+    }
+}
+
+
+/*
+ * Free the values of every key of a multimap, walking the leaves in order
+ * (the nodes themselves all go at once, with the arena). A snapshot's
+ * values are held in its origin's pool.
+ */
+void free_multimap_values(multimap *mm)
+{
+    value_pool *pool = (mm->origin != NULL) ? &mm->origin->values :
+                                              &mm->values;
+
+    for (bp_node *leaf = first_leaf(mm); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->nKeys; i++)
+        {
+            kNode_free(pool, &leaf->kNodes[i]);
+        }
+    }
+}
+
+
+/* Initialize a multimap data structure, with DEFAULT_NODE_SIZE nodes. */
+multimap * init_multimap()
+{
+    return init_multimap_with_config(NULL);
+}
+
+
+/*
+ * Initialize a multimap data structure whose nodes take up (at most)
+ * config->node_size bytes, working out how many keys fit in a leaf and in
+ * an internal node of that size (but never less than MIN_KEYS).
+ */
+multimap * init_multimap_with_config(const mm_config *config)
+{
+    if (config == NULL || config->node_size == 0)
+    {
+        mm_config defaults;
+        defaults.node_size = DEFAULT_NODE_SIZE;
+        defaults.fill_factor = (config != NULL) ? config->fill_factor : 0;
+        defaults.page_backing = (config != NULL) ? config->page_backing : 0;
+        defaults.concurrent = (config != NULL) ? config->concurrent : 0;
+        return init_multimap_with_config(&defaults);
+    }
+
+    multimap *mm = malloc(sizeof(multimap));
+    mm->root = NULL;
+    mm->origin = NULL;
+    mm->concurrent = config->concurrent;
+    pthread_rwlock_init(&mm->lock, NULL);
+    pthread_mutex_init(&mm->rootLock, NULL);
+    pthread_mutex_init(&mm->nodesLock, NULL);
+
+    mm->leafKeys = MIN_KEYS;
+    while (array_offset(mm->leafKeys + 1) +
+           sizeof(key_node) * (mm->leafKeys + 1) <= config->node_size)
+    {
+        mm->leafKeys++;
+    }
+    mm->innerKeys = MIN_KEYS;
+    while (array_offset(mm->innerKeys + 1) +
+           sizeof(bp_node *) * (mm->innerKeys + 2) <= config->node_size)
+    {
+        mm->innerKeys++;
+    }
+
+    mm->minLeafKeys = mm->leafKeys / 2;
+    mm->minInnerKeys = (mm->innerKeys - 1) / 2;
+
+    size_t leafBytes = array_offset(mm->leafKeys) +
+                       sizeof(key_node) * mm->leafKeys;
+    size_t innerBytes = array_offset(mm->innerKeys) +
+                        sizeof(bp_node *) * (mm->innerKeys + 1);
+    mm->nodeBytes = (leafBytes > innerBytes) ? leafBytes : innerBytes;
+    arena_init(&mm->nodes, mm->nodeBytes,
+               pages_backing(config->page_backing));
+    pool_init(&mm->values, mm->nodes.backing);
+
+    /* bulk loaded nodes can't be any emptier than a split would leave them */
+    mm->fillLeafKeys = mm->leafKeys;
+    mm->fillInnerKeys = mm->innerKeys;
+    if (config->fill_factor > 0 && config->fill_factor < 1)
+    {
+        mm->fillLeafKeys = (int) (config->fill_factor * mm->leafKeys + 0.5);
+        mm->fillInnerKeys = (int) (config->fill_factor * mm->innerKeys + 0.5);
+    }
+    if (mm->fillLeafKeys < mm->minLeafKeys)
+    {
+        mm->fillLeafKeys = mm->minLeafKeys;
+    }
+    if (mm->fillInnerKeys < mm->minInnerKeys)
+    {
+        mm->fillInnerKeys = mm->minInnerKeys;
+    }
+    return mm;
+}
+
+
+/* Frees the contents of a whole multimap (not the multimap itself though) */
+void clear_multimap(multimap *mm)
+{
+    assert(mm != NULL);
+    free_multimap_values(mm);
+    arena_release(&mm->nodes);
+    pool_release(&mm->values);
+    mm->root = NULL;
+}
+
+
+/*
+ * A concurrent B+ tree is simply locked as a whole, exclusive for changing
+ * it and shared for looking things up in it, so that lookups can still go
+ * on side by side. (See bTree.c for latching each node instead.)
+ */
+void lockTree(multimap *mm, int exclusive)
+{
+    if (!mm->concurrent)
+    {
+        return;
+    }
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(&mm->lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&mm->lock);
+    }
+}
+
+
+void unlockTree(multimap *mm)
+{
+    if (mm->concurrent)
+    {
+        pthread_rwlock_unlock(&mm->lock);
+    }
+}
+
+
+void latchNode(bp_node *node, int exclusive)
+{
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(&node->latch);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&node->latch);
+    }
+}
+
+
+void unlatchNode(bp_node *node)
+{
+    pthread_rwlock_unlock(&node->latch);
+}
+
+
+bp_node * moveRight(bp_node *node, int key, int exclusive)
+{
+    while (node->bounded && key >= node->highKey)
+    {
+        bp_node *right = node->next;
+        latchNode(right, exclusive);
+        unlatchNode(node);
+        node = right;
+    }
+    return node;
+}
+
+
+/*
+ * The kid a walk steps into may split before the walk latches it, which
+ * moveRight takes care of. A separator for a level the root hasn't grown
+ * to yet is waited for: that root split is already on its way up (its
+ * left half was the root, and it is only waiting for rootLock).
+ */
+bp_node * descendLink(multimap *mm, int key, int level, bp_node **path,
+                      int *depth)
+{
+    bp_node *node = __atomic_load_n(&mm->root, __ATOMIC_ACQUIRE);
+
+    while (node != NULL && node->level < level)
+    {
+        sched_yield();
+        node = __atomic_load_n(&mm->root, __ATOMIC_ACQUIRE);
+    }
+    while (node != NULL && node->level > level)
+    {
+        latchNode(node, 0);
+        node = moveRight(node, key, 0);
+        if (path != NULL)
+        {
+            path[(*depth)++] = node;
+        }
+        bp_node *kid = node->kids[upper_bound(node, key)];
+        unlatchNode(node);
+        node = kid;
+    }
+    return node;
+}
+
+
+/*
+ * The parent is the node the walk down went through at the level above,
+ * or, if it has split since, one to its right. If elder was the root when
+ * the walk started, the tree grows a level, unless some other split has
+ * already done that, in which case the parent is looked for from the new
+ * root.
+ */
+void addSeparator(multimap *mm, bp_node **path, int depth, bp_node *elder,
+                  int sep, bp_node *younger)
+{
+    for (;;)
+    {
+        bp_node *parent;
+        bp_node *right = NULL;
+        int up;
+
+        if (depth > 0)
+        {
+            parent = path[--depth];
+        }
+        else
+        {
+            pthread_mutex_lock(&mm->rootLock);
+            if (mm->root == elder)
+            {
+                parent = alloc_node(mm, /* isLeaf */ 0);
+                parent->level = elder->level + 1;
+                parent->kids[0] = elder;
+                insertKid(mm, parent, 0, sep, younger);
+                __atomic_store_n(&mm->root, parent, __ATOMIC_RELEASE);
+                pthread_mutex_unlock(&mm->rootLock);
+                return;
+            }
+            pthread_mutex_unlock(&mm->rootLock);
+            parent = descendLink(mm, sep, elder->level + 1, NULL, NULL);
+        }
+
+        latchNode(parent, 1);
+        parent = moveRight(parent, sep, 1);
+        if (node_full(mm, parent))
+        {
+            right = splitInTwo(mm, parent, &up);
+        }
+
+        /* right is only reachable through parent, which is still latched */
+        bp_node *target = (right != NULL && sep >= up) ? right : parent;
+        insertKid(mm, target, upper_bound(target, sep), sep, younger);
+        unlatchNode(parent);
+
+        if (right == NULL)
+        {
+            return;
+        }
+        elder = parent;
+        sep = up;
+        younger = right;
+    }
+}
+
+
+/*
+ * A full leaf is split with only itself latched, the key going into
+ * whichever half it belongs in, and the separator is only added to the
+ * level above once the leaf is let go.
+ */
+void add_value_link(multimap *mm, int key, int value)
+{
+    bp_node *path[MAX_DEPTH];
+    int depth = 0;
+    bp_node *younger = NULL;
+    int sep;
+
+    if (__atomic_load_n(&mm->root, __ATOMIC_ACQUIRE) == NULL)
+    {
+        pthread_mutex_lock(&mm->rootLock);
+        if (mm->root == NULL)
+        {
+            __atomic_store_n(&mm->root, alloc_node(mm, /* isLeaf */ 1),
+                             __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&mm->rootLock);
+    }
+
+    bp_node *leaf = descendLink(mm, key, 0, path, &depth);
+    latchNode(leaf, 1);
+    leaf = moveRight(leaf, key, 1);
+
+    bp_node *target = leaf;
+    int pos = lower_bound(leaf, key);
+    if (!(pos < leaf->nKeys && leaf->keys[pos] == key))
+    {
+        if (node_full(mm, leaf))
+        {
+            younger = splitInTwo(mm, leaf, &sep);
+            if (key >= sep)
+            {
+                target = younger;
+            }
+            pos = lower_bound(target, key);
+        }
+        insertInLeaf(mm, target, pos, key);
+    }
+    kNode_add(&mm->values, &target->kNodes[pos], value);
+    unlatchNode(leaf);
+
+    if (younger != NULL)
+    {
+        addSeparator(mm, path, depth, leaf, sep, younger);
+    }
+}
+
+
+/* Takes the key out of its leaf once it has no values left, and that's all. */
+int remove_link(multimap *mm, int key, int value, int wholeKey)
+{
+    key_node emptied;
+    int removed = 0;
+
+    bp_node *leaf = descendLink(mm, key, 0, NULL, NULL);
+    if (leaf == NULL)
+    {
+        return 0;
+    }
+    latchNode(leaf, 1);
+    leaf = moveRight(leaf, key, 1);
+
+    int pos = lower_bound(leaf, key);
+    if (!(pos < leaf->nKeys && leaf->keys[pos] == key))
+    {
+        unlatchNode(leaf);
+        return 0;
+    }
+    key_node *kNodePtr = &leaf->kNodes[pos];
+    removed = wholeKey ? kNodePtr->nVals :
+                         kNode_remove(&mm->values, kNodePtr, value);
+    if (kNodePtr->nVals > 0 && !wholeKey)
+    {
+        unlatchNode(leaf);
+        return removed;
+    }
+    removeFromLeaf(leaf, pos, &emptied);
+    unlatchNode(leaf);
+    kNode_free(&mm->values, &emptied);
+    return removed;
+}
+
+
+int contains_link(multimap *mm, int key, int value, int checkValue)
+{
+    bp_node *leaf = descendLink(mm, key, 0, NULL, NULL);
+    if (leaf == NULL)
+    {
+        return 0;
+    }
+    latchNode(leaf, 0);
+    leaf = moveRight(leaf, key, 0);
+
+    int pos = lower_bound(leaf, key);
+    int found = pos < leaf->nKeys && leaf->keys[pos] == key &&
+                (!checkValue || kNode_contains(&leaf->kNodes[pos], value));
+    unlatchNode(leaf);
+    return found;
+}
+
+
+/* Adds the specified (key, value) pair to the multimap. */
+void mm_add_value(multimap *mm, int key, int value)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        add_value_link(mm, key, value);
+        return;
+    }
+    lockTree(mm, 1);
+
+    /* Look up the key node with the specified key.  Create if not found. */
+    key_node *kNodePtr = find_node(mm, key, /* create */ 1, NULL);
+
+    assert(kNodePtr != NULL);
+
+    kNode_add(&mm->values, kNodePtr, value);
+    unlockTree(mm);
+}
+
+
+/* Builds the tree bottom up when it is empty, see README point 6. */
+void mm_bulk_load(multimap *mm, const int *keys, const int *vals, size_t n)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->root != NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            mm_add_value(mm, keys[i], vals[i]);
+        }
+        return;
+    }
+
+    mm_pair *pairs = malloc(sizeof(mm_pair) * (n + 1));
+    for (size_t i = 0; i < n; i++)
+    {
+        pairs[i].key = keys[i];
+        pairs[i].value = vals[i];
+    }
+    if (!pairs_sorted(pairs, n))
+    {
+        sort_pairs(pairs, n);
+    }
+    bulk_build(mm, pairs, n);
+    free(pairs);
+}
+
+
+/*
+ * Only the sort is done by many threads here: the levels of a B+ tree are
+ * built as in mm_bulk_load, which is one pass over the sorted pairs.
+ */
+void mm_bulk_load_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                           int nthreads)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->root != NULL)
+    {
+        mm_add_values(mm, pairs, n);
+        return;
+    }
+
+    mm_pair *sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+    {
+        sort_pairs_parallel(sorted, n, nthreads);
+    }
+    bulk_build(mm, sorted, n);
+    free(sorted);
+}
+
+
+/*
+ * Works like the one in bTree.c: sort the batch, then insert each key into
+ * the leaf the last one went into, for as long as it belongs there and the
+ * leaf has room, and only go back to the root when it doesn't.
+ */
+void mm_add_values(multimap *mm, const mm_pair *pairs, size_t n)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            add_value_link(mm, pairs[i].key, pairs[i].value);
+        }
+        return;
+    }
+
+    mm_pair *sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+    {
+        sort_pairs(sorted, n);
+    }
+
+    lockTree(mm, 1);
+    leaf_hint hint = { NULL, 0, 0 };
+    size_t first = 0;
+    while (first < n)
+    {
+        int key = sorted[first].key;
+        size_t last = first + 1;
+        while (last < n && sorted[last].key == key)
+        {
+            last++;
+        }
+
+        key_node *kNodePtr;
+        bp_node *leaf = hint.leaf;
+        if (leaf != NULL && !node_full(mm, leaf) &&
+            (!hint.bounded || key < hint.bound))
+        {
+            int pos = lower_bound(leaf, key);
+            if (pos < leaf->nKeys && leaf->keys[pos] == key)
+            {
+                kNodePtr = &leaf->kNodes[pos];
+            }
+            else
+            {
+                kNodePtr = insertInLeaf(mm, leaf, pos, key);
+            }
+        }
+        else
+        {
+            kNodePtr = find_node(mm, key, /* create */ 1, &hint);
+        }
+
+        kNode_add_values(&mm->values, kNodePtr, &sorted[first],
+                         last - first);
+        first = last;
+    }
+    unlockTree(mm);
+    free(sorted);
+}
+
+
+/*
+ * Removes every occurrence of the (key, value) pair from the multimap,
+ * shrinking the values array to fit what is left (and removing the key if
+ * nothing is). Returns how many pairs were removed.
+ */
+int mm_remove_value(multimap *mm, int key, int value)
+{
+    key_node emptied;
+    int removed = 0;
+
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        return remove_link(mm, key, value, /* wholeKey */ 0);
+    }
+    lockTree(mm, 1);
+    key_node *kNodePtr = find_node(mm, key, /* create */ 0, NULL);
+    if (kNodePtr != NULL)
+    {
+        removed = kNode_remove(&mm->values, kNodePtr, value);
+        if (kNodePtr->nVals == 0)
+        {
+            removeKey(mm, key, &emptied);
+            kNode_free(&mm->values, &emptied);
+        }
+    }
+    unlockTree(mm);
+    return removed;
+}
+
+
+/*
+ * Removes a key and all of its values from the multimap, returning how
+ * many values it had (zero if the key wasn't there).
+ */
+int mm_remove_key(multimap *mm, int key)
+{
+    key_node removed;
+
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        return remove_link(mm, key, 0, /* wholeKey */ 1);
+    }
+
+    /* don't rebalance anything on the way down for a key that isn't there */
+    lockTree(mm, 1);
+    if (find_node(mm, key, /* create */ 0, NULL) == NULL)
+    {
+        unlockTree(mm);
+        return 0;
+    }
+    removeKey(mm, key, &removed);
+    unlockTree(mm);
+    kNode_free(&mm->values, &removed);
+    return removed.nVals;
+}
+
+
+/*
+ * Returns nonzero if the multimap contains the specified key-value, zero
+ * otherwise.
+ */
+int mm_contains_key(multimap *mm, int key) {
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        return contains_link(mm, key, 0, /* checkValue */ 0);
+    }
+    lockTree(mm, 0);
+    int found = find_node(mm, key, /* create */ 0, NULL) != NULL;
+    unlockTree(mm);
+    return found;
+}
+
+
+/*
+ * Returns nonzero if the multimap contains the specified (key, value) pair,
+ * zero otherwise.
+ */
+int mm_contains_pair(multimap *mm, int key, int value)
+{
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        return contains_link(mm, key, value, /* checkValue */ 1);
+    }
+    lockTree(mm, 0);
+    key_node *kNodePtr = find_node(mm, key, /* create */ 0, NULL);
+    int found = kNodePtr != NULL && kNode_contains(kNodePtr, value);
+    unlockTree(mm);
+    return found;
+}
+
+
+/*
+ * The same interleaving of lookups as in bTree.c. Every lookup goes all the
+ * way down to a leaf here, so they only differ in how long their values
+ * take to scan.
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+                       int *out, size_t n)
+{
+    probe_state group[PROBE_GROUP];
+    size_t next = 0;
+    int inFlight = 0;
+
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = contains_link(mm, keys[i], vals[i], /* checkValue */ 1);
+        }
+        return;
+    }
+    lockTree(mm, 0);
+    if (mm->root == NULL)
+    {
+        unlockTree(mm);
+        memset(out, 0, sizeof(int) * n);
+        return;
+    }
+    for (int g = 0; g < PROBE_GROUP; g++)
+    {
+        group[g].stage = PROBE_IDLE;
+    }
+
+    do
+    {
+        for (int g = 0; g < PROBE_GROUP; g++)
+        {
+            probe_state *probe = &group[g];
+            switch (probe->stage)
+            {
+            case PROBE_IDLE:
+                if (next < n)
+                {
+                    probe->stage = PROBE_NODE;
+                    probe->index = next++;
+                    probe->node = mm->root;
+                    inFlight++;
+                }
+                break;
+
+            case PROBE_NODE:
+            {
+                bp_node *node = probe->node;
+                int key = keys[probe->index];
+
+                if (!(node->isLeaf))
+                {
+                    probe->node = node->kids[upper_bound(node, key)];
+                    prefetch_node(probe->node);
+                    break;
+                }
+
+                int pos = lower_bound(node, key);
+                if (pos < node->nKeys && node->keys[pos] == key)
+                {
+                    probe->kNode = &node->kNodes[pos];
+                    __builtin_prefetch(probe->kNode);
+                    probe->stage = PROBE_KNODE;
+                }
+                else
+                {
+                    out[probe->index] = 0;
+                    probe->stage = PROBE_IDLE;
+                    inFlight--;
+                }
+                break;
+            }
+
+            case PROBE_KNODE:
+            {
+                kNode_prefetch(probe->kNode, vals[probe->index],
+                               PREFETCH_LINES * LINE_SIZE);
+                probe->stage = PROBE_VALUES;
+                break;
+            }
+
+            case PROBE_VALUES:
+                out[probe->index] = kNode_contains(probe->kNode,
+                                                   vals[probe->index]);
+                probe->stage = PROBE_IDLE;
+                inFlight--;
+                break;
+            }
+        }
+    } while (inFlight > 0 || next < n);
+    unlockTree(mm);
+}
+
+
+/*
+ * Performs an in-order traversal of the multimap, passing each (key, value)
+ * pair to the specified function. This is just a walk along the leaf list.
+ */
+void mm_traverse(multimap *mm, void (*f)(int key, int value))
+{
+    for (bp_node *leaf = first_leaf(mm); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->nKeys; i++)
+        {
+            value_iter values;
+            int value;
+
+            values_begin(&values, &leaf->kNodes[i]);
+            while (values_next(&values, &value))
+            {
+                f(leaf->keys[i], value);
+            }
+        }
+    }
+}
+
+
+/* The same leaf walk as mm_traverse, stopping when f returns nonzero. */
+void mm_traverse_ex(multimap *mm, int (*f)(void *ctx, int key, int value),
+                    void *ctx)
+{
+    for (bp_node *leaf = first_leaf(mm); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->nKeys; i++)
+        {
+            value_iter values;
+            int value;
+
+            values_begin(&values, &leaf->kNodes[i]);
+            while (values_next(&values, &value))
+            {
+                if (f(ctx, leaf->keys[i], value))
+                {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+
+/* Hands over each key's values array as it is, or unpacked, as in bTree.c. */
+void mm_traverse_values(multimap *mm,
+                        int (*f)(void *ctx, int key, const int *values,
+                                 int nVals),
+                        void *ctx)
+{
+    multimap_value *buffer = NULL;
+
+    for (bp_node *leaf = first_leaf(mm); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->nKeys; i++)
+        {
+            key_node *kNodePtr = &leaf->kNodes[i];
+            if (f(ctx, leaf->keys[i], kNode_values(kNodePtr, &buffer),
+                  kNodePtr->nVals))
+            {
+                free(buffer);
+                return;
+            }
+        }
+    }
+    free(buffer);
+}
+
+
+/*
+ * Passes each (key, value) pair with lo <= key < hi to f, in order: one
+ * descent to the leaf holding lo, then along the leaf list until hi.
+ */
+void mm_range(multimap *mm, int lo, int hi,
+              int (*f)(void *ctx, int key, int value), void *ctx)
+{
+    mm_cursor cursor;
+    int key, value;
+
+    cursor_seek(&cursor, mm, lo);
+    while (mm_cursor_next(&cursor, &key, &value) && key < hi)
+    {
+        if (f(ctx, key, value))
+        {
+            break;
+        }
+    }
+}
+
+
+/* Returns a cursor positioned just before the first key >= key. */
+mm_cursor * mm_cursor_seek(multimap *mm, int key)
+{
+    mm_cursor *cursor = malloc(sizeof(mm_cursor));
+    cursor_seek(cursor, mm, key);
+    return cursor;
+}
+
+
+/* Hands out the next pair, moving on to the next key or leaf when needed. */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value)
+{
+    while (cursor->leaf != NULL)
+    {
+        if (cursor->pos >= cursor->leaf->nKeys)
+        {
+            cursor->leaf = cursor->leaf->next;
+            cursor->pos = 0;
+        }
+        else if (cursor->values.kNode == NULL)
+        {
+            values_begin(&cursor->values, &cursor->leaf->kNodes[cursor->pos]);
+        }
+        else if (values_next(&cursor->values, value))
+        {
+            *key = cursor->leaf->keys[cursor->pos];
+            return 1;
+        }
+        else
+        {
+            cursor->pos++;
+            cursor->values.kNode = NULL;
+        }
+    }
+    return 0;
+}
+
+
+void mm_cursor_free(mm_cursor *cursor)
+{
+    free(cursor);
+}
+
+
+/*
+ * The nodes of a B+ tree are linked to their neighbours on every level (and
+ * leaves are chained for cursors), so sharing a subtree would mean copying
+ * all the nodes to the left of any change too. A snapshot is a copy of the
+ * whole tree instead, node for node, in an arena of its own worked out from
+ * the same node size. The values are shared with the multimap, though (see
+ * kNode_share), until a change to a key gives it values of its own.
+ */
+multimap * mm_snapshot(multimap *mm)
+{
+    mm_config config = { mm->nodeBytes, 0, mm->nodes.backing, 0 };
+    bp_node *last[MAX_DEPTH] = { NULL };
+
+    if (mm->concurrent)
+    {
+        return NULL;
+    }
+    multimap *snap = init_multimap_with_config(&config);
+    snap->origin = (mm->origin != NULL) ? mm->origin : mm;
+    snap->fillLeafKeys = mm->fillLeafKeys;
+    snap->fillInnerKeys = mm->fillInnerKeys;
+    if (mm->root != NULL)
+    {
+        snap->root = copy_subtree(snap, mm->root, 0, last);
+    }
+    return snap;
+}
+
+
+/*
+ * A depth first walk meets the nodes of each level from left to right, so
+ * each copy is the next one after the last copy made at its depth.
+ */
+bp_node * copy_subtree(multimap *mm, bp_node *node, int depth,
+                       bp_node **last)
+{
+    bp_node *copy = alloc_node(mm, node->isLeaf);
+
+    copy->nKeys = node->nKeys;
+    copy->level = node->level;
+    copy->bounded = node->bounded;
+    copy->highKey = node->highKey;
+    memcpy(copy->keys, node->keys, sizeof(int) * node->nKeys);
+    if (node->isLeaf)
+    {
+        memcpy(copy->kNodes, node->kNodes, sizeof(key_node) * node->nKeys);
+        for (int i = 0; i < node->nKeys; i++)
+        {
+            kNode_share(&mm->origin->values, &copy->kNodes[i]);
+        }
+    }
+    else
+    {
+        for (int i = 0; i <= node->nKeys; i++)
+        {
+            copy->kids[i] = copy_subtree(mm, node->kids[i], depth + 1, last);
+        }
+    }
+    if (last[depth] != NULL)
+    {
+        last[depth]->next = copy;
+    }
+    last[depth] = copy;
+    return copy;
+}
+
+
+/*
+ * Trims every key's values array down to the block its values need, and
+ * hands the blocks this thread has cached back to the pool. A snapshot's
+ * values aren't its own to change.
+ */
+void mm_shrink_to_fit(multimap *mm)
+{
+    if (mm->origin != NULL)
+    {
+        return;
+    }
+    for (bp_node *leaf = first_leaf(mm); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->nKeys; i++)
+        {
+            kNode_shrink(&mm->values, &leaf->kNodes[i]);
+        }
+    }
+    pool_flush(&mm->values);
+}
+
+
+/* Counts the allocator calls for values made so far by this thread, for
+ * every multimap.
+ */
+void mm_get_alloc_stats(mm_alloc_stats *stats)
+{
+    *stats = value_stats;
+}
+
+
+/* Prints how this multimap is built, for the performance tests. */
+void mm_print_info(multimap *mm)
+{
+    printf("Multimap:  b+ tree, %d keys per leaf, %d per internal node "
+           "(%d bytes), %s%s.\n", mm->leafKeys, mm->innerKeys,
+           (int) mm->nodeBytes, pages_name(mm->nodes.backing),
+           (mm->concurrent == MM_CONCURRENT_BLINK) ? ", B-link" :
+           mm->concurrent ? ", one lock" : "");
+}
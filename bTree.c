@@ -1,9 +1,55 @@
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "multimap.h"
+#include "mmsort.h"
+#include "mmvalues.h"
+#include "mmarena.h"
+#include "mmepoch.h"
+
+/*
+ * SEARCH_SIMD selects how searchInNode scans a node. When it is 1 (the
+ * default), the scan is vectorized with SSE4.2 or AVX2, picked at runtime
+ * from whatever the CPU supports, falling back to the plain scalar loop.
+ * Build with -DSEARCH_SIMD=0 to always use the scalar loop (this is what
+ * the bTreePerfScalar target does, for comparison).
+ */
+#ifndef SEARCH_SIMD
+#define SEARCH_SIMD (1)
+#endif
+
+/*
+ * SEARCH_STRATEGY selects, at compile time, how searchInNode finds a key
+ * within a node:
+ *   SEARCH_LINEAR     scan keys left to right (vectorized, see above)
+ *   SEARCH_BINARY     branchless binary search over the sorted keys
+ *   SEARCH_EYTZINGER  binary search over a copy of the keys stored in
+ *                     Eytzinger (breadth-first) order, prefetching the
+ *                     cache line holding the next few levels as it goes
+ * Which one is fastest depends on the node size and the cache hierarchy,
+ * so "make searchperf" runs bTreePerf for each of them over a few node
+ * sizes.
+ */
+#define SEARCH_LINEAR (0)
+#define SEARCH_BINARY (1)
+#define SEARCH_EYTZINGER (2)
+
+#ifndef SEARCH_STRATEGY
+#define SEARCH_STRATEGY SEARCH_LINEAR
+#endif
+
+#if SEARCH_SIMD && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD (1)
+#else
+#define HAVE_X86_SIMD (0)
+#endif
 
 
 /*============================================================================
@@ -11,11 +57,14 @@ README:
     Just some important notes about data structure implementations and common
     coding motifs in these implementations:
         1) Multimap representation --- To improve locality of access, the
-            multimap is implemented as a b-tree with a max of MAX_KEYS keys
-            per node. It is a general b-tree, where by changing the #define
-            for MAX_KEYS, one can change the b-tree (making this value 2
-            makes a 2-3 b tree, while making this value 1 or less just breaks
-            everything, so plz don't break my tree???)
+            multimap is implemented as a b-tree with a max of mm->maxKeys
+            keys per node. It is a general b-tree, where maxKeys is worked
+            out from the node size (in bytes) the multimap was created with,
+            see init_multimap_with_config; init_multimap uses nodes that
+            hold MAX_KEYS keys. maxKeys is never less than MIN_KEYS, since
+            splitting a node that can only hold 2 keys leaves an empty half
+            (and 1 or less just breaks everything, so plz don't break my
+            tree???)
         2) More on structs --- To implement this tree, there are many levels
             of wrappers. Here they are, in order of highest to lowest level.
 
@@ -26,8 +75,8 @@ README:
                             child, root         how many key_nodes are in it
                                                 an array of its key nodes
                                                 an array of pointers to kids
-        c)  key_node        kNode               the key, the number of vals
-                                                associated with the key,
+        c)  key_node        kNode               the number of vals
+                                                associated with a key,
                                                 pointer to the array of vals
         d)  multimap_value  value               literally an int
             
@@ -76,6 +125,11 @@ README:
                                 | NULL       | NULL         | NULL         |
                                 --------------------------------------------
 
+            (The keys themselves are stored in a separate dense array,
+            node->keys, with node->keys[i] being the key of kNodes[i]; they
+            are drawn inside the key_nodes above just for readability. See
+            point 4.)
+
             Here, you see a simple 2-3 tree that addresses some important
             points. In general, one can view the key_nodes as being within
             the node, and the pointers to children as being along the
@@ -91,7 +145,7 @@ README:
             too many key_nodes, then another split would happen, and
             would recursively travel up the tree, perhaps making a new root
             and extending the depth if necessary. 
-            Since we don't have room for more than MAX_KEYS key nodes, instead
+            Since we don't have room for more than maxKeys key nodes, instead
             we proactively split nodes, using the nifty splitNodes function.
             Essentially, as we travel down the tree, if the next node we 
             are to visit ever is full, before visiting it, we split it, and 
@@ -105,6 +159,43 @@ README:
             into a leaf node, one simply pushes the key nodes greater than
             the new insert one place to the right (there is guaranteed to be
             room for this), and adds the new key_node.
+            Removal is the mirror image. A node that is not the root
+            must hold at least minKeys key_nodes, minKeys being the size of
+            the smaller half of a split, (maxKeys - 1) / 2. Instead of
+            fixing underfull nodes on the way back up, we proactively make
+            sure every node we step into has more than minKeys key_nodes,
+            so it can lose one without underflowing: if it doesn't, it
+            borrows one from a sibling with some to spare (rotating a key
+            through the parent), and if neither sibling has any to spare it
+            is merged with a sibling and the key between them in the
+            parent (the opposite of splitNode). Removing a key from an
+            internal node swaps in its predecessor (or successor) from a
+            leaf, or merges the two kids around it and carries on below.
+            When the root ends up with no keys, its only kid becomes the
+            root, which is the only way the tree gets shorter.
+        4)  Node layout --- The keys of a node are kept in their own dense
+            int array rather than inside the key_nodes (a "structure of
+            arrays" layout). Searching a node only ever looks at keys, so
+            this way a 64 byte cache line holds 16 keys instead of 4, and the
+            vectorized searches can load keys straight from memory. The
+            key_nodes (value metadata) are only touched once the right key
+            has been found. Anything that moves key_nodes around (splitting,
+            inserting) has to move the matching keys along with them.
+            All the arrays of a node live in one allocation: the mm_node
+            header ends with the flexible array member keys[], sized for
+            maxKeys keys, and is followed by kNodes, kids (and the
+            Eytzinger arrays, if used), which the header points to. So a
+            node is a single block of mm->nodeBytes bytes.
+        5)  Bulk loading --- mm_bulk_load builds a tree from sorted pairs
+            without any searching or splitting, one level at a time from
+            the bottom up. The sorted keys are dealt out left to right:
+            mm->fillKeys of them into a leaf, then one that is set aside
+            to go between that leaf and the next in their parent, then the
+            next leaf, and so on. The keys set aside are then dealt out the
+            same way into the level above, with the leaves as their kids,
+            and so on up until a level is just one node, the root. The
+            keys are spread evenly over the nodes of a level, so that the
+            last node is never left underfull.
  *============================================================================*/
 
 
@@ -117,32 +208,141 @@ README:
  *   programs are generic and don't have any access to implementation details.
  *============================================================================*/
 
-#define MAX_KEYS (500) /* How many key_nodes fit in a node, 50 is arbitrary */
-#define LINE_SIZE (64) /* the size of a cache line in bytes */
-
-typedef int multimap_value; /* just for readability */
-
-typedef struct key_node /* see README */
-{
-    int key;
-    int nVals; 
-    multimap_value *values;
-} key_node;
+#ifndef MAX_KEYS
+#define MAX_KEYS (500) /* default key_nodes per node, 500 is arbitrary */
+#endif
+#define MIN_KEYS (3) /* the smallest node that still splits properly */
+#define LIMIT_KEYS (65535) /* the largest, so indices fit in a short */
 
 typedef struct mm_node  /* see README */
 {
     int isLeaf;     /* is this a leaf */
     int nKeys;    /*  many keys does this node contain? */
-    key_node kNodes[MAX_KEYS];
-    struct mm_node *kids[MAX_KEYS + 1];  /* kids[i] has keys < kNodes[i].key */
+    key_node *kNodes;  /* maxKeys of them, kNodes[i] holds keys[i]'s values */
+    struct mm_node **kids;  /* maxKeys + 1 of them, kids[i] has keys < keys[i] */
+    pthread_rwlock_t latch; /* only used by concurrent multimaps (latchNode) */
+    uint64_t version;       /* ... and by optimistic ones (readVersion) */
+    int shared;   /* how many more trees than one hold it (see ownNode) */
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+    /* 
+     * The keys again, in Eytzinger order (1-based, eytz[0] unused), and for
+     * each of those the index it has in keys. Rebuilt by reindex_node.
+     */
+    int *eytz;
+    unsigned short *eytzRank;
+#endif
+    int keys[];  /* maxKeys sorted keys, followed by the arrays above */
 } mm_node;
 
+/* 
+ * How deep a tree can get. Every node other than the root has at least 2
+ * kids, so a tree this deep would need more than 2^63 keys.
+ */
+#define MAX_DEPTH (64)
+
+/* 
+ * A position in the tree, for in-order walks (see cursor_next_key). The
+ * path holds the nodes from the root down to where the walk is, and for
+ * each of them the index of the key to hand out next once everything to
+ * its left has been visited.
+ */
+struct mm_cursor
+{
+    int depth;                   /* how many entries of the path are used */
+    mm_node *path[MAX_DEPTH];
+    int index[MAX_DEPTH];
+    int key;                     /* the key whose values are being visited */
+    key_node *kNode;             /* its key_node, NULL before the first one */
+    value_iter values;           /* how far through its values it is */
+};
+
+/*
+ * Where the last key of a batch (see mm_add_values) was inserted: the leaf
+ * it went into, and the smallest key above it on the way down, which every
+ * key in that leaf is less than. A later, larger key that is still less
+ * than bound belongs in the same leaf, and can go straight there.
+ */
+typedef struct leaf_hint
+{
+    mm_node *leaf;    /* NULL if the key was found in an internal node */
+    int bounded;      /* zero if the leaf is the rightmost one */
+    int bound;
+} leaf_hint;
+
+#define PROBE_GROUP (16) /* how many lookups mm_contains_pairs interleaves */
+#define PREFETCH_LINES (4) /* how much of a node to prefetch ahead of a search */
+
+/* 
+ * One of the lookups mm_contains_pairs has in flight, and what it is
+ * waiting for to arrive in the cache before it can take its next step.
+ */
+typedef struct probe_state
+{
+    enum { PROBE_IDLE, PROBE_NODE, PROBE_KNODE, PROBE_VALUES } stage;
+    size_t index;       /* which of the pairs this is */
+    mm_node *node;      /* PROBE_NODE: the node to search next */
+    key_node *kNode;    /* PROBE_KNODE, PROBE_VALUES: the key's key_node */
+} probe_state;
+
+#define PARALLEL_BUILD (1 << 15) /* the fewest pairs worth a build thread */
+#define PARALLEL_NODES (256) /* the narrowest level built by many threads */
+
+/*
+ * One thread's part of a level of bulk_build_parallel (or, for count_keys,
+ * of the pairs): the nodes from first up to last. Their memory has already
+ * been taken from the arena. A level of width nodes shares slots slots
+ * between them the same way bulk_build does, taking its keys from pairs
+ * (leaves) or from the level below, and setting one aside after each node
+ * but the last.
+ */
+typedef struct build_share
+{
+    multimap *mm;
+    const mm_pair *pairs;
+    size_t n;
+    size_t next;       /* leaves: where to look for the first key from */
+    size_t skip;       /* ... and how many keys after that it is */
+    size_t first, last;
+    size_t slots, width;
+    mm_node **nodes;   /* the level being built, and what it sets aside */
+    int *sepKeys;
+    key_node *sepKNodes;
+    mm_node **kids;    /* the level below, and what it set aside */
+    int *kidKeys;
+    key_node *kidKNodes;
+    size_t keys;       /* count_keys: how many keys start in its pairs */
+} build_share;
+
 /* The entry-point of the multimap data structure. */
 struct multimap 
 {
     mm_node *root;
+    int maxKeys;       /* how many key_nodes fit in a node of this tree */
+    int minKeys;       /* how few a node other than the root may have */
+    int fillKeys;      /* how many mm_bulk_load puts in a node (README 5) */
+    size_t nodeBytes;  /* the size of one node, header and arrays included */
+    node_arena nodes;  /* where its nodes come from (see mmarena.h) */
+    value_pool values; /* ... and its values arrays (see mmvalues.h) */
+    int concurrent;    /* MM_CONCURRENT_*, or zero */
+    pthread_rwlock_t rootLatch;  /* guards root itself, with latches */
+    uint64_t rootVersion;        /* ... and when optimistic */
+    pthread_mutex_t nodesLock;   /* guards nodes, when concurrent */
+    epoch_domain *epoch;         /* what optimistic operations let go of */
+    multimap *origin;  /* a snapshot's multimap, whose nodes it shares */
+    int snapshots;     /* how many snapshots share this one's nodes */
 };
 
+/* How latchNode latches a node. */
+#define LATCH_SHARED (0)
+#define LATCH_EXCLUSIVE (1)
+
+/* The low bits of a version (see readVersion), and how long to spin on a
+ * locked one before letting other threads run.
+ */
+#define VERSION_OBSOLETE (1)
+#define VERSION_LOCKED (2)
+#define VERSION_SPINS (64)
+
 
 
 /*============================================================================
@@ -152,37 +352,208 @@ struct multimap
  *   these are not visible outside of this module.
  *============================================================================*/
 
+/* the size of a node that holds maxKeys keys, and where its arrays start */
+size_t node_layout(int maxKeys, size_t *kNodesOff, size_t *kidsOff,
+                   size_t *eytzOff, size_t *rankOff);
+
+/* just the size part of node_layout */
+size_t node_size_for(int maxKeys);
+
 /* allocate a single mm_node */
-mm_node * alloc_node();
+mm_node * alloc_node(multimap *mm);
+
+/* the two halves of alloc_node: take the memory, then set it up */
+mm_node * raw_node(multimap *mm);
+void init_node(multimap *mm, mm_node *node);
+
+/* give a node that is no longer in the tree back to the arena */
+void release_node(multimap *mm, mm_node *node);
+
+/* what release_node does, once no optimistic operation can still see it */
+void recycleNode(void *ctx, void *node, size_t bytes);
+
+/* bracket every operation on an optimistic multimap (no-ops otherwise) */
+void enterOptimistic(multimap *mm);
+void exitOptimistic(multimap *mm);
+
+/*
+ * make *link (the root, or a kid of a node of this tree's own) a node of
+ * this tree's own, copying it if it is shared with a snapshot, and return it
+ */
+mm_node * ownNode(multimap *mm, mm_node **link);
+
+/* let go of a node that may be shared, freeing it if nothing else has it */
+void dropNode(multimap *mm, mm_node *node);
+
+/* latch and unlatch a node of a concurrent multimap (no-ops otherwise) */
+void latchNode(multimap *mm, mm_node *node, int mode);
+void unlatchNode(multimap *mm, mm_node *node);
+
+/* the same for the root pointer, always exclusive */
+void latchRoot(multimap *mm);
+void unlatchRoot(multimap *mm);
+
+/* the version counters of optimistic multimaps */
+uint64_t readVersion(const uint64_t *version);
+int checkVersion(const uint64_t *version, uint64_t seen);
+int upgradeVersion(uint64_t *version, uint64_t seen);
+void lockVersion(uint64_t *version);
+void unlockVersion(uint64_t *version);
+
+/*
+ * the fields of a node that optimistic lookups read while it is changing,
+ * and how changes write them (see moveKeys): memmove-like, with a NULL
+ * from clearing n entries instead
+ */
+void moveKeys(multimap *mm, int *to, const int *from, int n);
+void moveKNodes(multimap *mm, key_node *to, const key_node *from, int n);
+void moveKids(multimap *mm, mm_node **to, mm_node *const *from, int n);
+void setNKeys(mm_node *node, int nKeys);
+
+/* the reading side of those, for optimistic lookups */
+int searchOptimistic(mm_node *node, int key, int *match);
+void loadKNode(key_node *to, const key_node *from);
+void storeKNode(key_node *to, const key_node *from);
 
 /* find the index of the first kNode with key > the argument key */
 int searchInNode(mm_node *node, int key);
 
+/* the different implementations searchInNode can dispatch to */
+int searchInNodeScalar(mm_node *node, int key);
+#if HAVE_X86_SIMD
+int searchInNodeSSE(mm_node *node, int key);
+int searchInNodeAVX2(mm_node *node, int key);
+#endif
+int searchInNodeBinary(mm_node *node, int key);
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+int searchInNodeEytzinger(mm_node *node, int key);
+#endif
+
+/* 
+ * must be called whenever the keys of a node change, to keep any extra
+ * search structure (the Eytzinger copy of the keys) up to date
+ */
+void reindex_node(mm_node *node);
+
+/* picks the fastest searchInNode implementation this CPU can run */
+void select_search_impl();
+
 /* 
  * given a parent and the pos (which allows finding the child), will split
  * child into two separate nodes, and patch up parent to point to both this
  * child and the newly created splitoff of child
  */
-void splitNode(mm_node *parent, int pos);
+void splitNode(multimap *mm, mm_node *parent, int pos);
 
 /*
  * will recursively search through a tree, splitting nodes as it goes along
  * if an insert is requested, and will either find the kNode searched for,
- * or insert this new kNode in the appropriate place
+ * or insert this new kNode in the appropriate place; if hint isn't NULL,
+ * it is filled in with where that was
+ */
+key_node * searchAndInsert(multimap *mm, mm_node *node, int key,
+                           int create_if_not_found, leaf_hint *hint);
+
+/* add a new, empty key_node for key at pos in a leaf that has room */
+key_node * insertInLeaf(multimap *mm, mm_node *node, int pos, int key);
+
+/*
+ * does the same thing as find_mm_node in mm_impl.c, filling in hint (if it
+ * isn't NULL) like searchAndInsert
+ */
+key_node * find_node(multimap *mm, int key, int create_if_not_found,
+                     leaf_hint *hint);
+
+/*
+ * the removal counterparts of splitNode: make sure parent->kids[pos] has
+ * more than minKeys key_nodes, by borrowing from a sibling or merging with
+ * one, and return where that kid (or what it was merged into) now is
+ */
+int fixChild(multimap *mm, mm_node *parent, int pos);
+void borrowFromLeft(multimap *mm, mm_node *parent, int pos);
+void borrowFromRight(multimap *mm, mm_node *parent, int pos);
+void mergeNodes(multimap *mm, mm_node *parent, int pos);
+
+/*
+ * remove the largest (or smallest) key of a subtree whose root has more
+ * than minKeys key_nodes, putting it and its key_node at to's slot pos
+ */
+void takeMax(multimap *mm, mm_node *node, mm_node *to, int pos);
+void takeMin(multimap *mm, mm_node *node, mm_node *to, int pos);
+
+/*
+ * removes key (and its key_node, which is copied to removed) from the
+ * tree, rebalancing on the way down; returns zero if it wasn't there (or
+ * if onlyIfEmpty is set and the key still has values)
+ */
+int removeKey(multimap *mm, int key, key_node *removed, int onlyIfEmpty);
+
+/* find_node for concurrent multimaps, leaving the found node latched */
+key_node * find_node_latched(multimap *mm, int key, int mode,
+                             int create_if_not_found, mm_node **held);
+
+/* mm_remove_value for concurrent multimaps */
+int remove_value_latched(multimap *mm, int key, int value);
+
+/*
+ * find_node for optimistic multimaps, leaving the found node locked, and
+ * one try at it, which returns zero if it has to start over
+ */
+key_node * find_node_optimistic(multimap *mm, int key,
+                                int create_if_not_found, mm_node **held);
+int descend_optimistic(multimap *mm, int key, int create_if_not_found,
+                       mm_node **held, key_node **found);
+
+/*
+ * mm_contains_key (checkValue zero) and mm_contains_pair for optimistic
+ * multimaps, and one try at them, which returns zero if it has to start
+ * over
+ */
+int contains_optimistic(multimap *mm, int key, int value, int checkValue);
+int probe_optimistic(multimap *mm, int key, int value, int checkValue,
+                     int *result);
+
+/* position a cursor just before the first key >= key */
+void cursor_seek(mm_cursor *cursor, multimap *mm, int key);
+
+/* step a cursor to its next key, returning zero if there isn't one */
+int cursor_next_key(mm_cursor *cursor);
+
+/*
+ * how many nodes a level of a bulk loaded tree is made of, given how many
+ * slots (keys plus the kids or separators between them) it must hold and
+ * how many slots there should be, and at most can be, in a node
  */
-key_node * searchAndInsert(mm_node *node, int key, int create_if_not_found);
+size_t level_width(size_t slots, int fillSlots, int maxSlots);
+
+/* hands out the next key of the sorted pairs, with all of its values */
+void take_key(multimap *mm, const mm_pair *pairs, size_t n, size_t *next,
+              int *key, key_node *kNode);
 
-/* does the same thing as find_mm_node in mm_impl.c */
-key_node * find_node(multimap *mm, int key, int create_if_not_found);
+/* builds the tree from n pairs sorted by key, see README point 5 */
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n);
 
-/* free's an entire subtree starting at node */
-void free_multimap_node(mm_node *node);
+/* the same, with nthreads threads building each level */
+void bulk_build_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                         int nthreads);
+
+/* the work of one thread of bulk_build_parallel (see build_share) */
+void * count_keys(void *arg);
+void * build_leaves(void *arg);
+void * build_level(void *arg);
+
+/* free's the values of an entire subtree starting at node */
+void free_multimap_values(multimap *mm, mm_node *node);
+
+/* start loading the start of a node (header and first keys) into cache */
+void prefetch_node(mm_node *node);
 
 /* 
  * This is a helper function for mm_traverse_helper that traverses just the
  * values for a single key node.  
  */
-void kNode_traverse(key_node *kNodePtr, void (*f)(int key, int value));
+void kNode_traverse(int key, key_node *kNodePtr,
+                    void (*f)(int key, int value));
 
 
 
@@ -190,273 +561,2230 @@ void kNode_traverse(key_node *kNodePtr, void (*f)(int key, int value));
  * FUNCTION IMPLEMENTATIONS
  *============================================================================*/
 
+/*
+ * Works out how big a node holding maxKeys keys is, and the offsets (from
+ * the start of the node) of each array that follows the header. keys[] is
+ * padded out to a multiple of 8 bytes, so that the pointer-holding arrays
+ * after it stay aligned.
+ */
+size_t node_layout(int maxKeys, size_t *kNodesOff, size_t *kidsOff,
+                   size_t *eytzOff, size_t *rankOff)
+{
+    size_t size = sizeof(mm_node) + sizeof(int) * ((maxKeys + 1) & ~1);
+    *kNodesOff = size;
+    size += sizeof(key_node) * maxKeys;
+    *kidsOff = size;
+    size += sizeof(mm_node *) * (maxKeys + 1);
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+    *eytzOff = size;
+    size += sizeof(int) * (maxKeys + 1);
+    *rankOff = size;
+    size += sizeof(unsigned short) * (maxKeys + 1);
+#else
+    *eytzOff = *rankOff = size;
+#endif
+    return size;
+}
+
+
+size_t node_size_for(int maxKeys)
+{
+    size_t kNodesOff, kidsOff, eytzOff, rankOff;
+    return node_layout(maxKeys, &kNodesOff, &kidsOff, &eytzOff, &rankOff);
+}
+
+
 /* 
  * Allocates a multimap node, and zeros out its contents so that we know what
- * the initial value of everything will be. Also, explicitly sets nKeys to be 0.
+ * the initial value of everything will be. Also, explicitly sets nKeys to be
+ * 0, and points the header at the arrays that follow it. The arena is
+ * shared by the threads of a concurrent multimap, and by snapshots, which
+ * may give nodes back to it from threads of their own.
  */
-mm_node * alloc_node()
+mm_node * alloc_node(multimap *mm)
 {    
-    mm_node *node = (mm_node *) malloc(sizeof(mm_node));
-    bzero(node, sizeof(mm_node));
-    node->nKeys = 0;
+    mm_node *node = raw_node(mm);
+    init_node(mm, node);
     return node;
 }
 
 
-/* 
- * Search within a node to find the index of the first key_node with a key
- * greater than the key passed as an argument. If all the keys in a node are
- * less than the query key, will return the node's nKeys. This is useful
- * for figuring out which subtree to look through in a search or insert.
- */
-int searchInNode(mm_node *node, int key)
+mm_node * raw_node(multimap *mm)
 {
-    for (int i = 0; i < node->nKeys; i++)
+    mm_node *node;
+    if (mm->concurrent ||
+        __atomic_load_n(&mm->snapshots, __ATOMIC_ACQUIRE))
     {
-        if (key <= node->kNodes[i].key)
-        {
-            return i;
-        }
+        pthread_mutex_lock(&mm->nodesLock);
+        node = (mm_node *) arena_alloc(&mm->nodes);
+        pthread_mutex_unlock(&mm->nodesLock);
     }
-    return node->nKeys;
+    else
+    {
+        node = (mm_node *) arena_alloc(&mm->nodes);
+    }
+    return node;
 }
 
 
 /*
- * The "key" (haha, see what I did there) to the insert operation. Given a
- * parent node, and the position of the child subtree (an index from 0 to
- * nKeys), will take the middle keyNode of the child, move it to parent,
- * and split the child node with the second half of its kNodes being placed
- * in the new splitoff. Will also add a pointer to the splitoff to parent.
- *
- * Visually (* is empty/NULL, numbers are keys, a line is a level of tree)
- * 
- * original tree:
- *         4      6      *                 -- parent
- *       /     |     |     \
- *     0 1 2   5     *      *              -- children
- *   
- * to add key 3 to this tree, first call splitNode(parent, 0):
- *     step 1, shift things in the parent:
- *        result:
- *           *       4       6                -- parent
- *          /    |       |     \
- *        0 1 2  *       5      *             -- children
- *
- *     step 2, update the keys and kids of the parent: 
- *        result:
- *           1       4       6                -- parent
- *          /    |       |     \
- *        0 1 2 (*)      5      *             -- children, (*) is new, empty kid
- *     step 3, update the newly created "younger" node:
- *        result:
- *           1       4       6                -- parent
- *          /    |       |     \
- *        0 1 2  2       5      *             -- children
- *     step 4, update the "elder" node (0 out useless stuff):
- *        result:
- *           1       4       6                -- parent
- *          /    |       |     \
- *        0      2       5      *             -- children
- * Now, we can add 3:
- * final:
- *        1       4       6                -- parent
- *       /    |       |     \
- *     0     2 3      5      *             -- children
+ * Only touches the node itself, so that bulk_build_parallel can set up
+ * nodes from many threads once raw_node has handed them out.
  */
-void splitNode(mm_node *parent, int pos)
+void init_node(multimap *mm, mm_node *node)
 {
-    mm_node *elder = parent->kids[pos]; /* child to be split */
-    mm_node *younger = alloc_node(); /* child made from split */
-    
-    /* 
-     * Here, we shift the kids pointers and key nodes in the parent down 1,
-     * from the position that the new key (from elder) will be added.
-     * Note that due to proactive splitting, pos will always be
-     * < MAX_KEYS - 1, and since kNodes has length MAX_KEYS, while kids
-     * has length MAX_KEYS + 1, there is never an invalid memory access, and
-     * there is always room for this shift down by 1 operation.
-     * 
-     * Step 1 in the little visual aid above.
-     */
-    memmove(&parent->kNodes[pos + 1], &parent->kNodes[pos], 
-                                    sizeof(key_node) * (parent->nKeys - pos));
-    memmove(&parent->kids[pos + 2], &parent->kids[pos + 1], 
-                                    sizeof(mm_node *) * (parent->nKeys - pos));
-
-    /*
-     * Find where to break off elder, move the kNode there to parent, and
-     * add a pointer to the new child (younger) to the parent after the
-     * new kNode.
-     *
-     * Step 2
-     */
-    int mid = elder->nKeys / 2;
-    parent->kNodes[pos] = elder->kNodes[mid];
-    parent->kids[pos + 1] = younger;
-    parent->nKeys++;
-    assert(!(parent->nKeys > MAX_KEYS));
-    
-    /* 
-     * Move the appropriate key nodes to the younger node, update its other
-     * fields.
-     * 
-     * Step 3
-     */
-    younger->nKeys = elder->nKeys - (mid + 1);
-    memmove(younger->kNodes, &elder->kNodes[mid + 1], 
-                                    sizeof(key_node) * (younger->nKeys));
-    younger->isLeaf = elder->isLeaf;
-    if (!(younger->isLeaf))
-    {
-        memmove(younger->kids, &elder->kids[mid + 1], 
-                                    sizeof(mm_node *) * (younger->nKeys + 1));
-    }
+    size_t kNodesOff, kidsOff, eytzOff, rankOff;
+    node_layout(mm->maxKeys, &kNodesOff, &kidsOff, &eytzOff, &rankOff);
 
-    /*
-     * Update the elder's fields, zeroing out the things moved to younger to
-     * avoid confusion later on
-     *
-     * Step 4
-     */
-    elder->nKeys = mid;
-    bzero(&elder->kNodes[mid], sizeof(key_node) * (younger->nKeys + 1));
-    if (!(elder->isLeaf))
+    bzero(node, mm->nodeBytes);
+    node->nKeys = 0;
+    node->kNodes = (key_node *) ((char *) node + kNodesOff);
+    node->kids = (mm_node **) ((char *) node + kidsOff);
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+    node->eytz = (int *) ((char *) node + eytzOff);
+    node->eytzRank = (unsigned short *) ((char *) node + rankOff);
+#endif
+    if (mm->concurrent == MM_CONCURRENT_LATCHES)
     {
-        bzero(&elder->kids[mid + 1], sizeof(mm_node *) * (younger->nKeys + 1));
+        pthread_rwlock_init(&node->latch, NULL);
     }
 }
 
 
-key_node * searchAndInsert(mm_node *node, int key, int create_if_not_found)
+/*
+ * An optimistic operation may still be reading a node that has just been
+ * taken out of the tree, so it is marked obsolete (which makes the
+ * operation start over) and retired, and only handed out again once every
+ * operation that could have seen it has finished (see mmepoch.h).
+ */
+void release_node(multimap *mm, mm_node *node)
 {
-    /* look for smallest position that key fits below */
-    int pos = searchInNode(node, key);
-
-    if (pos < node->nKeys && node->kNodes[pos].key == key) 
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
     {
-        return &node->kNodes[pos];
-    } 
-    if (node->isLeaf)
+        __atomic_fetch_or(&node->version, VERSION_OBSOLETE, __ATOMIC_RELEASE);
+        epoch_retire(mm->epoch, node, mm->nodeBytes, recycleNode, mm);
+    }
+    else if (mm->concurrent)
     {
-        if (create_if_not_found)
-        {
-            /* should have space cuz proactive splitting */
-            memmove(&node->kNodes[pos + 1], &node->kNodes[pos], 
-                                    sizeof(key_node) * (node->nKeys - pos));
-            bzero(&node->kNodes[pos], sizeof(key_node));
-            node->kNodes[pos].key = key;
-            node->nKeys++;
-            assert(!(node->nKeys > MAX_KEYS));
-            return &node->kNodes[pos];
-        }
-        return NULL;
+        pthread_rwlock_destroy(&node->latch);
+        pthread_mutex_lock(&mm->nodesLock);
+        arena_free(&mm->nodes, node);
+        pthread_mutex_unlock(&mm->nodesLock);
     }
-    mm_node * nextNode = node->kids[pos];
-    if (create_if_not_found)
+    else if (__atomic_load_n(&mm->snapshots, __ATOMIC_ACQUIRE))
     {
-        if (nextNode->nKeys == MAX_KEYS)
-        {
-            splitNode(node, pos);
-            nextNode = node; /* Must re-examine since tree modified */
-        }
+        pthread_mutex_lock(&mm->nodesLock);
+        arena_free(&mm->nodes, node);
+        pthread_mutex_unlock(&mm->nodesLock);
+    }
+    else
+    {
+        arena_free(&mm->nodes, node);
     }
-    return searchAndInsert(nextNode, key, create_if_not_found);
 }
 
 
-/* This helper function searches for the key node that contains the
- * specified key.  If such a node doesn't exist, the function can initialize
- * a new key node and add this into a multimap node, initializing that
- * too if necessary; the function might also simply return NULL.
- * Most of the searching and inserting legwork is done in searchAndInsert,
- * this function primarily handles edge cases involving the root, before
- * calling the helper.
+/*
+ * A snapshot (see mm_snapshot) holds the root of the tree as it was, and
+ * so shares every node with it until the tree changes. A node's shared
+ * count is how many more parents (or roots) than one point at it, and a
+ * node is only ever changed by a tree that has it to itself. So every
+ * change walks down from the root through ownNode, which copies a shared
+ * node, points the link it came through at the copy, and lets go of the
+ * original; the copy's kids are shared by one more node now, and are
+ * copied in turn if the change goes on down to them. The copy shares the
+ * values of its keys too (see kNode_share), until a change to a key gives
+ * it values of its own. A node
+ * that was never shared is used as it is, so with no snapshots around this
+ * costs one more load per node.
  */
-key_node * find_node (multimap *mm, int key, int create_if_not_found)
+mm_node * ownNode(multimap *mm, mm_node **link)
 {
-    mm_node *node;
+    mm_node *node = *link;
 
-    /* edge case where tree does not exist */
-    if (mm->root == NULL)
+    if (node == NULL || __atomic_load_n(&node->shared, __ATOMIC_ACQUIRE) == 0)
     {
-        if (create_if_not_found)
-        {
-            mm->root = alloc_node();
-            node = mm->root;
-            node->isLeaf = 1;
-            node->kNodes[0].key = key;
-            node->nKeys++;
-            assert(!(node->nKeys > MAX_KEYS));
-        }
-        return &mm->root->kNodes[0];
+        return node;
     }
-    
-    node = mm->root;
-
-    /* 
-     * edge case where the root is a full node, and a key might
-     * potentially be inserted. In keeping with the proactive splitting
-     * strategy, generate a new root and extend the tree height. In fact,
-     * this is the only way to extend the tree depth
-     */
-    if (node->nKeys == MAX_KEYS)
+    mm_node *copy = alloc_node(mm);
+    copy->isLeaf = node->isLeaf;
+    copy->nKeys = node->nKeys;
+    memcpy(copy->keys, node->keys, sizeof(int) * node->nKeys);
+    memcpy(copy->kNodes, node->kNodes, sizeof(key_node) * node->nKeys);
+    for (int i = 0; i < node->nKeys; i++)
     {
-        if (create_if_not_found)
+        kNode_share(&mm->values, &copy->kNodes[i]);
+    }
+    if (!(node->isLeaf))
+    {
+        memcpy(copy->kids, node->kids, sizeof(mm_node *) * (node->nKeys + 1));
+        for (int i = 0; i <= node->nKeys; i++)
         {
-            mm->root = alloc_node();
-            mm->root->isLeaf = 0;
-            mm->root->kids[0] = node;
-            splitNode(mm->root, 0);
-            node = mm->root; /* re-examine from root since tree was changed */
+            __atomic_fetch_add(&node->kids[i]->shared, 1, __ATOMIC_RELAXED);
         }
     }
-    return searchAndInsert(node, key, create_if_not_found);
+    reindex_node(copy);
+
+    *link = copy;
+    dropNode(mm, node);
+    return copy;
 }
 
 
 /*
- * Free a subtree of a multimap starting at the node "node". Essentially moves
+ * Whoever lets go of a node last frees it, values and all, and lets go of
+ * its kids in turn. mm is the multimap whose arena the node came from.
+ */
+void dropNode(multimap *mm, mm_node *node)
+{
+    if (__atomic_fetch_sub(&node->shared, 1, __ATOMIC_ACQ_REL) > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < node->nKeys; i++)
+    {
+        kNode_free(&mm->values, &node->kNodes[i]);
+    }
+    if (!(node->isLeaf))
+    {
+        for (int i = 0; i <= node->nKeys; i++)
+        {
+            dropNode(mm, node->kids[i]);
+        }
+    }
+    release_node(mm, node);
+}
+
+
+/*
+ * The nodes of a concurrent multimap are only looked at with their latch
+ * held, shared to read them and exclusive to change them, and the latches
+ * are taken by lock coupling ("crabbing"): on the way down, a kid is
+ * latched before the latch of its parent is let go, so that nothing can
+ * change the tree in between. Latches are only ever taken from the top
+ * down (and, for siblings, only by whoever has their parent exclusive),
+ * so there can be no deadlock. rootLatch is the parent of the root.
+ *
+ * An optimistic multimap has no shared latches: everything that changes
+ * it takes the lock in the version of a node instead (so mode is always
+ * exclusive), and lookups take none (see readVersion).
+ */
+void latchNode(multimap *mm, mm_node *node, int mode)
+{
+    if (!mm->concurrent)
+    {
+        return;
+    }
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        lockVersion(&node->version);
+    }
+    else if (mode == LATCH_EXCLUSIVE)
+    {
+        pthread_rwlock_wrlock(&node->latch);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&node->latch);
+    }
+}
+
+
+void unlatchNode(multimap *mm, mm_node *node)
+{
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        unlockVersion(&node->version);
+    }
+    else if (mm->concurrent)
+    {
+        pthread_rwlock_unlock(&node->latch);
+    }
+}
+
+
+void latchRoot(multimap *mm)
+{
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        lockVersion(&mm->rootVersion);
+    }
+    else if (mm->concurrent)
+    {
+        pthread_rwlock_wrlock(&mm->rootLatch);
+    }
+}
+
+
+void unlatchRoot(multimap *mm)
+{
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        unlockVersion(&mm->rootVersion);
+    }
+    else if (mm->concurrent)
+    {
+        pthread_rwlock_unlock(&mm->rootLatch);
+    }
+}
+
+
+/*
+ * Optimistic lock coupling (Leis et al.): every node of an optimistic
+ * multimap has a version, which is bumped each time the node is changed,
+ * and whose low bits say whether it is locked for a change right now, or
+ * has been taken out of the tree. A lookup never writes to a node. It
+ * reads the version of each node before looking at it, and checks that it
+ * is still the same afterwards (and before stepping into a kid it read, so
+ * that it never follows a pointer that was being changed); if it isn't,
+ * the lookup raced a change, and starts over from the root. Changes lock
+ * only the nodes they change, by upgrading the version they read, and
+ * fail (and start over) if that has moved on in the meantime.
+ */
+uint64_t readVersion(const uint64_t *version)
+{
+    int spins = 0;
+    uint64_t seen = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+
+    while (seen & VERSION_LOCKED)
+    {
+        /* the change should be quick, unless its thread isn't running */
+        if (++spins % VERSION_SPINS == 0)
+        {
+            sched_yield();
+        }
+        seen = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+    }
+    return seen;
+}
+
+
+/* Is the version still the one read before whatever was read since? */
+int checkVersion(const uint64_t *version, uint64_t seen)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(version, __ATOMIC_RELAXED) == seen;
+}
+
+
+/* Locks the version if it is still the one that was read. */
+int upgradeVersion(uint64_t *version, uint64_t seen)
+{
+    if (!__atomic_compare_exchange_n(version, &seen, seen + VERSION_LOCKED,
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    /* a lookup that reads anything written from here on sees it locked */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+
+void lockVersion(uint64_t *version)
+{
+    while (!upgradeVersion(version, readVersion(version)))
+    {
+    }
+}
+
+
+/* Unlocks the version, and (since the lock bit carries) bumps it. */
+void unlockVersion(uint64_t *version)
+{
+    __atomic_fetch_add(version, VERSION_LOCKED, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * The optimistic lookups read nodes that a change may be writing to, and
+ * only find out afterwards, from the version, whether what they read can
+ * be used. So that those reads are not data races, everything they read
+ * and a change can write to (nKeys, the keys, key_nodes and kids) is read
+ * through relaxed atomics, a word at a time, and written the same way in
+ * an optimistic multimap; the root is stored with release and loaded with
+ * acquire, as a new one is set up just before. Other multimaps keep their
+ * memmoves.
+ * (A node that isn't in the tree yet, like the younger half of a split, is
+ * written plainly: a lookup only reads it after its parent's version says
+ * that it is there.)
+ */
+void moveKeys(multimap *mm, int *to, const int *from, int n)
+{
+    if (mm->concurrent != MM_CONCURRENT_OPTIMISTIC)
+    {
+        if (from == NULL)
+        {
+            bzero(to, sizeof(int) * n);
+        }
+        else
+        {
+            memmove(to, from, sizeof(int) * n);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        /* copy in the direction that an overlap doesn't clobber */
+        int at = (to > from) ? n - 1 - i : i;
+        int key = (from == NULL) ? 0 : from[at];
+        __atomic_store_n(&to[at], key, __ATOMIC_RELAXED);
+    }
+}
+
+
+void moveKNodes(multimap *mm, key_node *to, const key_node *from, int n)
+{
+    key_node empty = { 0 };
+
+    if (mm->concurrent != MM_CONCURRENT_OPTIMISTIC)
+    {
+        if (from == NULL)
+        {
+            bzero(to, sizeof(key_node) * n);
+        }
+        else
+        {
+            memmove(to, from, sizeof(key_node) * n);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int at = (to > from) ? n - 1 - i : i;
+        storeKNode(&to[at], (from == NULL) ? &empty : &from[at]);
+    }
+}
+
+
+void moveKids(multimap *mm, mm_node **to, mm_node *const *from, int n)
+{
+    if (mm->concurrent != MM_CONCURRENT_OPTIMISTIC)
+    {
+        if (from == NULL)
+        {
+            bzero(to, sizeof(mm_node *) * n);
+        }
+        else
+        {
+            memmove(to, from, sizeof(mm_node *) * n);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int at = (to > from) ? n - 1 - i : i;
+        mm_node *kid = (from == NULL) ? NULL : from[at];
+        __atomic_store_n(&to[at], kid, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* A plain store compiles to the same thing, so this is always atomic. */
+void setNKeys(mm_node *node, int nKeys)
+{
+    __atomic_store_n(&node->nKeys, nKeys, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * searchInNode for the optimistic lookups, over what they load (so a plain
+ * binary search, rather than the vectorized or Eytzinger ones). Sets
+ * *match if the key at the position returned is the one searched for.
+ */
+int searchOptimistic(mm_node *node, int key, int *match)
+{
+    int nKeys = __atomic_load_n(&node->nKeys, __ATOMIC_RELAXED);
+    int lo = 0;
+    int hi = nKeys;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (__atomic_load_n(&node->keys[mid], __ATOMIC_RELAXED) < key)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *match = lo < nKeys &&
+             __atomic_load_n(&node->keys[lo], __ATOMIC_RELAXED) == key;
+    return lo;
+}
+
+
+/*
+ * A key_node is copied as its ints: the inline values cover the rest of it
+ * (capacity and the pointers included), as checked here.
+ */
+_Static_assert(sizeof(key_node) ==
+               sizeof(int) * 2 + sizeof(multimap_value) * INLINE_VALUES,
+               "the inline values of a key_node must cover its union");
+
+void loadKNode(key_node *to, const key_node *from)
+{
+    to->nVals = __atomic_load_n(&from->nVals, __ATOMIC_RELAXED);
+    to->nSorted = __atomic_load_n(&from->nSorted, __ATOMIC_RELAXED);
+    for (int i = 0; i < INLINE_VALUES; i++)
+    {
+        to->inlineValues[i] = __atomic_load_n(&from->inlineValues[i],
+                                              __ATOMIC_RELAXED);
+    }
+}
+
+
+void storeKNode(key_node *to, const key_node *from)
+{
+    __atomic_store_n(&to->nVals, from->nVals, __ATOMIC_RELAXED);
+    __atomic_store_n(&to->nSorted, from->nSorted, __ATOMIC_RELAXED);
+    for (int i = 0; i < INLINE_VALUES; i++)
+    {
+        __atomic_store_n(&to->inlineValues[i], from->inlineValues[i],
+                         __ATOMIC_RELAXED);
+    }
+}
+
+
+/* The searchInNode implementation picked by select_search_impl. */
+static int (*searchInNodeImpl)(mm_node *node, int key) = searchInNodeScalar;
+static const char *searchImplName = "linear (scalar)";
+
+
+/* 
+ * Search within a node to find the index of the first key_node with a key
+ * greater than the key passed as an argument. If all the keys in a node are
+ * less than the query key, will return the node's nKeys. This is useful
+ * for figuring out which subtree to look through in a search or insert.
+ *
+ * Since the keys in a node are sorted and distinct, this index is the same
+ * as the number of keys in the node that are less than the query key, which
+ * is what the vectorized versions count.
+ */
+int searchInNode(mm_node *node, int key)
+{
+    int pos = searchInNodeImpl(node, key);
+    assert(pos == searchInNodeScalar(node, key));
+    return pos;
+}
+
+
+/* The plain linear scan, one key at a time. */
+int searchInNodeScalar(mm_node *node, int key)
+{
+    for (int i = 0; i < node->nKeys; i++)
+    {
+        if (key <= node->keys[i])
+        {
+            return i;
+        }
+    }
+    return node->nKeys;
+}
+
+
+#if HAVE_X86_SIMD
+
+/*
+ * SSE4.2 version: compares 8 keys per iteration. As soon as a group
+ * contains a key >= the query, the answer is in that group and is found by
+ * counting how many of its keys were still smaller.
+ */
+__attribute__((target("sse4.2,popcnt")))
+int searchInNodeSSE(mm_node *node, int key)
+{
+    const __m128i query = _mm_set1_epi32(key);
+    int i = 0;
+
+    for ( ; i + 8 <= node->nKeys; i += 8)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *) &node->keys[i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *) &node->keys[i + 4]);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(
+                                            _mm_cmpgt_epi32(query, lo)))
+                 | _mm_movemask_ps(_mm_castsi128_ps(
+                                            _mm_cmpgt_epi32(query, hi))) << 4;
+        if (mask != 0xff)
+        {
+            return i + _mm_popcnt_u32(mask);
+        }
+    }
+
+    /* less than a full group left, finish up one at a time */
+    for ( ; i < node->nKeys; i++)
+    {
+        if (key <= node->keys[i])
+        {
+            return i;
+        }
+    }
+    return node->nKeys;
+}
+
+
+/* AVX2 version: the same idea, 16 keys per iteration. */
+__attribute__((target("avx2,popcnt")))
+int searchInNodeAVX2(mm_node *node, int key)
+{
+    const __m256i query = _mm256_set1_epi32(key);
+    int i = 0;
+
+    for ( ; i + 16 <= node->nKeys; i += 16)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) &node->keys[i]);
+        __m256i hi = _mm256_loadu_si256((const __m256i *) &node->keys[i + 8]);
+        unsigned mask = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(
+                                            _mm256_cmpgt_epi32(query, lo)))
+                      | (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(
+                                            _mm256_cmpgt_epi32(query, hi)))
+                                                                        << 8;
+        if (mask != 0xffff)
+        {
+            return i + _mm_popcnt_u32(mask);
+        }
+    }
+
+    for ( ; i < node->nKeys; i++)
+    {
+        if (key <= node->keys[i])
+        {
+            return i;
+        }
+    }
+    return node->nKeys;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/*
+ * Branchless binary search. Each step halves the range that could hold the
+ * answer, and picks the half with a conditional move rather than a branch,
+ * so there are no mispredictions; the number of steps only depends on
+ * nKeys. base ends up on the last key < the query (or on keys[0]), so
+ * the answer is either base or the key right after it.
+ */
+int searchInNodeBinary(mm_node *node, int key)
+{
+    const int *base = node->keys;
+    int n = node->nKeys;
+
+    if (n == 0)
+    {
+        return 0;
+    }
+    while (n > 1)
+    {
+        int half = n / 2;
+        base = (base[half] < key) ? base + half : base;
+        n -= half;
+    }
+    return (base - node->keys) + (*base < key);
+}
+
+
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+
+/*
+ * Binary search over the Eytzinger copy of the keys. Node k of the implicit
+ * tree has its children at 2k and 2k + 1, so the search is just "go left or
+ * right" with no bounds to track, and the 16 descendants four levels below
+ * k are contiguous (16k ... 16k + 15), i.e. one cache line, which is
+ * prefetched before they are needed. When the loop falls off the bottom,
+ * the lower bound is the last node where we went left, which is found by
+ * stripping the trailing "went right" bits (and the final left turn) off k.
+ */
+int searchInNodeEytzinger(mm_node *node, int key)
+{
+    const int lineKeys = LINE_SIZE / sizeof(int);
+    int n = node->nKeys;
+    int k = 1;
+
+    while (k <= n)
+    {
+        __builtin_prefetch(node->eytz + k * lineKeys);
+        k = 2 * k + (node->eytz[k] < key);
+    }
+    k >>= __builtin_ffs(~k);
+    return (k == 0) ? n : node->eytzRank[k];
+}
+
+
+/* fills eytz[k...] by an in-order walk of the implicit tree, see above */
+int build_eytzinger(mm_node *node, int i, int k)
+{
+    if (k <= node->nKeys)
+    {
+        i = build_eytzinger(node, i, 2 * k);
+        node->eytz[k] = node->keys[i];
+        node->eytzRank[k] = i;
+        i = build_eytzinger(node, i + 1, 2 * k + 1);
+    }
+    return i;
+}
+
+#endif /* SEARCH_STRATEGY == SEARCH_EYTZINGER */
+
+
+/* 
+ * Rebuild whatever the search strategy keeps besides keys. For the linear
+ * and binary searches there is nothing to do.
+ */
+void reindex_node(mm_node *node)
+{
+#if SEARCH_STRATEGY == SEARCH_EYTZINGER
+    build_eytzinger(node, 0, 1);
+#else
+    (void) node;
+#endif
+}
+
+
+/*
+ * Runtime CPU dispatch for searchInNode. Called from init_multimap, so by
+ * the time any tree is searched the best available version is in place.
+ */
+void select_search_impl()
+{
+#if SEARCH_STRATEGY == SEARCH_BINARY
+    searchInNodeImpl = searchInNodeBinary;
+    searchImplName = "branchless binary";
+    return;
+#elif SEARCH_STRATEGY == SEARCH_EYTZINGER
+    searchInNodeImpl = searchInNodeEytzinger;
+    searchImplName = "eytzinger";
+    return;
+#else
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        searchInNodeImpl = searchInNodeAVX2;
+        searchImplName = "linear (avx2)";
+        return;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    {
+        searchInNodeImpl = searchInNodeSSE;
+        searchImplName = "linear (sse4.2)";
+        return;
+    }
+#endif
+    searchInNodeImpl = searchInNodeScalar;
+    searchImplName = "linear (scalar)";
+#endif
+}
+
+
+/*
+ * The "key" (haha, see what I did there) to the insert operation. Given a
+ * parent node, and the position of the child subtree (an index from 0 to
+ * nKeys), will take the middle keyNode of the child, move it to parent,
+ * and split the child node with the second half of its kNodes being placed
+ * in the new splitoff. Will also add a pointer to the splitoff to parent.
+ *
+ * Visually (* is empty/NULL, numbers are keys, a line is a level of tree)
+ * 
+ * original tree:
+ *         4      6      *                 -- parent
+ *       /     |     |     \
+ *     0 1 2   5     *      *              -- children
+ *   
+ * to add key 3 to this tree, first call splitNode(parent, 0):
+ *     step 1, shift things in the parent:
+ *        result:
+ *           *       4       6                -- parent
+ *          /    |       |     \
+ *        0 1 2  *       5      *             -- children
+ *
+ *     step 2, update the keys and kids of the parent: 
+ *        result:
+ *           1       4       6                -- parent
+ *          /    |       |     \
+ *        0 1 2 (*)      5      *             -- children, (*) is new, empty kid
+ *     step 3, update the newly created "younger" node:
+ *        result:
+ *           1       4       6                -- parent
+ *          /    |       |     \
+ *        0 1 2  2       5      *             -- children
+ *     step 4, update the "elder" node (0 out useless stuff):
+ *        result:
+ *           1       4       6                -- parent
+ *          /    |       |     \
+ *        0      2       5      *             -- children
+ * Now, we can add 3:
+ * final:
+ *        1       4       6                -- parent
+ *       /    |       |     \
+ *     0     2 3      5      *             -- children
+ */
+void splitNode(multimap *mm, mm_node *parent, int pos)
+{
+    mm_node *elder = parent->kids[pos]; /* child to be split */
+    mm_node *younger = alloc_node(mm); /* child made from split */
+    
+    /* 
+     * Here, we shift the kids pointers and key nodes in the parent down 1,
+     * from the position that the new key (from elder) will be added.
+     * Note that due to proactive splitting, pos will always be
+     * < maxKeys - 1, and since kNodes has length maxKeys, while kids
+     * has length maxKeys + 1, there is never an invalid memory access, and
+     * there is always room for this shift down by 1 operation.
+     * 
+     * Step 1 in the little visual aid above.
+     */
+    moveKeys(mm, &parent->keys[pos + 1], &parent->keys[pos],
+                                    parent->nKeys - pos);
+    moveKNodes(mm, &parent->kNodes[pos + 1], &parent->kNodes[pos],
+                                    parent->nKeys - pos);
+    moveKids(mm, &parent->kids[pos + 2], &parent->kids[pos + 1],
+                                    parent->nKeys - pos);
+
+    /*
+     * Find where to break off elder, move the kNode there to parent, and
+     * add a pointer to the new child (younger) to the parent after the
+     * new kNode.
+     *
+     * Step 2
+     */
+    int mid = elder->nKeys / 2;
+    moveKeys(mm, &parent->keys[pos], &elder->keys[mid], 1);
+    moveKNodes(mm, &parent->kNodes[pos], &elder->kNodes[mid], 1);
+    moveKids(mm, &parent->kids[pos + 1], &younger, 1);
+    setNKeys(parent, parent->nKeys + 1);
+    assert(!(parent->nKeys > mm->maxKeys));
+    
+    /* 
+     * Move the appropriate key nodes to the younger node, update its other
+     * fields.
+     * 
+     * Step 3
+     */
+    younger->nKeys = elder->nKeys - (mid + 1);
+    memmove(younger->keys, &elder->keys[mid + 1], 
+                                    sizeof(int) * (younger->nKeys));
+    memmove(younger->kNodes, &elder->kNodes[mid + 1], 
+                                    sizeof(key_node) * (younger->nKeys));
+    younger->isLeaf = elder->isLeaf;
+    if (!(younger->isLeaf))
+    {
+        memmove(younger->kids, &elder->kids[mid + 1], 
+                                    sizeof(mm_node *) * (younger->nKeys + 1));
+    }
+
+    /*
+     * Update the elder's fields, zeroing out the things moved to younger to
+     * avoid confusion later on
+     *
+     * Step 4
+     */
+    setNKeys(elder, mid);
+    moveKeys(mm, &elder->keys[mid], NULL, younger->nKeys + 1);
+    moveKNodes(mm, &elder->kNodes[mid], NULL, younger->nKeys + 1);
+    if (!(elder->isLeaf))
+    {
+        moveKids(mm, &elder->kids[mid + 1], NULL, younger->nKeys + 1);
+    }
+
+    reindex_node(parent);
+    reindex_node(elder);
+    reindex_node(younger);
+}
+
+
+key_node * searchAndInsert(multimap *mm, mm_node *node, int key,
+                           int create_if_not_found, leaf_hint *hint)
+{
+    /* look for smallest position that key fits below */
+    int pos = searchInNode(node, key);
+
+    if (pos < node->nKeys && node->keys[pos] == key) 
+    {
+        if (hint != NULL)
+        {
+            hint->leaf = node->isLeaf ? node : NULL;
+        }
+        return &node->kNodes[pos];
+    } 
+    if (node->isLeaf)
+    {
+        if (hint != NULL)
+        {
+            hint->leaf = node;
+        }
+        if (create_if_not_found)
+        {
+            return insertInLeaf(mm, node, pos, key);
+        }
+        return NULL;
+    }
+    if (hint != NULL && pos < node->nKeys)
+    {
+        /* the deeper this is, the tighter a bound it is */
+        hint->bounded = 1;
+        hint->bound = node->keys[pos];
+    }
+    mm_node * nextNode = node->kids[pos];
+    if (create_if_not_found)
+    {
+        nextNode = ownNode(mm, &node->kids[pos]);
+        if (nextNode->nKeys == mm->maxKeys)
+        {
+            splitNode(mm, node, pos);
+            nextNode = node; /* Must re-examine since tree modified */
+        }
+    }
+    return searchAndInsert(mm, nextNode, key, create_if_not_found, hint);
+}
+
+
+key_node * insertInLeaf(multimap *mm, mm_node *node, int pos, int key)
+{
+    /* should have space cuz proactive splitting */
+    moveKeys(mm, &node->keys[pos + 1], &node->keys[pos], node->nKeys - pos);
+    moveKNodes(mm, &node->kNodes[pos + 1], &node->kNodes[pos],
+                            node->nKeys - pos);
+    moveKNodes(mm, &node->kNodes[pos], NULL, 1);
+    moveKeys(mm, &node->keys[pos], &key, 1);
+    setNKeys(node, node->nKeys + 1);
+    assert(!(node->nKeys > mm->maxKeys));
+    reindex_node(node);
+    return &node->kNodes[pos];
+}
+
+
+/* This helper function searches for the key node that contains the
+ * specified key.  If such a node doesn't exist, the function can initialize
+ * a new key node and add this into a multimap node, initializing that
+ * too if necessary; the function might also simply return NULL.
+ * Most of the searching and inserting legwork is done in searchAndInsert,
+ * this function primarily handles edge cases involving the root, before
+ * calling the helper. A descent that may create the key also makes every
+ * node on its way its own (see ownNode), so the key_node it returns can be
+ * changed.
+ */
+key_node * find_node (multimap *mm, int key, int create_if_not_found,
+                      leaf_hint *hint)
+{
+    mm_node *node;
+
+    if (hint != NULL)
+    {
+        hint->leaf = NULL;
+        hint->bounded = 0;
+    }
+
+    /* edge case where tree does not exist */
+    if (mm->root == NULL)
+    {
+        if (create_if_not_found)
+        {
+            mm->root = alloc_node(mm);
+            node = mm->root;
+            node->isLeaf = 1;
+            node->keys[0] = key;
+            node->nKeys++;
+            assert(!(node->nKeys > mm->maxKeys));
+            reindex_node(node);
+            if (hint != NULL)
+            {
+                hint->leaf = node;
+            }
+            return &node->kNodes[0];
+        }
+        return NULL;
+    }
+    
+    node = create_if_not_found ? ownNode(mm, &mm->root) : mm->root;
+
+    /* 
+     * edge case where the root is a full node, and a key might
+     * potentially be inserted. In keeping with the proactive splitting
+     * strategy, generate a new root and extend the tree height. In fact,
+     * this is the only way to extend the tree depth
+     */
+    if (node->nKeys == mm->maxKeys)
+    {
+        if (create_if_not_found)
+        {
+            mm->root = alloc_node(mm);
+            mm->root->isLeaf = 0;
+            mm->root->kids[0] = node;
+            splitNode(mm, mm->root, 0);
+            node = mm->root; /* re-examine from root since tree was changed */
+        }
+    }
+    return searchAndInsert(mm, node, key, create_if_not_found, hint);
+}
+
+
+/*
+ * find_node for a concurrent multimap, with lock coupling (see latchNode).
+ * Lookups go down with shared latches. A descent that may create the key
+ * goes down with exclusive ones, splitting a full kid while it still has
+ * the parent, so that, as in searchAndInsert, the kid always has room for
+ * whatever comes up from below and the parent can be let go as soon as the
+ * kid is latched. Either way no more than two nodes are latched at once.
+ * If the key_node is found (or made), the node holding it is left latched
+ * with mode, and stored in *held for the caller to unlatch.
+ */
+key_node * find_node_latched(multimap *mm, int key, int mode,
+                             int create_if_not_found, mm_node **held)
+{
+    mm_node *node;
+
+    if (create_if_not_found)
+    {
+        /* only a descent that creates can change the root */
+        mode = LATCH_EXCLUSIVE;
+        pthread_rwlock_wrlock(&mm->rootLatch);
+        if (mm->root == NULL)
+        {
+            mm->root = alloc_node(mm);
+            mm->root->isLeaf = 1;
+        }
+        node = mm->root;
+        latchNode(mm, node, LATCH_EXCLUSIVE);
+        if (node->nKeys == mm->maxKeys)
+        {
+            mm->root = alloc_node(mm);
+            mm->root->isLeaf = 0;
+            mm->root->kids[0] = node;
+            splitNode(mm, mm->root, 0);
+            unlatchNode(mm, node);
+            node = mm->root;
+            latchNode(mm, node, LATCH_EXCLUSIVE);
+        }
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&mm->rootLatch);
+        node = mm->root;
+        if (node == NULL)
+        {
+            pthread_rwlock_unlock(&mm->rootLatch);
+            return NULL;
+        }
+        latchNode(mm, node, mode);
+    }
+    pthread_rwlock_unlock(&mm->rootLatch);
+
+    while (1)
+    {
+        int pos = searchInNode(node, key);
+
+        if (pos < node->nKeys && node->keys[pos] == key)
+        {
+            *held = node;
+            return &node->kNodes[pos];
+        }
+        if (node->isLeaf)
+        {
+            if (create_if_not_found)
+            {
+                *held = node;
+                return insertInLeaf(mm, node, pos, key);
+            }
+            unlatchNode(mm, node);
+            return NULL;
+        }
+
+        mm_node *kid = node->kids[pos];
+        latchNode(mm, kid, mode);
+        if (create_if_not_found && kid->nKeys == mm->maxKeys)
+        {
+            splitNode(mm, node, pos);
+            unlatchNode(mm, kid);
+            continue; /* must re-examine node since it was modified */
+        }
+        unlatchNode(mm, node);
+        node = kid;
+    }
+}
+
+
+/*
+ * find_node for an optimistic multimap (see readVersion). The descent locks
+ * nothing on the way: each node is read under its version, which is
+ * checked before stepping into the kid. Only the node the key_node is in
+ * (or is to go into) is locked, by upgrading the version it was read
+ * under, and left locked in *held for the caller. A full kid is split on
+ * the way down, as in searchAndInsert, locking it and its parent for just
+ * that, and the descent then starts over. (Nodes are searched without the
+ * check searchInNode makes in debug builds, which a change going on at the
+ * same time would trip.)
+ */
+key_node * find_node_optimistic(multimap *mm, int key,
+                                int create_if_not_found, mm_node **held)
+{
+    key_node *found;
+
+    while (!descend_optimistic(mm, key, create_if_not_found, held, &found))
+    {
+    }
+    return found;
+}
+
+
+int descend_optimistic(multimap *mm, int key, int create_if_not_found,
+                       mm_node **held, key_node **found)
+{
+    uint64_t rootSeen = readVersion(&mm->rootVersion);
+    mm_node *node = __atomic_load_n(&mm->root, __ATOMIC_ACQUIRE);
+    int match;
+
+    if (node == NULL)
+    {
+        *found = NULL;
+        if (!create_if_not_found)
+        {
+            return checkVersion(&mm->rootVersion, rootSeen);
+        }
+        if (upgradeVersion(&mm->rootVersion, rootSeen))
+        {
+            mm_node *root = alloc_node(mm);
+            root->isLeaf = 1;
+            __atomic_store_n(&mm->root, root, __ATOMIC_RELEASE);
+            unlockVersion(&mm->rootVersion);
+        }
+        return 0;
+    }
+    uint64_t seen = readVersion(&node->version);
+    if (!checkVersion(&mm->rootVersion, rootSeen))
+    {
+        return 0;
+    }
+
+    /* the only way to extend the tree depth, as in find_node */
+    if (create_if_not_found &&
+        __atomic_load_n(&node->nKeys, __ATOMIC_RELAXED) == mm->maxKeys)
+    {
+        if (!upgradeVersion(&mm->rootVersion, rootSeen))
+        {
+            return 0;
+        }
+        if (upgradeVersion(&node->version, seen))
+        {
+            /* set up before it is published, as a lookup may get to it */
+            mm_node *root = alloc_node(mm);
+            root->isLeaf = 0;
+            root->kids[0] = node;
+            splitNode(mm, root, 0);
+            __atomic_store_n(&mm->root, root, __ATOMIC_RELEASE);
+            unlockVersion(&node->version);
+        }
+        unlockVersion(&mm->rootVersion);
+        return 0;
+    }
+
+    while (1)
+    {
+        int pos = searchOptimistic(node, key, &match);
+
+        if (match)
+        {
+            if (!upgradeVersion(&node->version, seen))
+            {
+                return 0;
+            }
+            *held = node;
+            *found = &node->kNodes[pos];
+            return 1;
+        }
+        if (node->isLeaf)
+        {
+            *found = NULL;
+            if (!create_if_not_found)
+            {
+                return checkVersion(&node->version, seen);
+            }
+            if (!upgradeVersion(&node->version, seen))
+            {
+                return 0;
+            }
+            *held = node;
+            *found = insertInLeaf(mm, node, pos, key);
+            return 1;
+        }
+
+        mm_node *kid = __atomic_load_n(&node->kids[pos], __ATOMIC_RELAXED);
+        if (!checkVersion(&node->version, seen))
+        {
+            return 0;
+        }
+        uint64_t kidSeen = readVersion(&kid->version);
+        if (!checkVersion(&node->version, seen))
+        {
+            return 0;
+        }
+        if (create_if_not_found &&
+            __atomic_load_n(&kid->nKeys, __ATOMIC_RELAXED) == mm->maxKeys)
+        {
+            if (!upgradeVersion(&node->version, seen))
+            {
+                return 0;
+            }
+            if (upgradeVersion(&kid->version, kidSeen))
+            {
+                splitNode(mm, node, pos);
+                unlockVersion(&kid->version);
+            }
+            unlockVersion(&node->version);
+            return 0;
+        }
+        node = kid;
+        seen = kidSeen;
+    }
+}
+
+
+void recycleNode(void *ctx, void *node, size_t bytes)
+{
+    multimap *mm = (multimap *) ctx;
+
+    pthread_mutex_lock(&mm->nodesLock);
+    arena_free(&mm->nodes, node);
+    pthread_mutex_unlock(&mm->nodesLock);
+}
+
+
+/*
+ * Every operation on an optimistic multimap, lookups included, runs in an
+ * epoch of its multimap, so that nothing it could reach without a lock is
+ * freed under it. While it does, the values arrays (and sets, bitmaps and
+ * runs) that it lets go of are retired too, through value_epoch.
+ *
+ * The epoch domain is big (a cache line per thread), so only optimistic
+ * multimaps have one, made by the first operation that needs it (again
+ * after a clear_multimap, which frees it); of threads racing to, one wins.
+ */
+void enterOptimistic(multimap *mm)
+{
+    if (mm->concurrent != MM_CONCURRENT_OPTIMISTIC)
+    {
+        return;
+    }
+    epoch_domain *epoch = __atomic_load_n(&mm->epoch, __ATOMIC_ACQUIRE);
+    if (epoch == NULL)
+    {
+        epoch_domain *made = epoch_new();
+        if (__atomic_compare_exchange_n(&mm->epoch, &epoch, made, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            epoch = made;
+        }
+        else
+        {
+            epoch_free(made);
+        }
+    }
+    epoch_enter(epoch);
+    value_epoch = epoch;
+}
+
+
+void exitOptimistic(multimap *mm)
+{
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        value_epoch = NULL;
+        epoch_exit(mm->epoch);
+    }
+}
+
+
+/*
+ * The lookups of an optimistic multimap write nothing shared, so that they
+ * don't take cache lines away from each other: they descend the way
+ * find_node_optimistic does, but without locking anything. Inline values
+ * are looked through in a copy of their key_node, made under the node's
+ * version. Values elsewhere are looked through the same way:  the copy
+ * points at them, and whatever a change lets go of is retired rather than
+ * freed, so they can still be read, and checking the version afterwards
+ * tells whether what was read is the key's values as of the copy.
+ */
+int contains_optimistic(multimap *mm, int key, int value, int checkValue)
+{
+    int result;
+
+    enterOptimistic(mm);
+    while (!probe_optimistic(mm, key, value, checkValue, &result))
+    {
+    }
+    exitOptimistic(mm);
+    return result;
+}
+
+
+int probe_optimistic(multimap *mm, int key, int value, int checkValue,
+                     int *result)
+{
+    uint64_t rootSeen = readVersion(&mm->rootVersion);
+    mm_node *node = __atomic_load_n(&mm->root, __ATOMIC_ACQUIRE);
+    int match;
+
+    *result = 0;
+    if (node == NULL)
+    {
+        return checkVersion(&mm->rootVersion, rootSeen);
+    }
+    uint64_t seen = readVersion(&node->version);
+    if (!checkVersion(&mm->rootVersion, rootSeen))
+    {
+        return 0;
+    }
+
+    while (1)
+    {
+        int pos = searchOptimistic(node, key, &match);
+
+        if (match)
+        {
+            key_node copy;
+            loadKNode(&copy, &node->kNodes[pos]);
+            if (!checkVersion(&node->version, seen))
+            {
+                return 0;
+            }
+            if (!checkValue || kNode_inline(&copy))
+            {
+                *result = !checkValue || kNode_contains(&copy, value);
+                return 1;
+            }
+            *result = kNode_contains(&copy, value);
+            return checkVersion(&node->version, seen);
+        }
+        if (node->isLeaf)
+        {
+            return checkVersion(&node->version, seen);
+        }
+
+        mm_node *kid = __atomic_load_n(&node->kids[pos], __ATOMIC_RELAXED);
+        if (!checkVersion(&node->version, seen))
+        {
+            return 0;
+        }
+        uint64_t kidSeen = readVersion(&kid->version);
+        if (!checkVersion(&node->version, seen))
+        {
+            return 0;
+        }
+        node = kid;
+        seen = kidSeen;
+    }
+}
+
+
+/*
+ * Makes sure the kid at parent->kids[pos] can lose a key_node: if it is at
+ * minKeys, it takes one from its left or right sibling if they can spare
+ * one, and otherwise it is merged with a sibling. Since merging with the
+ * left sibling moves the kid's contents into that sibling, the position of
+ * the kid to continue with is returned. Parent loses a key in a merge,
+ * which is fine because it was fixed the same way before we stepped in
+ * (or is the root). In a concurrent multimap, parent must be latched
+ * exclusive, and the kid to continue with is returned latched exclusive.
+ * Every node it latches is made parent's own first (see ownNode), so that
+ * the latch is taken on the node that stays in the tree.
+ */
+int fixChild(multimap *mm, mm_node *parent, int pos)
+{
+    mm_node *left = (pos > 0) ? parent->kids[pos - 1] : NULL;
+    mm_node *right = (pos < parent->nKeys) ? parent->kids[pos + 1] : NULL;
+
+    latchNode(mm, ownNode(mm, &parent->kids[pos]), LATCH_EXCLUSIVE);
+    if (parent->kids[pos]->nKeys > mm->minKeys)
+    {
+        return pos;
+    }
+    if (left != NULL)
+    {
+        left = ownNode(mm, &parent->kids[pos - 1]);
+        latchNode(mm, left, LATCH_EXCLUSIVE);
+        if (left->nKeys > mm->minKeys)
+        {
+            borrowFromLeft(mm, parent, pos);
+            unlatchNode(mm, left);
+            return pos;
+        }
+    }
+    if (right != NULL)
+    {
+        right = ownNode(mm, &parent->kids[pos + 1]);
+        latchNode(mm, right, LATCH_EXCLUSIVE);
+        if (right->nKeys > mm->minKeys)
+        {
+            borrowFromRight(mm, parent, pos);
+            unlatchNode(mm, right);
+        }
+        else
+        {
+            mergeNodes(mm, parent, pos);
+        }
+        if (left != NULL)
+        {
+            unlatchNode(mm, left);
+        }
+        return pos;
+    }
+    mergeNodes(mm, parent, pos - 1);
+    return pos - 1;
+}
+
+
+/*
+ * Rotates a key_node right: the separator parent->keys[pos - 1] moves down
+ * to the front of kids[pos], and the last key_node of kids[pos - 1] moves
+ * up to replace it (with its rightmost kid going along to kids[pos]).
+ *
+ *        3       6                 2       6
+ *      /    |       \      ->    /    |       \
+ *    1 2    4         7         1    3 4        7
+ */
+void borrowFromLeft(multimap *mm, mm_node *parent, int pos)
+{
+    mm_node *child = parent->kids[pos];
+    mm_node *left = parent->kids[pos - 1];
+
+    moveKeys(mm, &child->keys[1], &child->keys[0], child->nKeys);
+    moveKNodes(mm, &child->kNodes[1], &child->kNodes[0], child->nKeys);
+    moveKeys(mm, &child->keys[0], &parent->keys[pos - 1], 1);
+    moveKNodes(mm, &child->kNodes[0], &parent->kNodes[pos - 1], 1);
+    if (!(child->isLeaf))
+    {
+        moveKids(mm, &child->kids[1], &child->kids[0], child->nKeys + 1);
+        moveKids(mm, &child->kids[0], &left->kids[left->nKeys], 1);
+        moveKids(mm, &left->kids[left->nKeys], NULL, 1);
+    }
+    setNKeys(child, child->nKeys + 1);
+
+    setNKeys(left, left->nKeys - 1);
+    moveKeys(mm, &parent->keys[pos - 1], &left->keys[left->nKeys], 1);
+    moveKNodes(mm, &parent->kNodes[pos - 1], &left->kNodes[left->nKeys], 1);
+    moveKeys(mm, &left->keys[left->nKeys], NULL, 1);
+    moveKNodes(mm, &left->kNodes[left->nKeys], NULL, 1);
+
+    reindex_node(parent);
+    reindex_node(left);
+    reindex_node(child);
+}
+
+
+/* The mirror image of borrowFromLeft, rotating a key_node left. */
+void borrowFromRight(multimap *mm, mm_node *parent, int pos)
+{
+    mm_node *child = parent->kids[pos];
+    mm_node *right = parent->kids[pos + 1];
+
+    moveKeys(mm, &child->keys[child->nKeys], &parent->keys[pos], 1);
+    moveKNodes(mm, &child->kNodes[child->nKeys], &parent->kNodes[pos], 1);
+    if (!(child->isLeaf))
+    {
+        moveKids(mm, &child->kids[child->nKeys + 1], &right->kids[0], 1);
+        moveKids(mm, &right->kids[0], &right->kids[1], right->nKeys);
+        moveKids(mm, &right->kids[right->nKeys], NULL, 1);
+    }
+    setNKeys(child, child->nKeys + 1);
+
+    moveKeys(mm, &parent->keys[pos], &right->keys[0], 1);
+    moveKNodes(mm, &parent->kNodes[pos], &right->kNodes[0], 1);
+    setNKeys(right, right->nKeys - 1);
+    moveKeys(mm, &right->keys[0], &right->keys[1], right->nKeys);
+    moveKNodes(mm, &right->kNodes[0], &right->kNodes[1], right->nKeys);
+    moveKeys(mm, &right->keys[right->nKeys], NULL, 1);
+    moveKNodes(mm, &right->kNodes[right->nKeys], NULL, 1);
+
+    reindex_node(parent);
+    reindex_node(right);
+    reindex_node(child);
+}
+
+
+/*
+ * The opposite of splitNode: kids[pos], the key_node parent->kNodes[pos]
+ * and kids[pos + 1] become a single node (kids[pos]), and the now empty
+ * kids[pos + 1] is freed. Both kids have minKeys key_nodes, so the result
+ * has 2 * minKeys + 1 <= maxKeys of them. In a concurrent multimap, all
+ * three must be latched exclusive, and kids[pos] stays latched.
+ *
+ *        3       6                       6
+ *      /    |       \      ->          /    \
+ *     1     4         7            1 3 4      7
+ */
+void mergeNodes(multimap *mm, mm_node *parent, int pos)
+{
+    mm_node *elder = parent->kids[pos];
+    mm_node *younger = parent->kids[pos + 1];
+    int n = elder->nKeys;
+
+    /* pull the separator down, then append all of younger */
+    moveKeys(mm, &elder->keys[n], &parent->keys[pos], 1);
+    moveKNodes(mm, &elder->kNodes[n], &parent->kNodes[pos], 1);
+    moveKeys(mm, &elder->keys[n + 1], younger->keys, younger->nKeys);
+    moveKNodes(mm, &elder->kNodes[n + 1], younger->kNodes, younger->nKeys);
+    if (!(elder->isLeaf))
+    {
+        moveKids(mm, &elder->kids[n + 1], younger->kids, younger->nKeys + 1);
+    }
+    setNKeys(elder, elder->nKeys + younger->nKeys + 1);
+    assert(!(elder->nKeys > mm->maxKeys));
+
+    /* close the gap in the parent */
+    moveKeys(mm, &parent->keys[pos], &parent->keys[pos + 1],
+                                    parent->nKeys - pos - 1);
+    moveKNodes(mm, &parent->kNodes[pos], &parent->kNodes[pos + 1],
+                                    parent->nKeys - pos - 1);
+    moveKids(mm, &parent->kids[pos + 1], &parent->kids[pos + 2],
+                                    parent->nKeys - pos - 1);
+    setNKeys(parent, parent->nKeys - 1);
+    moveKeys(mm, &parent->keys[parent->nKeys], NULL, 1);
+    moveKNodes(mm, &parent->kNodes[parent->nKeys], NULL, 1);
+    moveKids(mm, &parent->kids[parent->nKeys + 1], NULL, 1);
+
+    unlatchNode(mm, younger);
+    release_node(mm, younger);
+    reindex_node(parent);
+    reindex_node(elder);
+}
+
+
+/*
+ * Walks down the right edge of the subtree at node, fixing kids on the way,
+ * and removes the last key_node of the leaf it ends up in. In a concurrent
+ * multimap, node must be latched exclusive; it is crabbed down from, and
+ * the leaf is unlatched at the end.
+ */
+void takeMax(multimap *mm, mm_node *node, mm_node *to, int pos)
+{
+    while (!(node->isLeaf))
+    {
+        mm_node *kid = node->kids[fixChild(mm, node, node->nKeys)];
+        unlatchNode(mm, node);
+        node = kid;
+    }
+    setNKeys(node, node->nKeys - 1);
+    moveKeys(mm, &to->keys[pos], &node->keys[node->nKeys], 1);
+    moveKNodes(mm, &to->kNodes[pos], &node->kNodes[node->nKeys], 1);
+    moveKeys(mm, &node->keys[node->nKeys], NULL, 1);
+    moveKNodes(mm, &node->kNodes[node->nKeys], NULL, 1);
+    reindex_node(node);
+    unlatchNode(mm, node);
+}
+
+
+/* Same as takeMax, down the left edge. */
+void takeMin(multimap *mm, mm_node *node, mm_node *to, int pos)
+{
+    while (!(node->isLeaf))
+    {
+        mm_node *kid = node->kids[fixChild(mm, node, 0)];
+        unlatchNode(mm, node);
+        node = kid;
+    }
+    moveKeys(mm, &to->keys[pos], &node->keys[0], 1);
+    moveKNodes(mm, &to->kNodes[pos], &node->kNodes[0], 1);
+    setNKeys(node, node->nKeys - 1);
+    moveKeys(mm, &node->keys[0], &node->keys[1], node->nKeys);
+    moveKNodes(mm, &node->kNodes[0], &node->kNodes[1], node->nKeys);
+    moveKeys(mm, &node->keys[node->nKeys], NULL, 1);
+    moveKNodes(mm, &node->kNodes[node->nKeys], NULL, 1);
+    reindex_node(node);
+    unlatchNode(mm, node);
+}
+
+
+/*
+ * Removes key from the tree in a single pass from the root down (see the
+ * README). The removed key_node is copied into *removed so that the caller
+ * can deal with its values. Afterwards, an empty root is replaced by its
+ * only kid (or by nothing, if it was a leaf). Every node it changes is made
+ * the tree's own first (see ownNode).
+ *
+ * In a concurrent multimap this crabs down with exclusive latches, holding
+ * the node the key is found in until takeMax or takeMin has brought up its
+ * replacement. One pass takes at most one key_node out of the root, so only
+ * a root with a single one can end up empty, and rootLatch is only kept
+ * for the whole pass then.
+ */
+int removeKey(multimap *mm, int key, key_node *removed, int onlyIfEmpty)
+{
+    mm_node *node;
+    int found = 0;
+
+    latchRoot(mm);
+    node = ownNode(mm, &mm->root);
+    if (node == NULL)
+    {
+        unlatchRoot(mm);
+        return 0;
+    }
+    latchNode(mm, node, LATCH_EXCLUSIVE);
+    int holdRoot = node->nKeys <= 1;
+    if (!holdRoot)
+    {
+        unlatchRoot(mm);
+    }
+
+    while (1)
+    {
+        int pos = searchInNode(node, key);
+
+        if (pos < node->nKeys && node->keys[pos] == key)
+        {
+            if (onlyIfEmpty && node->kNodes[pos].nVals > 0)
+            {
+                break;
+            }
+            found = 1;
+            *removed = node->kNodes[pos];
+            if (node->isLeaf)
+            {
+                setNKeys(node, node->nKeys - 1);
+                moveKeys(mm, &node->keys[pos], &node->keys[pos + 1],
+                                    node->nKeys - pos);
+                moveKNodes(mm, &node->kNodes[pos], &node->kNodes[pos + 1],
+                                    node->nKeys - pos);
+                moveKeys(mm, &node->keys[node->nKeys], NULL, 1);
+                moveKNodes(mm, &node->kNodes[node->nKeys], NULL, 1);
+                reindex_node(node);
+                break;
+            }
+            latchNode(mm, ownNode(mm, &node->kids[pos]), LATCH_EXCLUSIVE);
+            if (node->kids[pos]->nKeys > mm->minKeys)
+            {
+                takeMax(mm, node->kids[pos], node, pos);
+                reindex_node(node);
+                break;
+            }
+            latchNode(mm, ownNode(mm, &node->kids[pos + 1]),
+                      LATCH_EXCLUSIVE);
+            if (node->kids[pos + 1]->nKeys > mm->minKeys)
+            {
+                unlatchNode(mm, node->kids[pos]);
+                takeMin(mm, node->kids[pos + 1], node, pos);
+                reindex_node(node);
+                break;
+            }
+            /* key moves down into the merged kid, go remove it there */
+            mergeNodes(mm, node, pos);
+            mm_node *kid = node->kids[pos];
+            unlatchNode(mm, node);
+            node = kid;
+            continue;
+        }
+
+        if (node->isLeaf)
+        {
+            break;
+        }
+        mm_node *kid = node->kids[fixChild(mm, node, pos)];
+        unlatchNode(mm, node);
+        node = kid;
+    }
+    unlatchNode(mm, node);
+
+    if (holdRoot)
+    {
+        node = mm->root;
+        if (node->nKeys == 0)
+        {
+            __atomic_store_n(&mm->root, node->isLeaf ? NULL : node->kids[0],
+                             __ATOMIC_RELEASE);
+            release_node(mm, node);
+        }
+        unlatchRoot(mm);
+    }
+    return found;
+}
+
+
+/*
+ * Normally a level has one node per fillSlots slots (rounding down, so no
+ * node has fewer), but never so few that a node would need more than
+ * maxSlots. In that case the nodes are at least half full anyway, as a
+ * split would leave them.
+ */
+size_t level_width(size_t slots, int fillSlots, int maxSlots)
+{
+    size_t width = slots / fillSlots;
+    size_t least = (slots + maxSlots - 1) / maxSlots;
+    if (width < least)
+    {
+        width = least;
+    }
+    return (width > 0) ? width : 1;
+}
+
+
+/*
+ * The values array is allocated the same size mm_add_value would have
+ * grown it to, so that it can carry on growing it from there.
+ */
+void take_key(multimap *mm, const mm_pair *pairs, size_t n, size_t *next,
+              int *key, key_node *kNode)
+{
+    size_t first = *next;
+    size_t last = first + 1;
+    while (last < n && pairs[last].key == pairs[first].key)
+    {
+        last++;
+    }
+
+    bzero(kNode, sizeof(key_node));
+    kNode_add_values(&mm->values, kNode, &pairs[first], last - first);
+    *key = pairs[first].key;
+    *next = last;
+}
+
+
+/*
+ * See README point 5. A node with nKeys keys counts as nKeys + 1 slots, so
+ * the leaves share nKeys + 1 slots between them (every key except the
+ * width - 1 set aside, plus one per leaf), and a level above shares one
+ * slot per kid. The nodes of a level (and the keys set aside between
+ * them) are kept in nodes, sepKeys and sepKNodes, and each level above
+ * overwrites them in place, since it never writes past what it has already
+ * read.
+ */
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n)
+{
+    size_t nKeys = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == 0 || pairs[i].key != pairs[i - 1].key)
+        {
+            nKeys++;
+        }
+    }
+    if (nKeys == 0)
+    {
+        return;
+    }
+
+    size_t width = level_width(nKeys + 1, mm->fillKeys + 1, mm->maxKeys + 1);
+    mm_node **nodes = malloc(sizeof(mm_node *) * width);
+    int *sepKeys = malloc(sizeof(int) * width);
+    key_node *sepKNodes = malloc(sizeof(key_node) * width);
+    size_t next = 0;
+
+    for (size_t i = 0; i < width; i++)
+    {
+        mm_node *node = alloc_node(mm);
+        node->isLeaf = 1;
+        node->nKeys = (nKeys + 1) / width + (i < (nKeys + 1) % width) - 1;
+        for (int j = 0; j < node->nKeys; j++)
+        {
+            take_key(mm, pairs, n, &next, &node->keys[j], &node->kNodes[j]);
+        }
+        reindex_node(node);
+        nodes[i] = node;
+        if (i + 1 < width)
+        {
+            take_key(mm, pairs, n, &next, &sepKeys[i], &sepKNodes[i]);
+        }
+    }
+    assert(next == n);
+
+    while (width > 1)
+    {
+        size_t upper = level_width(width, mm->fillKeys + 1, mm->maxKeys + 1);
+        size_t kid = 0;
+        size_t sep = 0;
+
+        for (size_t i = 0; i < upper; i++)
+        {
+            mm_node *node = alloc_node(mm);
+            node->isLeaf = 0;
+            node->nKeys = width / upper + (i < width % upper) - 1;
+            for (int j = 0; j < node->nKeys; j++)
+            {
+                node->kids[j] = nodes[kid++];
+                node->keys[j] = sepKeys[sep];
+                node->kNodes[j] = sepKNodes[sep];
+                sep++;
+            }
+            node->kids[node->nKeys] = nodes[kid++];
+            reindex_node(node);
+            nodes[i] = node;
+            if (i + 1 < upper)
+            {
+                sepKeys[i] = sepKeys[sep];
+                sepKNodes[i] = sepKNodes[sep];
+                sep++;
+            }
+        }
+        assert(kid == width && sep == width - 1);
+        width = upper;
+    }
+
+    mm->root = nodes[0];
+    free(nodes);
+    free(sepKeys);
+    free(sepKNodes);
+}
+
+
+/*
+ * Works out the same tree as bulk_build, a level at a time, with each
+ * thread building a range of the nodes of a level. Every node's keys (or
+ * kids) start at a place that follows from its index alone, so threads
+ * never wait on each other within a level; a level only has to wait for
+ * the one below it. The leaves need to know where their first key is in
+ * the pairs, so the threads first count the keys that start in a share of
+ * the pairs each, which tells every leaf thread which share to start
+ * looking in. Only the memory of the nodes is taken from the arena by the
+ * calling thread, since the arena has no lock of its own. Levels too
+ * narrow to be worth it, near the root, are built by the calling thread.
+ */
+void bulk_build_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                         int nthreads)
+{
+    if (nthreads > 1 && n / nthreads < PARALLEL_BUILD)
+    {
+        nthreads = (int) (n / PARALLEL_BUILD);
+    }
+    if (nthreads <= 1)
+    {
+        bulk_build(mm, pairs, n);
+        return;
+    }
+
+    build_share *shares = malloc(sizeof(build_share) * nthreads);
+    size_t *keysBefore = malloc(sizeof(size_t) * (nthreads + 1));
+    for (int t = 0; t < nthreads; t++)
+    {
+        shares[t].pairs = pairs;
+        shares[t].n = n;
+        shares[t].first = n * t / nthreads;
+        shares[t].last = n * (t + 1) / nthreads;
+    }
+    run_shares(count_keys, shares, sizeof(build_share), nthreads);
+    keysBefore[0] = 0;
+    for (int t = 0; t < nthreads; t++)
+    {
+        keysBefore[t + 1] = keysBefore[t] + shares[t].keys;
+    }
+    size_t nKeys = keysBefore[nthreads];
+
+    size_t width = level_width(nKeys + 1, mm->fillKeys + 1, mm->maxKeys + 1);
+    mm_node **nodes = malloc(sizeof(mm_node *) * width);
+    int *sepKeys = malloc(sizeof(int) * width);
+    key_node *sepKNodes = malloc(sizeof(key_node) * width);
+    mm_node **upNodes = malloc(sizeof(mm_node *) * width);
+    int *upKeys = malloc(sizeof(int) * width);
+    key_node *upKNodes = malloc(sizeof(key_node) * width);
+
+    for (size_t i = 0; i < width; i++)
+    {
+        nodes[i] = raw_node(mm);
+    }
+    int c = 0;
+    for (int t = 0; t < nthreads; t++)
+    {
+        build_share *share = &shares[t];
+        share->mm = mm;
+        share->first = width * t / nthreads;
+        share->last = width * (t + 1) / nthreads;
+        share->slots = nKeys + 1;
+        share->width = width;
+        share->nodes = nodes;
+        share->sepKeys = sepKeys;
+        share->sepKNodes = sepKNodes;
+
+        /* the index of its first key, and the share of pairs it is in */
+        size_t key = share->first * (share->slots / width) +
+                     ((share->first < share->slots % width) ?
+                      share->first : share->slots % width);
+        while (c + 1 < nthreads && keysBefore[c + 1] <= key)
+        {
+            c++;
+        }
+        share->next = n * c / nthreads;
+        share->skip = key - keysBefore[c];
+    }
+    run_shares(build_leaves, shares, sizeof(build_share), nthreads);
+
+    while (width > 1)
+    {
+        size_t upper = level_width(width, mm->fillKeys + 1, mm->maxKeys + 1);
+        int threads = (upper < PARALLEL_NODES) ? 1 : nthreads;
+
+        for (size_t i = 0; i < upper; i++)
+        {
+            upNodes[i] = raw_node(mm);
+        }
+        for (int t = 0; t < threads; t++)
+        {
+            build_share *share = &shares[t];
+            share->first = upper * t / threads;
+            share->last = upper * (t + 1) / threads;
+            share->slots = width;
+            share->width = upper;
+            share->nodes = upNodes;
+            share->sepKeys = upKeys;
+            share->sepKNodes = upKNodes;
+            share->kids = nodes;
+            share->kidKeys = sepKeys;
+            share->kidKNodes = sepKNodes;
+        }
+        run_shares(build_level, shares, sizeof(build_share), threads);
+
+        mm_node **swapNodes = nodes;
+        nodes = upNodes;
+        upNodes = swapNodes;
+        int *swapKeys = sepKeys;
+        sepKeys = upKeys;
+        upKeys = swapKeys;
+        key_node *swapKNodes = sepKNodes;
+        sepKNodes = upKNodes;
+        upKNodes = swapKNodes;
+        width = upper;
+    }
+
+    mm->root = nodes[0];
+    free(nodes);
+    free(sepKeys);
+    free(sepKNodes);
+    free(upNodes);
+    free(upKeys);
+    free(upKNodes);
+    free(keysBefore);
+    free(shares);
+}
+
+
+void * count_keys(void *arg)
+{
+    build_share *share = arg;
+    const mm_pair *pairs = share->pairs;
+
+    share->keys = 0;
+    for (size_t i = share->first; i < share->last; i++)
+    {
+        if (i == 0 || pairs[i].key != pairs[i - 1].key)
+        {
+            share->keys++;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * The leaves from first up to last, as bulk_build deals them out. The
+ * share of pairs next is in may start partway through a key's pairs,
+ * which belong to the key before it.
+ */
+void * build_leaves(void *arg)
+{
+    build_share *share = arg;
+    const mm_pair *pairs = share->pairs;
+    size_t n = share->n;
+    size_t next = share->next;
+
+    if (share->first == share->last)
+    {
+        return NULL;
+    }
+    while (next > 0 && next < n && pairs[next].key == pairs[next - 1].key)
+    {
+        next++;
+    }
+    for (size_t k = 0; k < share->skip; k++)
+    {
+        next++;
+        while (next < n && pairs[next].key == pairs[next - 1].key)
+        {
+            next++;
+        }
+    }
+
+    for (size_t i = share->first; i < share->last; i++)
+    {
+        mm_node *node = share->nodes[i];
+        init_node(share->mm, node);
+        node->isLeaf = 1;
+        node->nKeys = share->slots / share->width +
+                      (i < share->slots % share->width) - 1;
+        for (int j = 0; j < node->nKeys; j++)
+        {
+            take_key(share->mm, pairs, n, &next, &node->keys[j],
+                     &node->kNodes[j]);
+        }
+        reindex_node(node);
+        if (i + 1 < share->width)
+        {
+            take_key(share->mm, pairs, n, &next, &share->sepKeys[i],
+                     &share->sepKNodes[i]);
+        }
+    }
+    assert(share->last < share->width || next == n);
+
+    /* the thread is about to exit, so give back the blocks it has cached */
+    pool_flush(&share->mm->values);
+    return NULL;
+}
+
+
+/*
+ * The nodes from first up to last of a level above the leaves. Node i's
+ * kids, and the keys set aside between them, start at the same index
+ * below, since each node before it took one more kid than keys, and one
+ * more key went up after it.
+ */
+void * build_level(void *arg)
+{
+    build_share *share = arg;
+
+    for (size_t i = share->first; i < share->last; i++)
+    {
+        size_t extra = share->slots % share->width;
+        size_t start = i * (share->slots / share->width) +
+                       ((i < extra) ? i : extra);
+        mm_node *node = share->nodes[i];
+        init_node(share->mm, node);
+        node->isLeaf = 0;
+        node->nKeys = share->slots / share->width +
+                      (i < share->slots % share->width) - 1;
+        for (int j = 0; j < node->nKeys; j++)
+        {
+            node->kids[j] = share->kids[start + j];
+            node->keys[j] = share->kidKeys[start + j];
+            node->kNodes[j] = share->kidKNodes[start + j];
+        }
+        node->kids[node->nKeys] = share->kids[start + node->nKeys];
+        reindex_node(node);
+        if (i + 1 < share->width)
+        {
+            share->sepKeys[i] = share->kidKeys[start + node->nKeys];
+            share->sepKNodes[i] = share->kidKNodes[start + node->nKeys];
+        }
+    }
+    return NULL;
+}
+
+
+/* 
+ * Descends once from the root, the same way a search would, pushing each
+ * node onto the cursor's path along with the position searchInNode found
+ * in it. The walk stops at the key itself if it is in the tree, and at a
+ * leaf otherwise; either way, the last position pushed is the next key in
+ * order, and each position further up is the key that comes after the
+ * subtree below it.
+ */
+void cursor_seek(mm_cursor *cursor, multimap *mm, int key)
+{
+    mm_node *node = mm->root;
+
+    cursor->depth = 0;
+    cursor->kNode = NULL;
+    while (node != NULL)
+    {
+        int pos = searchInNode(node, key);
+
+        assert(cursor->depth < MAX_DEPTH);
+        cursor->path[cursor->depth] = node;
+        cursor->index[cursor->depth] = pos;
+        cursor->depth++;
+
+        if (node->isLeaf || (pos < node->nKeys && node->keys[pos] == key))
+        {
+            break;
+        }
+        node = node->kids[pos];
+    }
+}
+
+
+/*
+ * Hands out the key at the bottom of the path and moves past it: if that
+ * node is internal, the next key is the leftmost one in the kid to the
+ * right of the one just handed out, so that kid's left edge is pushed.
+ * Nodes that have run out of keys are popped, which leaves their parent
+ * pointing at its next key.
+ */
+int cursor_next_key(mm_cursor *cursor)
+{
+    while (cursor->depth > 0)
+    {
+        int top = cursor->depth - 1;
+        mm_node *node = cursor->path[top];
+        int i = cursor->index[top];
+
+        if (i >= node->nKeys)
+        {
+            cursor->depth--;
+            continue;
+        }
+
+        cursor->key = node->keys[i];
+        cursor->kNode = &node->kNodes[i];
+        values_begin(&cursor->values, cursor->kNode);
+        cursor->index[top] = i + 1;
+
+        if (!(node->isLeaf))
+        {
+            mm_node *kid = node->kids[i + 1];
+            while (kid != NULL)
+            {
+                assert(cursor->depth < MAX_DEPTH);
+                cursor->path[cursor->depth] = kid;
+                cursor->index[cursor->depth] = 0;
+                cursor->depth++;
+                kid = kid->isLeaf ? NULL : kid->kids[0];
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Free the values of a subtree of a multimap starting at the node "node"
+ * (the nodes themselves all go at once, with the arena). Essentially moves
  * in the same way as the traversal (same idea of visit 0th kid, 0th kNode,
  * then 1st kid, 1st kNode, and so on).
  */
-void free_multimap_node(mm_node *node)
+void free_multimap_values(multimap *mm, mm_node *node)
 {
     for (int i = 0; i < node->nKeys; i++) 
     {
         if (!(node->isLeaf)) 
         {
-            free_multimap_node(node->kids[i]);
+            free_multimap_values(mm, node->kids[i]);
         }
-        free(node->kNodes[i].values);
+        kNode_free(&mm->values, &node->kNodes[i]);
+    }
+
+    /* Again, one more subtree at the far right of a node after all values */
+    if (!(node->isLeaf)) 
+    {
+        free_multimap_values(mm, node->kids[node->nKeys]);
+    }
+}
+
+
+/* Initialize a multimap data structure, with nodes of MAX_KEYS keys. */
+multimap * init_multimap() 
+{                                                    
+    return init_multimap_with_config(NULL);
+}
+
+
+/* 
+ * Initialize a multimap data structure whose nodes take up (at most)
+ * config->node_size bytes. The fanout is the largest number of keys whose
+ * node fits in that many bytes, clamped to [MIN_KEYS, LIMIT_KEYS]. A
+ * node_size of 0 (or no config at all) gets nodes of MAX_KEYS keys.
+ */
+multimap * init_multimap_with_config(const mm_config *config)
+{
+    if (config == NULL || config->node_size == 0)
+    {
+        mm_config defaults;
+        defaults.node_size = node_size_for(MAX_KEYS);
+        defaults.fill_factor = (config != NULL) ? config->fill_factor : 0;
+        defaults.page_backing = (config != NULL) ? config->page_backing : 0;
+        defaults.concurrent = (config != NULL) ? config->concurrent : 0;
+        return init_multimap_with_config(&defaults);
+    }
+
+    select_search_impl();
+    multimap *mm = malloc(sizeof(multimap));
+    mm->root = NULL;
+    mm->concurrent = config->concurrent;
+    if (mm->concurrent == MM_CONCURRENT_BLINK)
+    {
+        /* a B-link tree needs every key in a leaf, see bPlusTree.c */
+        mm->concurrent = MM_CONCURRENT_LATCHES;
+    }
+    pthread_rwlock_init(&mm->rootLatch, NULL);
+    mm->rootVersion = 0;
+    pthread_mutex_init(&mm->nodesLock, NULL);
+    mm->epoch = NULL;
+    mm->origin = NULL;
+    mm->snapshots = 0;
+
+    /* 
+     * Each key costs its key, key_node and kid pointer (and Eytzinger
+     * entries), so estimate from the average cost of a key, then nudge the
+     * estimate until it is the largest layout, padding included, that fits.
+     */
+    size_t fixed = node_size_for(0);
+    size_t perKey = (node_size_for(2) - fixed) / 2;
+    size_t maxKeys = (config->node_size > fixed) ?
+                                (config->node_size - fixed) / perKey : 0;
+    if (maxKeys > LIMIT_KEYS)
+    {
+        maxKeys = LIMIT_KEYS;
+    }
+    while (maxKeys < LIMIT_KEYS &&
+           node_size_for(maxKeys + 1) <= config->node_size)
+    {
+        maxKeys++;
+    }
+    while (maxKeys > MIN_KEYS && node_size_for(maxKeys) > config->node_size)
+    {
+        maxKeys--;
     }
-
-    /* Again, one more subtree at the far right of a node after all values */
-    if (!(node->isLeaf)) 
+    if (maxKeys < MIN_KEYS)
     {
-        free_multimap_node(node->kids[node->nKeys]);
+        maxKeys = MIN_KEYS;
     }
-    free(node);
-}
+    mm->maxKeys = (int) maxKeys;
+    mm->minKeys = (mm->maxKeys - 1) / 2;
+    mm->nodeBytes = node_size_for(mm->maxKeys);
+    arena_init(&mm->nodes, mm->nodeBytes,
+               pages_backing(config->page_backing));
+    pool_init(&mm->values, mm->nodes.backing);
 
-
-/* Initialize a multimap data structure. */                                     
-multimap * init_multimap() 
-{                                                    
-    multimap *mm = malloc(sizeof(multimap));
-    mm->root = NULL;
+    /* bulk loaded nodes can't be any emptier than a split would leave them */
+    mm->fillKeys = mm->maxKeys;
+    if (config->fill_factor > 0 && config->fill_factor < 1)
+    {
+        mm->fillKeys = (int) (config->fill_factor * mm->maxKeys + 0.5);
+    }
+    if (mm->fillKeys < mm->minKeys)
+    {
+        mm->fillKeys = mm->minKeys;
+    }
     return mm;
 }
 
 
-/* Frees the contents of a whole multimap (not the multimap itself though) */
+/*
+ * Frees the contents of a whole multimap (not the multimap itself though).
+ * A snapshot just lets go of its root, which frees whatever the multimap
+ * it was taken of no longer has too.
+ */
 void clear_multimap(multimap *mm)
 {
     assert(mm != NULL);
+    if (mm->origin != NULL)
+    {
+        if (mm->root != NULL)
+        {
+            dropNode(mm->origin, mm->root);
+        }
+        __atomic_fetch_sub(&mm->origin->snapshots, 1, __ATOMIC_RELEASE);
+        mm->root = NULL;
+        return;
+    }
+    assert(mm->snapshots == 0);
+    if (mm->epoch != NULL)
+    {
+        epoch_free(mm->epoch);
+        mm->epoch = NULL;
+    }
     if (mm->root != NULL)
     {
-        free_multimap_node(mm->root);
+        free_multimap_values(mm, mm->root);
     }
+    arena_release(&mm->nodes);
+    pool_release(&mm->values);
     mm->root = NULL;
 }
 
@@ -464,38 +2792,261 @@ void clear_multimap(multimap *mm)
 /* Adds the specified (key, value) pair to the multimap. */
 void mm_add_value(multimap *mm, int key, int value) 
 {
-    assert(mm != NULL);
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent)
+    {
+        mm_node *held;
+        enterOptimistic(mm);
+        key_node *kNodePtr =
+            (mm->concurrent == MM_CONCURRENT_OPTIMISTIC) ?
+                find_node_optimistic(mm, key, /* create */ 1, &held) :
+                find_node_latched(mm, key, LATCH_EXCLUSIVE, 1, &held);
+        key_node kNode = *kNodePtr;
+        kNode_add(&mm->values, &kNode, value);
+        moveKNodes(mm, kNodePtr, &kNode, 1);
+        unlatchNode(mm, held);
+        exitOptimistic(mm);
+        return;
+    }
 
     /* Look up the key node with the specified key.  Create if not found. */
-    key_node *kNodePtr = find_node(mm, key, /* create */ 1);
+    key_node *kNodePtr = find_node(mm, key, /* create */ 1, NULL);
  
     assert(kNodePtr != NULL); 
-    assert(kNodePtr->key == key);
 
-    
-    /* 
-     * figure out how much space is left in the values array for this key node
-     * and realloc to extend the array if more space is needed. This works
-     * on the premise that space for values array is always an integer multiple
-     * of the cache line size (to help with caching), so spaceAlloced is first
-     * integer multiple of line size more than spaceTaken. (Could also do this
-     * with the ceiling function, but this is almost as simple)
-     */
-    int spaceTaken = kNodePtr->nVals * sizeof(multimap_value);
-    int spaceAlloced = 0;
-    while (spaceAlloced < spaceTaken)
+    kNode_add(&mm->values, kNodePtr, value);
+}
+
+
+/*
+ * Builds the tree bottom up when it is empty (see README point 5), which
+ * takes one pass over the pairs once they are sorted, instead of a descent
+ * (and maybe some splits) per pair.
+ */
+void mm_bulk_load(multimap *mm, const int *keys, const int *vals, size_t n)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->root != NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            mm_add_value(mm, keys[i], vals[i]);
+        }
+        return;
+    }
+
+    mm_pair *pairs = malloc(sizeof(mm_pair) * (n + 1));
+    for (size_t i = 0; i < n; i++)
+    {
+        pairs[i].key = keys[i];
+        pairs[i].value = vals[i];
+    }
+    if (!pairs_sorted(pairs, n))
+    {
+        sort_pairs(pairs, n);
+    }
+    bulk_build(mm, pairs, n);
+    free(pairs);
+}
+
+
+/*
+ * See bulk_build_parallel. A multimap that is not empty gets the pairs
+ * the way mm_add_values adds them, which is quicker than one at a time.
+ */
+void mm_bulk_load_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                           int nthreads)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->root != NULL)
+    {
+        mm_add_values(mm, pairs, n);
+        return;
+    }
+
+    mm_pair *sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+    {
+        sort_pairs_parallel(sorted, n, nthreads);
+    }
+    bulk_build_parallel(mm, sorted, n, nthreads);
+    free(sorted);
+}
+
+
+/*
+ * Sorting the batch brings together all the pairs of a key, which are then
+ * appended in one go, and puts the keys in ascending order, so that each
+ * one is usually either in the leaf the last one went into or beyond its
+ * bound (see leaf_hint). Keys in the same leaf go straight in without a
+ * descent, until the leaf fills up; the next descent then splits it.
+ * A concurrent multimap can't keep a leaf between keys, so it just adds the
+ * pairs one at a time.
+ */
+void mm_add_values(multimap *mm, const mm_pair *pairs, size_t n)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            mm_add_value(mm, pairs[i].key, pairs[i].value);
+        }
+        return;
+    }
+
+    mm_pair *sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+    {
+        sort_pairs(sorted, n);
+    }
+
+    leaf_hint hint = { NULL, 0, 0 };
+    size_t first = 0;
+    while (first < n)
+    {
+        int key = sorted[first].key;
+        size_t last = first + 1;
+        while (last < n && sorted[last].key == key)
+        {
+            last++;
+        }
+
+        key_node *kNodePtr;
+        mm_node *leaf = hint.leaf;
+        if (leaf != NULL && leaf->nKeys < mm->maxKeys &&
+            (!hint.bounded || key < hint.bound))
+        {
+            int pos = searchInNode(leaf, key);
+            if (pos < leaf->nKeys && leaf->keys[pos] == key)
+            {
+                kNodePtr = &leaf->kNodes[pos];
+            }
+            else
+            {
+                kNodePtr = insertInLeaf(mm, leaf, pos, key);
+            }
+        }
+        else
+        {
+            kNodePtr = find_node(mm, key, /* create */ 1, &hint);
+        }
+
+        kNode_add_values(&mm->values, kNodePtr, &sorted[first],
+                         last - first);
+        first = last;
+    }
+    free(sorted);
+}
+
+
+/*
+ * mm_remove_value for a concurrent multimap. The values are changed with
+ * just the node holding the key latched; if that was the last of them, the
+ * key is then removed in a pass of its own, unless another thread has added
+ * to it (or removed it) in between.
+ */
+int remove_value_latched(multimap *mm, int key, int value)
+{
+    mm_node *held;
+    key_node removed;
+
+    enterOptimistic(mm);
+    key_node *kNodePtr =
+        (mm->concurrent == MM_CONCURRENT_OPTIMISTIC) ?
+            find_node_optimistic(mm, key, /* create */ 0, &held) :
+            find_node_latched(mm, key, LATCH_EXCLUSIVE, 0, &held);
+    if (kNodePtr == NULL)
+    {
+        exitOptimistic(mm);
+        return 0;
+    }
+    key_node kNode = *kNodePtr;
+    int nRemoved = kNode_remove(&mm->values, &kNode, value);
+    moveKNodes(mm, kNodePtr, &kNode, 1);
+    int empty = kNode.nVals == 0;
+    unlatchNode(mm, held);
+
+    if (empty && removeKey(mm, key, &removed, /* onlyIfEmpty */ 1))
+    {
+        kNode_free(&mm->values, &removed);
+    }
+    exitOptimistic(mm);
+    return nRemoved;
+}
+
+
+/*
+ * Removes every occurrence of the (key, value) pair from the multimap. The
+ * remaining values are packed down, and the values array is shrunk back to
+ * the smallest number of cache lines that holds them; if no values are
+ * left, the key is removed as well. Returns how many pairs were removed.
+ */
+int mm_remove_value(multimap *mm, int key, int value)
+{
+    assert(mm != NULL && mm->origin == NULL);
+
+    if (mm->concurrent)
     {
-        spaceAlloced += LINE_SIZE;
+        return remove_value_latched(mm, key, value);
     }
-    if (spaceAlloced - spaceTaken < sizeof(multimap_value))
+
+    key_node *kNodePtr = find_node(mm, key, /* create */ 0, NULL);
+    if (kNodePtr == NULL)
+    {
+        return 0;
+    }
+    if (__atomic_load_n(&mm->snapshots, __ATOMIC_ACQUIRE))
+    {
+        /* the key's node may be shared, so go down again to make it ours */
+        kNodePtr = find_node(mm, key, /* create */ 1, NULL);
+    }
+
+    int removed = kNode_remove(&mm->values, kNodePtr, value);
+    if (kNodePtr->nVals == 0)
     {
-        kNodePtr->values = (multimap_value *) realloc(kNodePtr->values, 
-                                                      spaceAlloced + LINE_SIZE);
+        mm_remove_key(mm, key);
     }
+    return removed;
+}
+
+
+/*
+ * Removes a key and all of its values from the multimap, returning how
+ * many values it had (zero if the key wasn't there).
+ */
+int mm_remove_key(multimap *mm, int key)
+{
+    key_node removed;
 
-    /* Add the new value to the key node. */
-    kNodePtr->values[kNodePtr->nVals] = value;
-    kNodePtr->nVals++;
+    assert(mm != NULL && mm->origin == NULL);
+
+    /* don't rebalance anything on the way down for a key that isn't there */
+    if (!mm_contains_key(mm, key))
+    {
+        return 0;
+    }
+    if (mm->concurrent)
+    {
+        /* someone else may have removed it since */
+        enterOptimistic(mm);
+        int found = removeKey(mm, key, &removed, 0);
+        if (found)
+        {
+            kNode_free(&mm->values, &removed);
+        }
+        exitOptimistic(mm);
+        return found ? removed.nVals : 0;
+    }
+    removeKey(mm, key, &removed, 0);
+    kNode_free(&mm->values, &removed);
+    return removed.nVals;
 }
 
 
@@ -504,7 +3055,21 @@ void mm_add_value(multimap *mm, int key, int value)
  * otherwise.
  */
 int mm_contains_key(multimap *mm, int key) {
-    return find_node(mm, key, /* create */ 0) != NULL;
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        return contains_optimistic(mm, key, 0, /* checkValue */ 0);
+    }
+    if (mm->concurrent)
+    {
+        mm_node *held;
+        if (find_node_latched(mm, key, LATCH_SHARED, 0, &held) == NULL)
+        {
+            return 0;
+        }
+        unlatchNode(mm, held);
+        return 1;
+    }
+    return find_node(mm, key, /* create */ 0, NULL) != NULL;
 }
 
 
@@ -514,24 +3079,150 @@ int mm_contains_key(multimap *mm, int key) {
  */
 int mm_contains_pair(multimap *mm, int key, int value) 
 {
+    if (mm->concurrent == MM_CONCURRENT_OPTIMISTIC)
+    {
+        return contains_optimistic(mm, key, value, /* checkValue */ 1);
+    }
+    if (mm->concurrent)
+    {
+        mm_node *held;
+        key_node *kNodePtr = find_node_latched(mm, key, LATCH_SHARED, 0,
+                                               &held);
+        if (kNodePtr == NULL)
+        {
+            return 0;
+        }
+        int found = kNode_contains(kNodePtr, value);
+        unlatchNode(mm, held);
+        return found;
+    }
+
     /* Is the right key_node even there? */
-    key_node *kNodePtr = find_node(mm, key, /* create */ 0);
+    key_node *kNodePtr = find_node(mm, key, /* create */ 0, NULL);
     if (kNodePtr == NULL)
     {
         return 0;
     }
 
     /* if it is, is the right value in that key node? */
-    multimap_value *curr = kNodePtr->values;
-    for (int i = 0; i < kNodePtr->nVals; i++)
+    return kNode_contains(kNodePtr, value);
+}
+
+
+/* 
+ * Works through the lookups PROBE_GROUP at a time, in the style of AMAC
+ * (asynchronous memory access chaining). Each lookup is a chain of
+ * dependent loads: node after node down the tree, then the key_node, then
+ * its values. Rather than waiting for each of them in turn, a lookup
+ * prefetches whatever it needs next, and then the other lookups in the
+ * group take a step each while it arrives. A lookup that finishes hands
+ * its slot to the next pair straight away, so lookups that stop early
+ * (at a key in an internal node, or at a leaf without the key) don't hold
+ * the group up. Lookups in a concurrent multimap have to hold latches as
+ * they go, so they are done one at a time instead.
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+                       int *out, size_t n)
+{
+    probe_state group[PROBE_GROUP];
+    size_t next = 0;
+    int inFlight = 0;
+
+    if (mm->concurrent)
     {
-        if (*curr == value)
+        for (size_t i = 0; i < n; i++)
         {
-            return 1;
+            out[i] = mm_contains_pair(mm, keys[i], vals[i]);
         }
-        curr++;
+        return;
+    }
+
+    if (mm->root == NULL)
+    {
+        memset(out, 0, sizeof(int) * n);
+        return;
+    }
+    for (int g = 0; g < PROBE_GROUP; g++)
+    {
+        group[g].stage = PROBE_IDLE;
+    }
+
+    do
+    {
+        for (int g = 0; g < PROBE_GROUP; g++)
+        {
+            probe_state *probe = &group[g];
+            switch (probe->stage)
+            {
+            case PROBE_IDLE:
+                if (next < n)
+                {
+                    probe->stage = PROBE_NODE;
+                    probe->index = next++;
+                    probe->node = mm->root;
+                    inFlight++;
+                }
+                break;
+
+            case PROBE_NODE:
+            {
+                mm_node *node = probe->node;
+                int key = keys[probe->index];
+                int pos = searchInNode(node, key);
+
+                if (pos < node->nKeys && node->keys[pos] == key)
+                {
+                    probe->kNode = &node->kNodes[pos];
+                    __builtin_prefetch(probe->kNode);
+                    probe->stage = PROBE_KNODE;
+                }
+                else if (node->isLeaf)
+                {
+                    out[probe->index] = 0;
+                    probe->stage = PROBE_IDLE;
+                    inFlight--;
+                }
+                else
+                {
+                    probe->node = node->kids[pos];
+                    prefetch_node(probe->node);
+                }
+                break;
+            }
+
+            case PROBE_KNODE:
+            {
+                kNode_prefetch(probe->kNode, vals[probe->index],
+                               PREFETCH_LINES * LINE_SIZE);
+                probe->stage = PROBE_VALUES;
+                break;
+            }
+
+            case PROBE_VALUES:
+                out[probe->index] = kNode_contains(probe->kNode,
+                                                   vals[probe->index]);
+                probe->stage = PROBE_IDLE;
+                inFlight--;
+                break;
+            }
+        }
+    } while (inFlight > 0 || next < n);
+}
+
+
+/*
+ * The first few lines are the header and the keys a linear search starts
+ * with; the hardware prefetcher picks up the rest of a long scan itself.
+ * The other search strategies jump around the node, but still start near
+ * the front of keys (binary) or need the header first (Eytzinger).
+ */
+void prefetch_node(mm_node *node)
+{
+    const char *start = (const char *) node;
+    for (int i = 0; i < PREFETCH_LINES; i++)
+    {
+        __builtin_prefetch(start + i * LINE_SIZE);
     }
-    return 0;
 }
 
 
@@ -547,13 +3238,16 @@ int mm_contains_pair(multimap *mm, int key, int value)
  *
  * This helper function handles the inner level of this loop.
  */
-void kNode_traverse(key_node *kNodePtr, void (*f)(int key, int value))
+void kNode_traverse(int key, key_node *kNodePtr,
+                    void (*f)(int key, int value))
 {
-    multimap_value *curr = kNodePtr->values;
-    for (int i = 0; i < kNodePtr->nVals; i++)
+    value_iter values;
+    int value;
+
+    values_begin(&values, kNodePtr);
+    while (values_next(&values, &value))
     {
-        f(kNodePtr->key, *curr);
-        curr++;
+        f(key, value);
     }
 }
     
@@ -575,7 +3269,7 @@ void mm_traverse_helper(mm_node *node, void (*f)(int key, int value))
         {
             mm_traverse_helper(node->kids[i], f);
         }
-        kNode_traverse(&node->kNodes[i], f);
+        kNode_traverse(node->keys[i], &node->kNodes[i], f);
     }
 
     /* At the end, one subtree after all key nodes, so look at that too */
@@ -592,9 +3286,188 @@ void mm_traverse_helper(mm_node *node, void (*f)(int key, int value))
  */
 void mm_traverse(multimap *mm, void (*f)(int key, int value)) 
 {
-    mm_traverse_helper(mm->root, f);
+    if (mm->root != NULL)
+    {
+        mm_traverse_helper(mm->root, f);
+    }
 }
     
 
     
 
+
+/*
+ * The same traversal as mm_traverse, but driven by a cursor rather than by
+ * recursion, so that it can stop part of the way through.
+ */
+void mm_traverse_ex(multimap *mm, int (*f)(void *ctx, int key, int value),
+                    void *ctx)
+{
+    mm_cursor cursor;
+    int value;
+
+    cursor_seek(&cursor, mm, INT_MIN);
+    while (cursor_next_key(&cursor))
+    {
+        while (values_next(&cursor.values, &value))
+        {
+            if (f(ctx, cursor.key, value))
+            {
+                return;
+            }
+        }
+    }
+}
+
+
+/*
+ * Each key's values array is handed over as it is, unless they are packed
+ * (see mmvalues.h), in which case they are unpacked into a buffer first.
+ */
+void mm_traverse_values(multimap *mm,
+                        int (*f)(void *ctx, int key, const int *values,
+                                 int nVals),
+                        void *ctx)
+{
+    mm_cursor cursor;
+    multimap_value *buffer = NULL;
+
+    cursor_seek(&cursor, mm, INT_MIN);
+    while (cursor_next_key(&cursor))
+    {
+        if (f(ctx, cursor.key, kNode_values(cursor.kNode, &buffer),
+              cursor.kNode->nVals))
+        {
+            break;
+        }
+    }
+    free(buffer);
+}
+
+
+/* 
+ * Passes each (key, value) pair with lo <= key < hi to f, in order: one
+ * descent to find lo, then a walk forward from there until hi, so this
+ * costs O(log n + k) for k pairs rather than a full traversal.
+ */
+void mm_range(multimap *mm, int lo, int hi,
+              int (*f)(void *ctx, int key, int value), void *ctx)
+{
+    mm_cursor cursor;
+    int key, value;
+
+    cursor_seek(&cursor, mm, lo);
+    while (mm_cursor_next(&cursor, &key, &value) && key < hi)
+    {
+        if (f(ctx, key, value))
+        {
+            break;
+        }
+    }
+}
+
+
+/* Returns a cursor positioned just before the first key >= key. */
+mm_cursor * mm_cursor_seek(multimap *mm, int key)
+{
+    mm_cursor *cursor = malloc(sizeof(mm_cursor));
+    cursor_seek(cursor, mm, key);
+    return cursor;
+}
+
+
+/* Hands out the next pair, moving on to the next key when needed. */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value)
+{
+    while (cursor->kNode == NULL || !values_next(&cursor->values, value))
+    {
+        if (!cursor_next_key(cursor))
+        {
+            return 0;
+        }
+    }
+    *key = cursor->key;
+    return 1;
+}
+
+
+void mm_cursor_free(mm_cursor *cursor)
+{
+    free(cursor);
+}
+
+
+/*
+ * A snapshot is a multimap whose root is the tree's root, shared (see
+ * ownNode), and whose nodes all go back to the arena of the multimap it was
+ * taken of. A snapshot of a snapshot shares the same nodes again.
+ */
+multimap * mm_snapshot(multimap *mm)
+{
+    assert(mm != NULL);
+
+    if (mm->concurrent)
+    {
+        return NULL;
+    }
+    multimap *origin = (mm->origin != NULL) ? mm->origin : mm;
+    multimap *snap = malloc(sizeof(multimap));
+    bzero(snap, sizeof(multimap));
+    snap->root = mm->root;
+    snap->maxKeys = mm->maxKeys;
+    snap->minKeys = mm->minKeys;
+    snap->fillKeys = mm->fillKeys;
+    snap->nodeBytes = mm->nodeBytes;
+    snap->origin = origin;
+    if (snap->root != NULL)
+    {
+        __atomic_fetch_add(&snap->root->shared, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&origin->snapshots, 1, __ATOMIC_RELEASE);
+    return snap;
+}
+
+
+/*
+ * Trims every key's values array down to the block its values need, unless
+ * they may be shared with a snapshot, and hands the blocks this thread has
+ * cached back to the pool.
+ */
+void mm_shrink_to_fit(multimap *mm)
+{
+    mm_cursor cursor;
+
+    if (mm->origin != NULL ||
+        __atomic_load_n(&mm->snapshots, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    cursor_seek(&cursor, mm, INT_MIN);
+    while (cursor_next_key(&cursor))
+    {
+        kNode_shrink(&mm->values, cursor.kNode);
+    }
+    pool_flush(&mm->values);
+}
+
+
+/* Counts the allocator calls for values made so far by this thread, for
+ * every multimap.
+ */
+void mm_get_alloc_stats(mm_alloc_stats *stats)
+{
+    *stats = value_stats;
+}
+
+
+/* Prints how this multimap is built, for the performance tests. */
+void mm_print_info(multimap *mm)
+{
+    printf("Multimap:  b-tree, %d keys per node (%d bytes), %s search, "
+           "%s%s.\n", mm->maxKeys, (int) mm->nodeBytes, searchImplName,
+           pages_name(mm->nodes.backing),
+           (mm->concurrent == MM_CONCURRENT_OPTIMISTIC) ?
+                ", optimistic lock coupling" :
+           mm->concurrent ? ", latch crabbing" : "");
+}
@@ -1,9 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "multimap.h"
+#include "mmsort.h"
 
 
 /*============================================================================
@@ -48,12 +50,35 @@ typedef struct multimap_node {
 } multimap_node;
 
 
+/* A position in an in-order walk of the tree.  The stack holds the nodes
+ * whose keys are still to come, nearest first; the tree can be arbitrarily
+ * deep, so it grows as needed.
+ */
+struct mm_cursor {
+    multimap_node **stack;
+    int depth;
+    int capacity;
+
+    /* The node whose values are being handed out, and where in them. */
+    multimap_node *node;
+    multimap_value *next_value;
+};
+
+
 /* The entry-point of the multimap data structure. */
 struct multimap {
     multimap_node *root;
+    int concurrent;          /* the tree is locked (see lock_tree()) */
+    pthread_rwlock_t lock;
 };
 
 
+/* The allocator calls made for values so far by each thread, by every
+ * multimap.
+ */
+static _Thread_local mm_alloc_stats value_stats;
+
+
 /*============================================================================
  * HELPER FUNCTION DECLARATIONS
  *
@@ -62,13 +87,27 @@ struct multimap {
  *============================================================================*/
 
 multimap_node * alloc_mm_node();
+multimap_value * alloc_mm_value(int value);
 
 multimap_node * find_mm_node(multimap_node *root, int key,
                              int create_if_not_found);
 
+multimap_node * unlink_mm_node(multimap_node **link, int key);
+
+multimap_node * build_mm_node(const mm_pair *pairs, const size_t *starts,
+                              size_t lo, size_t hi);
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n);
+
+void cursor_push(mm_cursor *cursor, multimap_node *node);
+
 void free_multimap_values(multimap_value *values);
 void free_multimap_node(multimap_node *node);
 
+multimap_node * copy_mm_node(const multimap_node *node);
+
+void lock_tree(multimap *mm, int exclusive);
+void unlock_tree(multimap *mm);
+
 
 /*============================================================================
  * FUNCTION IMPLEMENTATIONS
@@ -85,6 +124,17 @@ multimap_node * alloc_mm_node() {
 }
 
 
+/* Allocates a value for the end of a value-list. */
+multimap_value * alloc_mm_value(int value) {
+    multimap_value *new_value = malloc(sizeof(multimap_value));
+    new_value->value = value;
+    new_value->next = NULL;
+
+    value_stats.mallocs++;
+    return new_value;
+}
+
+
 /* This helper function searches for the multimap node that contains the
  * specified key.  If such a node doesn't exist, the function can initialize
  * a new node and add this into the structure, or it will simply return NULL.
@@ -139,6 +189,94 @@ multimap_node * find_mm_node(multimap_node *root, int key,
 }
 
 
+/* This helper function removes the node with the specified key from the
+ * subtree that *link points to, and returns it with its children cleared
+ * (or returns NULL if there is no such node).  A node with two children is
+ * replaced by its in-order successor, which is spliced out of its old spot.
+ */
+multimap_node * unlink_mm_node(multimap_node **link, int key) {
+    multimap_node *node, **succ_link, *succ;
+
+    while (*link != NULL && (*link)->key != key) {
+        if ((*link)->key > key)
+            link = &(*link)->left_child;
+        else
+            link = &(*link)->right_child;
+    }
+
+    node = *link;
+    if (node == NULL)
+        return NULL;
+
+    if (node->left_child == NULL) {
+        *link = node->right_child;
+    }
+    else if (node->right_child == NULL) {
+        *link = node->left_child;
+    }
+    else {
+        succ_link = &node->right_child;
+        while ((*succ_link)->left_child != NULL)
+            succ_link = &(*succ_link)->left_child;
+
+        succ = *succ_link;
+        *succ_link = succ->right_child;
+        succ->left_child = node->left_child;
+        succ->right_child = node->right_child;
+        *link = succ;
+    }
+
+    node->left_child = NULL;
+    node->right_child = NULL;
+    return node;
+}
+
+
+/* Builds a perfectly balanced subtree holding the keys lo through hi - 1 of
+ * the sorted pairs, where key i's pairs run from starts[i] up to
+ * starts[i + 1].  The middle key goes at the top, so the tree is only as
+ * deep as it has to be.
+ */
+multimap_node * build_mm_node(const mm_pair *pairs, const size_t *starts,
+                              size_t lo, size_t hi) {
+    multimap_node *node;
+    multimap_value *new_value;
+    size_t mid, i;
+
+    if (lo >= hi)
+        return NULL;
+
+    mid = lo + (hi - lo) / 2;
+    node = alloc_mm_node();
+    node->key = pairs[starts[mid]].key;
+    for (i = starts[mid]; i < starts[mid + 1]; i++) {
+        new_value = alloc_mm_value(pairs[i].value);
+
+        if (node->values_tail != NULL)
+            node->values_tail->next = new_value;
+        else
+            node->values = new_value;
+
+        node->values_tail = new_value;
+    }
+
+    node->left_child = build_mm_node(pairs, starts, lo, mid);
+    node->right_child = build_mm_node(pairs, starts, mid + 1, hi);
+    return node;
+}
+
+
+/* Pushes a node onto a cursor's stack, growing the stack if it is full. */
+void cursor_push(mm_cursor *cursor, multimap_node *node) {
+    if (cursor->depth == cursor->capacity) {
+        cursor->capacity = cursor->capacity ? 2 * cursor->capacity : 32;
+        cursor->stack = realloc(cursor->stack,
+                                cursor->capacity * sizeof(multimap_node *));
+    }
+    cursor->stack[cursor->depth++] = node;
+}
+
+
 /* This helper function frees all values in a multimap node's value-list. */
 void free_multimap_values(multimap_value *values) {
     while (values != NULL) {
@@ -148,6 +286,7 @@ void free_multimap_values(multimap_value *values) {
         bzero(values, sizeof(multimap_value));
 #endif
         free(values);
+        value_stats.frees++;
         values = next;
     }
 }
@@ -179,10 +318,44 @@ void free_multimap_node(multimap_node *node) {
 multimap * init_multimap() {
     multimap *mm = malloc(sizeof(multimap));
     mm->root = NULL;
+    mm->concurrent = 0;
+    pthread_rwlock_init(&mm->lock, NULL);
+    return mm;
+}
+
+
+/* Initialize a multimap data structure.  A binary tree has no settings
+ * worth tuning, so the configuration is ignored, other than whether it
+ * is to be used from many threads.
+ */
+multimap * init_multimap_with_config(const mm_config *config) {
+    multimap *mm = init_multimap();
+
+    if (config != NULL)
+        mm->concurrent = config->concurrent;
     return mm;
 }
 
 
+/* A concurrent binary tree is locked as a whole, exclusive to change it
+ * and shared to look things up in it.
+ */
+void lock_tree(multimap *mm, int exclusive) {
+    if (!mm->concurrent)
+        return;
+    if (exclusive)
+        pthread_rwlock_wrlock(&mm->lock);
+    else
+        pthread_rwlock_rdlock(&mm->lock);
+}
+
+
+void unlock_tree(multimap *mm) {
+    if (mm->concurrent)
+        pthread_rwlock_unlock(&mm->lock);
+}
+
+
 /* Release all dynamically allocated memory associated with the multimap
  * data structure.
  */
@@ -200,6 +373,8 @@ void mm_add_value(multimap *mm, int key, int value) {
 
     assert(mm != NULL);
 
+    lock_tree(mm, 1);
+
     /* Look up the node with the specified key.  Create if not found. */
     node = find_mm_node(mm->root, key, /* create */ 1);
     if (mm->root == NULL)
@@ -210,9 +385,7 @@ void mm_add_value(multimap *mm, int key, int value) {
 
     /* Add the new value to the multimap node. */
 
-    new_value = malloc(sizeof(multimap_value));
-    new_value->value = value;
-    new_value->next = NULL;
+    new_value = alloc_mm_value(value);
 
     if (node->values_tail != NULL)
         node->values_tail->next = new_value;
@@ -220,6 +393,181 @@ void mm_add_value(multimap *mm, int key, int value) {
         node->values = new_value;
 
     node->values_tail = new_value;
+    unlock_tree(mm);
+}
+
+
+/* Adds the n pairs (keys[i], vals[i]) to the multimap.  An empty multimap is
+ * built as a balanced tree straight from the sorted pairs (adding sorted
+ * keys one at a time would make the tree a linked list); a binary tree has
+ * no nodes to pack, so the fill factor is ignored.
+ */
+void mm_bulk_load(multimap *mm, const int *keys, const int *vals, size_t n) {
+    mm_pair *pairs;
+    size_t i;
+
+    assert(mm != NULL);
+
+    if (mm->root != NULL) {
+        for (i = 0; i < n; i++)
+            mm_add_value(mm, keys[i], vals[i]);
+        return;
+    }
+
+    pairs = malloc(sizeof(mm_pair) * (n + 1));
+    for (i = 0; i < n; i++) {
+        pairs[i].key = keys[i];
+        pairs[i].value = vals[i];
+    }
+    if (!pairs_sorted(pairs, n))
+        sort_pairs(pairs, n);
+    bulk_build(mm, pairs, n);
+    free(pairs);
+}
+
+
+/* Only the sort is done by many threads:  building the tree is one pass
+ * over the sorted pairs, which takes far less time.
+ */
+void mm_bulk_load_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                           int nthreads) {
+    mm_pair *sorted;
+
+    assert(mm != NULL);
+
+    if (mm->root != NULL) {
+        mm_add_values(mm, pairs, n);
+        return;
+    }
+
+    sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+        sort_pairs_parallel(sorted, n, nthreads);
+    bulk_build(mm, sorted, n);
+    free(sorted);
+}
+
+
+/* Builds the tree of an empty multimap from n pairs sorted by key. */
+void bulk_build(multimap *mm, const mm_pair *pairs, size_t n) {
+    size_t *starts;
+    size_t i, num_keys;
+
+    /* Find where each key's run of pairs starts. */
+    starts = malloc(sizeof(size_t) * (n + 1));
+    for (i = 0, num_keys = 0; i < n; i++) {
+        if (i == 0 || pairs[i].key != pairs[i - 1].key)
+            starts[num_keys++] = i;
+    }
+    starts[num_keys] = n;
+
+    mm->root = build_mm_node(pairs, starts, 0, num_keys);
+    free(starts);
+}
+
+
+/* Adds the n pairs to the multimap.  The batch is sorted so that all the
+ * values of a key can be added after looking the key up just once.
+ */
+void mm_add_values(multimap *mm, const mm_pair *pairs, size_t n) {
+    multimap_node *node;
+    multimap_value *new_value;
+    mm_pair *sorted;
+    size_t i;
+
+    assert(mm != NULL);
+
+    sorted = malloc(sizeof(mm_pair) * (n + 1));
+    memcpy(sorted, pairs, sizeof(mm_pair) * n);
+    if (!pairs_sorted(sorted, n))
+        sort_pairs(sorted, n);
+
+    lock_tree(mm, 1);
+    for (i = 0, node = NULL; i < n; i++) {
+        if (node == NULL || node->key != sorted[i].key) {
+            node = find_mm_node(mm->root, sorted[i].key, /* create */ 1);
+            if (mm->root == NULL)
+                mm->root = node;
+        }
+
+        new_value = alloc_mm_value(sorted[i].value);
+
+        if (node->values_tail != NULL)
+            node->values_tail->next = new_value;
+        else
+            node->values = new_value;
+
+        node->values_tail = new_value;
+    }
+    unlock_tree(mm);
+    free(sorted);
+}
+
+
+/* Removes every occurrence of the specified (key, value) pair from the
+ * multimap, and the key itself if that leaves it with no values.  Returns
+ * the number of pairs that were removed.
+ */
+int mm_remove_value(multimap *mm, int key, int value) {
+    multimap_node *node;
+    multimap_value **link, *curr;
+    int removed = 0;
+
+    assert(mm != NULL);
+
+    lock_tree(mm, 1);
+    node = find_mm_node(mm->root, key, /* create */ 0);
+    if (node == NULL) {
+        unlock_tree(mm);
+        return 0;
+    }
+
+    link = &node->values;
+    node->values_tail = NULL;
+    while (*link != NULL) {
+        curr = *link;
+        if (curr->value == value) {
+            *link = curr->next;
+            free(curr);
+            value_stats.frees++;
+            removed++;
+        }
+        else {
+            node->values_tail = curr;
+            link = &curr->next;
+        }
+    }
+
+    if (node->values == NULL)
+        free_multimap_node(unlink_mm_node(&mm->root, key));
+
+    unlock_tree(mm);
+    return removed;
+}
+
+
+/* Removes the specified key and all of its values from the multimap.
+ * Returns the number of pairs that were removed.
+ */
+int mm_remove_key(multimap *mm, int key) {
+    multimap_node *node;
+    multimap_value *curr;
+    int removed = 0;
+
+    assert(mm != NULL);
+
+    lock_tree(mm, 1);
+    node = unlink_mm_node(&mm->root, key);
+    unlock_tree(mm);
+    if (node == NULL)
+        return 0;
+
+    for (curr = node->values; curr != NULL; curr = curr->next)
+        removed++;
+
+    free_multimap_node(node);
+    return removed;
 }
 
 
@@ -227,7 +575,12 @@ void mm_add_value(multimap *mm, int key, int value) {
  * otherwise.
  */
 int mm_contains_key(multimap *mm, int key) {
-    return find_mm_node(mm->root, key, /* create */ 0) != NULL;
+    int found;
+
+    lock_tree(mm, 0);
+    found = find_mm_node(mm->root, key, /* create */ 0) != NULL;
+    unlock_tree(mm);
+    return found;
 }
 
 
@@ -237,20 +590,34 @@ int mm_contains_key(multimap *mm, int key) {
 int mm_contains_pair(multimap *mm, int key, int value) {
     multimap_node *node;
     multimap_value *curr;
+    int found = 0;
 
+    lock_tree(mm, 0);
     node = find_mm_node(mm->root, key, /* create */ 0);
-    if (node == NULL)
-        return 0;
-
-    curr = node->values;
+    curr = (node != NULL) ? node->values : NULL;
     while (curr != NULL) {
-        if (curr->value == value)
-            return 1;
+        if (curr->value == value) {
+            found = 1;
+            break;
+        }
 
         curr = curr->next;
     }
 
-    return 0;
+    unlock_tree(mm);
+    return found;
+}
+
+
+/* Checks n pairs at once.  The binary tree is only here for comparison, so
+ * this just checks one pair after another.
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+                       int *out, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        out[i] = mm_contains_pair(mm, keys[i], vals[i]);
 }
 
 
@@ -282,3 +649,242 @@ void mm_traverse(multimap *mm, void (*f)(int key, int value)) {
     mm_traverse_helper(mm->root, f);
 }
 
+
+/* This helper function is used by mm_range() to visit the pairs with
+ * lo <= key < hi, skipping subtrees that lie entirely outside the range.
+ * Returns nonzero once f has asked to stop.
+ */
+int mm_range_helper(multimap_node *node, int lo, int hi,
+                    int (*f)(void *ctx, int key, int value), void *ctx) {
+    multimap_value *curr;
+
+    if (node == NULL)
+        return 0;
+
+    if (node->key > lo && mm_range_helper(node->left_child, lo, hi, f, ctx))
+        return 1;
+
+    if (node->key >= lo && node->key < hi) {
+        for (curr = node->values; curr != NULL; curr = curr->next) {
+            if (f(ctx, node->key, curr->value))
+                return 1;
+        }
+    }
+
+    if (node->key < hi - 1)
+        return mm_range_helper(node->right_child, lo, hi, f, ctx);
+
+    return 0;
+}
+
+
+/* Passes each (key, value) pair with lo <= key < hi to the specified
+ * function, in order, stopping early if the function returns nonzero.
+ */
+void mm_range(multimap *mm, int lo, int hi,
+              int (*f)(void *ctx, int key, int value), void *ctx) {
+    if (lo < hi)
+        mm_range_helper(mm->root, lo, hi, f, ctx);
+}
+
+
+/* Returns a cursor positioned just before the first key >= key.  Every node
+ * on the way down whose key is >= key is somewhere after the start, and is
+ * pushed; the nodes we go right from come before it, and are not.
+ */
+mm_cursor * mm_cursor_seek(multimap *mm, int key) {
+    mm_cursor *cursor = malloc(sizeof(mm_cursor));
+    multimap_node *node = mm->root;
+
+    bzero(cursor, sizeof(mm_cursor));
+    while (node != NULL) {
+        if (node->key >= key) {
+            cursor_push(cursor, node);
+            if (node->key == key)
+                break;
+            node = node->left_child;
+        }
+        else {
+            node = node->right_child;
+        }
+    }
+    return cursor;
+}
+
+
+/* Hands out the next pair.  When a node's values run out, the next node is
+ * popped off the stack, and the left edge of its right subtree is pushed,
+ * since all of that comes before whatever is under it on the stack.
+ */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value) {
+    multimap_node *node;
+
+    while (cursor->next_value == NULL) {
+        if (cursor->depth == 0)
+            return 0;
+
+        cursor->node = cursor->stack[--cursor->depth];
+        cursor->next_value = cursor->node->values;
+        for (node = cursor->node->right_child; node != NULL;
+             node = node->left_child) {
+            cursor_push(cursor, node);
+        }
+    }
+
+    *key = cursor->node->key;
+    *value = cursor->next_value->value;
+    cursor->next_value = cursor->next_value->next;
+    return 1;
+}
+
+
+void mm_cursor_free(mm_cursor *cursor) {
+    free(cursor->stack);
+    free(cursor);
+}
+
+
+/* This helper function is used by mm_traverse_ex() to traverse every pair
+ * within the multimap.  Returns nonzero once f has asked to stop.
+ */
+int mm_traverse_ex_helper(multimap_node *node,
+                          int (*f)(void *ctx, int key, int value), void *ctx) {
+    multimap_value *curr;
+
+    if (node == NULL)
+        return 0;
+
+    if (mm_traverse_ex_helper(node->left_child, f, ctx))
+        return 1;
+
+    for (curr = node->values; curr != NULL; curr = curr->next) {
+        if (f(ctx, node->key, curr->value))
+            return 1;
+    }
+
+    return mm_traverse_ex_helper(node->right_child, f, ctx);
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each (key, value)
+ * pair to the specified function along with ctx, and stopping early if the
+ * function returns nonzero.
+ */
+void mm_traverse_ex(multimap *mm, int (*f)(void *ctx, int key, int value),
+                    void *ctx) {
+    mm_traverse_ex_helper(mm->root, f, ctx);
+}
+
+
+/* The state mm_traverse_values() carries through the tree.  The values of
+ * each key are copied out of their linked list into buffer, which grows to
+ * fit the key with the most values.
+ */
+typedef struct values_walk {
+    int (*f)(void *ctx, int key, const int *values, int nVals);
+    void *ctx;
+    int *buffer;
+    int capacity;
+} values_walk;
+
+
+/* This helper function is used by mm_traverse_values() to visit every key
+ * within the multimap.  Returns nonzero once the function has asked to stop.
+ */
+int mm_traverse_values_helper(multimap_node *node, values_walk *walk) {
+    multimap_value *curr;
+    int n = 0;
+
+    if (node == NULL)
+        return 0;
+
+    if (mm_traverse_values_helper(node->left_child, walk))
+        return 1;
+
+    for (curr = node->values; curr != NULL; curr = curr->next) {
+        if (n == walk->capacity) {
+            walk->capacity = walk->capacity ? 2 * walk->capacity : 16;
+            walk->buffer = realloc(walk->buffer,
+                                   walk->capacity * sizeof(int));
+        }
+        walk->buffer[n++] = curr->value;
+    }
+    if (walk->f(walk->ctx, node->key, walk->buffer, n))
+        return 1;
+
+    return mm_traverse_values_helper(node->right_child, walk);
+}
+
+
+/* Performs an in-order traversal of the multimap, passing each key and an
+ * array of all its values to the specified function along with ctx, and
+ * stopping early if the function returns nonzero.
+ */
+void mm_traverse_values(multimap *mm,
+                        int (*f)(void *ctx, int key, const int *values,
+                                 int nVals),
+                        void *ctx) {
+    values_walk walk = { f, ctx, NULL, 0 };
+
+    mm_traverse_values_helper(mm->root, &walk);
+    free(walk.buffer);
+}
+
+
+/* A snapshot of a binary tree is a copy of it, node for node. */
+multimap * mm_snapshot(multimap *mm) {
+    multimap *snap;
+
+    if (mm->concurrent)
+        return NULL;
+    snap = init_multimap();
+    snap->root = copy_mm_node(mm->root);
+    return snap;
+}
+
+
+/* This helper function copies a multimap node, its value-list and its
+ * children.
+ */
+multimap_node * copy_mm_node(const multimap_node *node) {
+    multimap_node *copy;
+    multimap_value *value, *tail = NULL;
+
+    if (node == NULL)
+        return NULL;
+
+    copy = alloc_mm_node();
+    copy->key = node->key;
+    for (value = node->values; value != NULL; value = value->next) {
+        multimap_value *new_value = alloc_mm_value(value->value);
+        if (tail == NULL)
+            copy->values = new_value;
+        else
+            tail->next = new_value;
+        tail = new_value;
+    }
+    copy->values_tail = tail;
+    copy->left_child = copy_mm_node(node->left_child);
+    copy->right_child = copy_mm_node(node->right_child);
+    return copy;
+}
+
+
+/* Values are one list cell each, so there is no slack to trim. */
+void mm_shrink_to_fit(multimap *mm) {
+}
+
+
+/* Counts the allocator calls for values made so far by this thread, for
+ * every multimap.
+ */
+void mm_get_alloc_stats(mm_alloc_stats *stats) {
+    *stats = value_stats;
+}
+
+
+/* Prints how this multimap is built, for the performance tests. */
+void mm_print_info(multimap *mm) {
+    printf("Multimap:  binary tree, linked lists of values%s.\n",
+           mm->concurrent ? ", one lock" : "");
+}
@@ -0,0 +1,221 @@
+/* The nodes of one multimap (bTree.c and bPlusTree.c), all the same size,
+ * kept in an arena of their own: making a node never goes to malloc(), and
+ * freeing a whole tree is one munmap() per chunk rather than a free() per
+ * node.
+ *
+ * Nodes are carved, cache line aligned, out of chunks of (a whole number
+ * of) HUGE_PAGE bytes.  A node that is given back goes on a free list and
+ * is handed out again before any new one.  Nothing goes back to the system
+ * until arena_release(), which unmaps every chunk.
+ *
+ * The chunks (and the slabs of mmvalues.h) are mapped by pages_alloc(), on
+ * huge pages if it can, so that a big tree needs far fewer TLB entries:
+ * with MM_PAGES_HUGETLB from the pool of reserved huge pages, and otherwise
+ * (or if the pool is empty) aligned to HUGE_PAGE and madvise()d to be
+ * backed by transparent huge pages.  MM_PAGES_SMALL asks for the opposite,
+ * to compare against.  Where neither is supported they are plain mappings,
+ * and if no memory can be mapped at all it comes from the heap instead.
+ */
+
+#ifndef MMARENA_H
+#define MMARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "multimap.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+
+#define HUGE_PAGE ((size_t) 2 << 20) /* a huge page on x86-64 */
+#define NODE_ALIGN (64) /* nodes start on a cache line */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    int mapped;               /* zero if it came from the heap instead */
+} arena_chunk;
+
+typedef struct free_node {
+    struct free_node *next;
+} free_node;
+
+typedef struct node_arena {
+    int backing;              /* how its chunks are backed, MM_PAGES_* */
+    size_t nodeBytes;         /* a node, rounded up to whole cache lines */
+    size_t chunkBytes;        /* a chunk, with room for at least one node */
+    arena_chunk *chunks;      /* the newest first */
+    char *next;               /* the part of the newest chunk */
+    size_t left;              /*     not handed out yet */
+    free_node *freeNodes;
+} node_arena;
+
+
+/* Maps bytes (a multiple of HUGE_PAGE) of zeroed memory, aligned to
+ * HUGE_PAGE, backed the way backing says.
+ */
+static void * pages_alloc(size_t bytes, int backing) {
+    char *block;
+    size_t head;
+
+#ifdef MAP_HUGETLB
+    if (backing == MM_PAGES_HUGETLB) {
+        block = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block != MAP_FAILED)
+            return block;
+    }
+#endif
+
+    /* map a huge page more than needed, and trim it down to aligned pages */
+    block = mmap(NULL, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+        return NULL;
+    head = (HUGE_PAGE - (uintptr_t) block % HUGE_PAGE) % HUGE_PAGE;
+    if (head > 0)
+        munmap(block, head);
+    munmap(block + head + bytes, HUGE_PAGE - head);
+    block += head;
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    madvise(block, bytes, (backing == MM_PAGES_SMALL) ? MADV_NOHUGEPAGE :
+                                                        MADV_HUGEPAGE);
+#endif
+    return block;
+}
+
+
+/* Unmaps what pages_alloc() mapped. */
+static void pages_free(void *block, size_t bytes) {
+    munmap(block, bytes);
+}
+
+
+/* pages_alloc(), falling back on the heap (and setting *mapped to zero) if
+ * no pages can be mapped, so that a failed mmap() never hands out NULL.
+ * Only if the heap has no memory either is there nothing left to do but
+ * abort.
+ */
+static void * pages_alloc_or_heap(size_t bytes, int backing, int *mapped) {
+    void *block = pages_alloc(bytes, backing);
+
+    *mapped = (block != NULL);
+    if (block == NULL) {
+        block = aligned_alloc(NODE_ALIGN, bytes);
+        if (block == NULL)
+            abort();
+        memset(block, 0, bytes);
+    }
+    return block;
+}
+
+
+/* Gives back what pages_alloc_or_heap() handed out. */
+static void pages_free_or_heap(void *block, size_t bytes, int mapped) {
+    if (mapped)
+        pages_free(block, bytes);
+    else
+        free(block);
+}
+
+
+/* The backing pages_alloc() will actually give for backing: the reserved
+ * pool is tried out once, and MM_PAGES_TRANSPARENT used instead if it has
+ * no free huge page.
+ */
+static int pages_backing(int backing) {
+    void *block;
+
+    if (backing != MM_PAGES_HUGETLB)
+        return backing;
+#ifdef MAP_HUGETLB
+    block = mmap(NULL, HUGE_PAGE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (block != MAP_FAILED) {
+        munmap(block, HUGE_PAGE);
+        return MM_PAGES_HUGETLB;
+    }
+#endif
+    return MM_PAGES_TRANSPARENT;
+}
+
+
+/* What pages_backing() returned, in words. */
+static const char * pages_name(int backing) {
+    switch (backing) {
+    case MM_PAGES_HUGETLB:  return "reserved huge pages";
+    case MM_PAGES_SMALL:    return "small pages";
+    default:                return "transparent huge pages";
+    }
+}
+
+
+/* Sets up an empty arena for nodes of nodeBytes bytes, with chunks backed
+ * the way backing says (see pages_backing()).
+ */
+static void arena_init(node_arena *arena, size_t nodeBytes, int backing) {
+    arena->backing = backing;
+    arena->nodeBytes = (nodeBytes + NODE_ALIGN - 1) / NODE_ALIGN * NODE_ALIGN;
+    arena->chunkBytes = (NODE_ALIGN + arena->nodeBytes + HUGE_PAGE - 1) /
+                        HUGE_PAGE * HUGE_PAGE;
+    arena->chunks = NULL;
+    arena->next = NULL;
+    arena->left = 0;
+    arena->freeNodes = NULL;
+}
+
+
+/* Hands out a node: a recycled one if there is any, or else the next one
+ * of the newest chunk, starting a chunk if that one is used up.  Its
+ * contents are whatever they happen to be.
+ */
+static void * arena_alloc(node_arena *arena) {
+    void *node;
+
+    if (arena->freeNodes != NULL) {
+        node = arena->freeNodes;
+        arena->freeNodes = arena->freeNodes->next;
+        return node;
+    }
+
+    if (arena->left < arena->nodeBytes) {
+        int mapped;
+        arena_chunk *chunk = pages_alloc_or_heap(arena->chunkBytes,
+                                                 arena->backing, &mapped);
+
+        chunk->next = arena->chunks;
+        chunk->mapped = mapped;
+        arena->chunks = chunk;
+        arena->next = (char *) chunk + NODE_ALIGN;
+        arena->left = arena->chunkBytes - NODE_ALIGN;
+    }
+    node = arena->next;
+    arena->next += arena->nodeBytes;
+    arena->left -= arena->nodeBytes;
+    return node;
+}
+
+
+/* Takes a node back, to be handed out again. */
+static void arena_free(node_arena *arena, void *node) {
+    ((free_node *) node)->next = arena->freeNodes;
+    arena->freeNodes = (free_node *) node;
+}
+
+
+/* Frees every node of the arena at once, leaving it empty (and usable). */
+static void arena_release(node_arena *arena) {
+    while (arena->chunks != NULL) {
+        arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        pages_free_or_heap(chunk, arena->chunkBytes, chunk->mapped);
+    }
+    arena_init(arena, arena->nodeBytes, arena->backing);
+}
+
+#endif
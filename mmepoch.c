@@ -0,0 +1,193 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmepoch.h"
+
+
+/* The thread slot indices not in use, and how a thread gives its back. */
+static pthread_mutex_t ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ids_key;
+static int ids_keyed = 0;
+static int free_ids[EPOCH_SLOTS];
+static int n_free_ids = 0;
+static int next_id = 0;
+
+/* This thread's slot index (EPOCH_SLOTS for the shared one), or -1 if it
+ * hasn't got one yet.
+ */
+static _Thread_local int thread_id = -1;
+
+
+/* Runs as a thread that had a slot exits (its key value is the index + 1). */
+static void release_id(void *value) {
+    pthread_mutex_lock(&ids_lock);
+    free_ids[n_free_ids++] = (int) (intptr_t) value - 1;
+    pthread_mutex_unlock(&ids_lock);
+}
+
+
+static int get_thread_id(void) {
+    int id;
+
+    if (thread_id >= 0)
+        return thread_id;
+
+    pthread_mutex_lock(&ids_lock);
+    if (!ids_keyed) {
+        pthread_key_create(&ids_key, release_id);
+        ids_keyed = 1;
+    }
+    if (n_free_ids > 0)
+        id = free_ids[--n_free_ids];
+    else if (next_id < EPOCH_SLOTS)
+        id = next_id++;
+    else
+        id = EPOCH_SLOTS;
+    pthread_mutex_unlock(&ids_lock);
+
+    if (id < EPOCH_SLOTS)
+        pthread_setspecific(ids_key, (void *) (intptr_t) (id + 1));
+    thread_id = id;
+    return id;
+}
+
+
+int epoch_thread_slot(void) {
+    return get_thread_id();
+}
+
+
+void epoch_init(epoch_domain *domain) {
+    memset(domain->slots, 0, sizeof(domain->slots));
+    domain->epoch = 1;
+    pthread_mutex_init(&domain->sharedLock, NULL);
+}
+
+
+/* The fence after noting the epoch makes sure no other thread can see the
+ * epoch move past it while this one goes on to read the multimap.
+ */
+void epoch_enter(epoch_domain *domain) {
+    epoch_slot *slot = &domain->slots[get_thread_id()];
+
+    if (slot == &domain->slots[EPOCH_SLOTS]) {
+        __atomic_fetch_add(&slot->sharers, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    __atomic_store_n(&slot->epoch,
+                     __atomic_load_n(&domain->epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void epoch_exit(epoch_domain *domain) {
+    epoch_slot *slot = &domain->slots[get_thread_id()];
+
+    if (slot == &domain->slots[EPOCH_SLOTS])
+        __atomic_fetch_sub(&slot->sharers, 1, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Moves the epoch on by one if every operation going on started in it. */
+static void try_advance(epoch_domain *domain) {
+    uint64_t epoch = __atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST);
+    uint64_t seen;
+    int i;
+
+    if (__atomic_load_n(&domain->slots[EPOCH_SLOTS].sharers,
+                        __ATOMIC_SEQ_CST) > 0)
+        return;
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+        seen = __atomic_load_n(&domain->slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch)
+            return;
+    }
+    __atomic_compare_exchange_n(&domain->epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+
+/* Frees what a slot retired before epoch - 1 (all of it, for epoch 0). */
+static void free_retired(epoch_domain *domain, epoch_slot *slot,
+                         uint64_t epoch) {
+    size_t i, n = 0;
+
+    if (slot->nLimbo == 0)
+        return;
+    while (n < slot->nLimbo &&
+           (epoch == 0 || slot->limbo[n].epoch + 2 <= epoch))
+        n++;
+    for (i = 0; i < n; i++) {
+        retired_block *r = &slot->limbo[i];
+        r->free_fn(r->ctx, r->block, r->bytes);
+    }
+    memmove(slot->limbo, slot->limbo + n,
+            (slot->nLimbo - n) * sizeof(retired_block));
+    slot->nLimbo -= n;
+}
+
+
+void epoch_retire(epoch_domain *domain, void *block, size_t bytes,
+                  epoch_free_fn free_fn, void *ctx) {
+    int id = get_thread_id();
+    epoch_slot *slot = &domain->slots[id];
+    retired_block *r;
+
+    if (id == EPOCH_SLOTS)
+        pthread_mutex_lock(&domain->sharedLock);
+
+    if (slot->nLimbo == slot->maxLimbo) {
+        slot->maxLimbo = 2 * slot->maxLimbo + EPOCH_BATCH;
+        slot->limbo = realloc(slot->limbo,
+                              slot->maxLimbo * sizeof(retired_block));
+    }
+    r = &slot->limbo[slot->nLimbo++];
+    r->block = block;
+    r->bytes = bytes;
+    r->free_fn = free_fn;
+    r->ctx = ctx;
+    r->epoch = __atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST);
+
+    if (++slot->retires % EPOCH_BATCH == 0) {
+        try_advance(domain);
+        free_retired(domain, slot,
+                     __atomic_load_n(&domain->epoch, __ATOMIC_SEQ_CST));
+    }
+
+    if (id == EPOCH_SLOTS)
+        pthread_mutex_unlock(&domain->sharedLock);
+}
+
+
+void epoch_drain(epoch_domain *domain) {
+    int i;
+
+    for (i = 0; i <= EPOCH_SLOTS; i++) {
+        free_retired(domain, &domain->slots[i], 0);
+        free(domain->slots[i].limbo);
+        domain->slots[i].limbo = NULL;
+        domain->slots[i].nLimbo = 0;
+        domain->slots[i].maxLimbo = 0;
+    }
+}
+
+
+epoch_domain *epoch_new(void) {
+    epoch_domain *domain = aligned_alloc(_Alignof(epoch_domain),
+                                         sizeof(epoch_domain));
+
+    epoch_init(domain);
+    return domain;
+}
+
+
+void epoch_free(epoch_domain *domain) {
+    epoch_drain(domain);
+    pthread_mutex_destroy(&domain->sharedLock);
+    free(domain);
+}
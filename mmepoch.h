@@ -0,0 +1,95 @@
+/* Epoch-based reclamation, for multimaps whose lookups take no locks at all
+ * (MM_CONCURRENT_OPTIMISTIC in bTree.c).  Memory such a lookup might still
+ * be reading (a node merged out of the tree, or a key's values array that
+ * has moved) isn't freed when it is let go of, but retired:  kept until
+ * every operation that could have reached it has finished, and only then
+ * freed.
+ *
+ * Every operation on the multimap runs between epoch_enter() and
+ * epoch_exit(), which note in the thread's slot which epoch it started in.
+ * The domain's epoch only moves on once every operation going on started
+ * in the current one.  Memory retired in epoch e was out of reach before
+ * epoch e + 1 began, so once the epoch has reached e + 2, no operation
+ * that saw it is left, and it is freed.
+ *
+ * Each thread has a slot of its own in every domain (the same index in
+ * each), handed out the first time it enters one and back again when the
+ * thread exits.  Past EPOCH_SLOTS threads at once, the rest share one
+ * more slot, which just counts them and holds the epoch back while any of
+ * them is in an operation.  What a thread retires waits in its slot; every
+ * EPOCH_BATCH retirements it tries to move the epoch on, and frees what it
+ * can.
+ */
+
+#ifndef MMEPOCH_H
+#define MMEPOCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define EPOCH_SLOTS (128) /* threads at once with a slot of their own */
+#define EPOCH_BATCH (64) /* retirements between tries at moving the epoch */
+
+/* Frees block (of bytes bytes) once it is safe to; ctx is whatever was
+ * handed to epoch_retire() with it.
+ */
+typedef void (*epoch_free_fn)(void *ctx, void *block, size_t bytes);
+
+typedef struct retired_block {
+    void *block;
+    size_t bytes;
+    epoch_free_fn free_fn;
+    void *ctx;
+    uint64_t epoch;           /* the epoch it was retired in */
+} retired_block;
+
+typedef struct epoch_slot {
+    uint64_t epoch;           /* its operation's epoch, or 0 if in none */
+    int sharers;              /* the shared slot:  how many are in one */
+    unsigned int retires;     /* how many it has retired, ever */
+    retired_block *limbo;     /* retired and not yet freed, oldest first */
+    size_t nLimbo;
+    size_t maxLimbo;
+} __attribute__((aligned(64))) epoch_slot;
+
+typedef struct epoch_domain {
+    uint64_t epoch;           /* starts at 1 */
+    pthread_mutex_t sharedLock; /* the shared slot's limbo */
+    epoch_slot slots[EPOCH_SLOTS + 1]; /* the last one is the shared one */
+} epoch_domain;
+
+
+/* The calling thread's slot index, the same in every domain:  below
+ * EPOCH_SLOTS, and no other thread running has it, or EPOCH_SLOTS for the
+ * shared slot.
+ */
+int epoch_thread_slot(void);
+
+/* Sets up a domain with nothing retired. */
+void epoch_init(epoch_domain *domain);
+
+/* Start and finish an operation, which mustn't already be in one. */
+void epoch_enter(epoch_domain *domain);
+void epoch_exit(epoch_domain *domain);
+
+/* Frees block with free_fn (handing it ctx) once no operation can still be
+ * reading it.  It must already be out of reach of any operation that starts
+ * from now on.
+ */
+void epoch_retire(epoch_domain *domain, void *block, size_t bytes,
+                  epoch_free_fn free_fn, void *ctx);
+
+/* Frees everything retired, at once.  Only while no thread is in an
+ * operation, e.g. when the multimap is cleared.
+ */
+void epoch_drain(epoch_domain *domain);
+
+/* A domain out of the heap (it is big:  a cache line per slot), set up,
+ * and freeing one, which drains it first.
+ */
+epoch_domain *epoch_new(void);
+void epoch_free(epoch_domain *domain);
+
+#endif
@@ -1,8 +1,17 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "multimap.h"
+#include "mmshard.h"
 #include "realtime.h"
 
 /* Set this to 1 to turn on extremely verbose output. */
@@ -24,6 +33,70 @@
  */
 #define EXCLUDE_SLOW_TESTS 0
 
+/* The most threads test_multimap_threads() and test_multimap_ingest() run
+ * at once; they start with one, and double the number up to this.
+ */
+#define MAX_THREADS 64
+
+/* How many shards test_multimap_ingest() splits a sharded multimap into. */
+#define PERF_SHARDS 16
+
+/* How many pairs test_multimap_load_parallel() loads.  With LOAD_ONLY set
+ * to 1, that is the only test this program runs (see the loadperf target
+ * in the Makefile, which sets both).
+ */
+#ifndef LOAD_PAIRS
+#define LOAD_PAIRS (SCALE * 4000000)
+#endif
+#ifndef LOAD_ONLY
+#define LOAD_ONLY 0
+#endif
+
+
+/* The configuration every multimap under test is created with.  The node
+ * size can be set from the command line (see main()), so the same binary can
+ * be run with different fanouts, and so can how the memory of the multimap
+ * is backed (MM_PAGES_*), to see what huge pages do for the probes.
+ */
+mm_config perf_config;
+
+
+/* A counter of the data TLB misses of loads by this program (see
+ * open_tlb_counter()), or -1 if there is none.
+ */
+int tlb_counter = -1;
+
+/* Opens tlb_counter, if this is Linux and the CPU's performance counters
+ * can be got at (they often can't from inside a virtual machine).
+ */
+void open_tlb_counter() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    tlb_counter = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+/* How many data TLB misses there have been so far, or -1 if unknown. */
+long long read_tlb_counter() {
+    long long count = -1;
+
+#ifdef __linux__
+    if (tlb_counter < 0 || read(tlb_counter, &count, sizeof(count)) !=
+                           sizeof(count))
+        count = -1;
+#endif
+    return count;
+}
+
 
 /* Populate the multimap with a specific number of key/value pairs.  The keys
  * can be generated in one of three ways, either randomly, incrementing, or
@@ -116,6 +189,20 @@ int probe_multimap(multimap *mm, int num_probes, int max_key, int max_val) {
 }
 
 
+/* Prints how many allocator calls were made for values since *since was
+ * taken with mm_get_alloc_stats().
+ */
+void print_alloc_stats(const mm_alloc_stats *since) {
+    mm_alloc_stats now;
+
+    mm_get_alloc_stats(&now);
+    printf("Allocator calls:  %lu mallocs, %lu reallocs, %lu frees, "
+           "%lu blocks reused\n", now.mallocs - since->mallocs,
+           now.reallocs - since->reallocs, now.frees - since->frees,
+           now.reused - since->reused);
+}
+
+
 /* Performs a single performance test against the multimap:
  *   1)  Generates key/value pairs to add to the map, using either incrementing,
  *       decrementing, or random key generation, and the specified maximum key
@@ -128,9 +215,10 @@ int probe_multimap(multimap *mm, int num_probes, int max_key, int max_val) {
 void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
                         int max_key, int max_val) {
     multimap *mm;
+    mm_alloc_stats stats;
     struct timespec ts;
     int total_hits;
-    long long int start_us, end_us;
+    long long int start_us, end_us, start_misses, end_misses;
     double total_seconds, us_per_probe;
     const char *mode_str[] = { "random", "incrementing", "decrementing" };
 
@@ -140,10 +228,14 @@ void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
            num_pairs, num_probes, mode_str[keygen_mode]);
 
     /* Initialize the multimap data structure. */
-    mm = init_multimap();
+    mm = init_multimap_with_config(&perf_config);
+    mm_print_info(mm);
 
+    mm_get_alloc_stats(&stats);
     populate_multimap(mm, num_pairs, keygen_mode, max_key, max_val);
+    print_alloc_stats(&stats);
 
+    start_misses = read_tlb_counter();
     clock_get_realtime(&ts);
     start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
 
@@ -151,6 +243,7 @@ void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
 
     clock_get_realtime(&ts);
     end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    end_misses = read_tlb_counter();
 
     printf("%d out of %d test-pairs were in the map (%.1f%%)\n",
            total_hits, num_probes,
@@ -159,15 +252,660 @@ void test_multimap_perf(int num_pairs, int num_probes, int keygen_mode,
     total_seconds = (double) (end_us - start_us) / 1000000.0;
     us_per_probe = (double) (end_us - start_us) / (double) num_probes;
     printf("Total wall-clock time:  %.2f seconds\t\t\u03BCs per probe:"
-           "  %.3f \u03BCs\n\n", total_seconds, us_per_probe);
+           "  %.3f \u03BCs\n", total_seconds, us_per_probe);
+    if (start_misses >= 0 && end_misses >= 0) {
+        printf("Data TLB misses per probe:  %.2f\n",
+               (double) (end_misses - start_misses) / (double) num_probes);
+    }
 
     /* Free it!  We're done. */
+    clock_get_realtime(&ts);
+    start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+    clear_multimap(mm);
+
+    clock_get_realtime(&ts);
+    end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+    printf("Freed the multimap in %.3f seconds\n\n",
+           (double) (end_us - start_us) / 1000000.0);
+}
+
+
+/* Counts the pairs visited by mm_traverse(), see test_multimap_churn(). */
+int pairs_left;
+
+void count_pair(int key, int value) {
+    pairs_left++;
+}
+
+
+/* Performs a mixed insert/delete performance test against the multimap:
+ *   1)  Populates the map with random keys, like test_multimap_perf().
+ *
+ *   2)  Performs the specified number of random operations, half of them
+ *       adding a pair, 40% removing a pair and 10% removing a whole key,
+ *       measuring the total wall-clock time they take.  This keeps the map
+ *       growing and shrinking, so it exercises node splits and merges as well
+ *       as value arrays that grow and shrink.
+ *
+ *   3)  Reports how many pairs were removed and how many are left, which
+ *       should not change regardless of optimizations.
+ */
+void test_multimap_churn(int num_pairs, int num_ops, int max_key,
+                         int max_val) {
+    multimap *mm;
+    mm_alloc_stats stats;
+    struct timespec ts;
+    int i, op, key, value, total_removed;
+    long long int start_us, end_us;
+    double total_seconds, us_per_op;
+
+    printf("Testing multimap insert/delete performance:  %d pairs, "
+           "%d operations.\n", num_pairs, num_ops);
+
+    mm = init_multimap_with_config(&perf_config);
+    mm_print_info(mm);
+
+    populate_multimap(mm, num_pairs, MODE_RAND, max_key, max_val);
+
+    printf("Adding and removing %d randomly generated pairs and keys.\n",
+           num_ops);
+
+    mm_get_alloc_stats(&stats);
+    clock_get_realtime(&ts);
+    start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+    for (i = 0, total_removed = 0; i < num_ops; i++) {
+        op = rand() % 10;
+        key = rand() % max_key;
+        value = rand() % max_val;
+
+        if (op < 5)
+            mm_add_value(mm, key, value);
+        else if (op < 9)
+            total_removed += mm_remove_value(mm, key, value);
+        else
+            total_removed += mm_remove_key(mm, key);
+    }
+
+    clock_get_realtime(&ts);
+    end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+    pairs_left = 0;
+    mm_traverse(mm, count_pair);
+    printf("%d pairs were removed, %d pairs are left in the map\n",
+           total_removed, pairs_left);
+    print_alloc_stats(&stats);
+
+    total_seconds = (double) (end_us - start_us) / 1000000.0;
+    us_per_op = (double) (end_us - start_us) / (double) num_ops;
+    printf("Total wall-clock time:  %.2f seconds\t\t\u03BCs per operation:"
+           "  %.3f \u03BCs\n\n", total_seconds, us_per_op);
+
+    clear_multimap(mm);
+}
+
+
+/* Compares two ways of filling an empty multimap with the same pairs:
+ *   1)  Adding them one at a time with mm_add_value(), which is what
+ *       populate_multimap() does.
+ *
+ *   2)  Handing them all to mm_bulk_load() at once, both in the random order
+ *       they were generated in and already sorted by key.
+ *
+ * The wall-clock time of each is measured, and the number of pairs each map
+ * ends up with is reported, which should of course be the same.
+ */
+void test_multimap_load(int num_pairs, int max_key, int max_val) {
+    multimap *mm;
+    mm_alloc_stats stats;
+    struct timespec ts;
+    int *keys, *vals;
+    int i, run;
+    long long int start_us, end_us;
+    const char *run_str[] = { "one at a time", "bulk, random order",
+                              "bulk, sorted" };
+
+    printf("Testing multimap load performance:  %d pairs.\n", num_pairs);
+    printf("Keys in range [0, %d), values in range [0, %d).\n",
+           max_key, max_val);
+
+    keys = malloc(num_pairs * sizeof(int));
+    vals = malloc(num_pairs * sizeof(int));
+    for (i = 0; i < num_pairs; i++) {
+        keys[i] = rand() % max_key;
+        vals[i] = rand() % max_val;
+    }
+
+    for (run = 0; run < 3; run++) {
+        if (run == 2) {
+            /* Sort the pairs by key (a counting sort; values stay in the
+             * order they were generated in), outside of the timing.
+             */
+            int *count = calloc(max_key + 1, sizeof(int));
+            int *sorted_keys = malloc(num_pairs * sizeof(int));
+            int *sorted_vals = malloc(num_pairs * sizeof(int));
+
+            for (i = 0; i < num_pairs; i++)
+                count[keys[i] + 1]++;
+            for (i = 0; i < max_key; i++)
+                count[i + 1] += count[i];
+            for (i = 0; i < num_pairs; i++) {
+                sorted_keys[count[keys[i]]] = keys[i];
+                sorted_vals[count[keys[i]]++] = vals[i];
+            }
+            free(count);
+            free(keys);
+            free(vals);
+            keys = sorted_keys;
+            vals = sorted_vals;
+        }
+
+        mm = init_multimap_with_config(&perf_config);
+        if (run == 0)
+            mm_print_info(mm);
+
+        mm_get_alloc_stats(&stats);
+        clock_get_realtime(&ts);
+        start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        if (run == 0) {
+            for (i = 0; i < num_pairs; i++)
+                mm_add_value(mm, keys[i], vals[i]);
+        }
+        else {
+            mm_bulk_load(mm, keys, vals, num_pairs);
+        }
+
+        clock_get_realtime(&ts);
+        end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        pairs_left = 0;
+        mm_traverse(mm, count_pair);
+        printf("%-20s %d pairs loaded in %.2f seconds\t\u03BCs per pair:"
+               "  %.3f \u03BCs\n", run_str[run], pairs_left,
+               (double) (end_us - start_us) / 1000000.0,
+               (double) (end_us - start_us) / (double) num_pairs);
+        print_alloc_stats(&stats);
+
+        clear_multimap(mm);
+        free(mm);
+    }
+    printf("\n");
+
+    free(keys);
+    free(vals);
+}
+
+
+/* Times mm_bulk_load_parallel() filling an empty multimap with num_pairs
+ * random pairs, on one thread and then on twice as many each time up to
+ * MAX_THREADS, next to mm_bulk_load() with the same pairs.  The speedup
+ * over mm_bulk_load() is reported for each, and can't be more than the
+ * number of cores the machine has.
+ */
+void test_multimap_load_parallel(int num_pairs, int max_key, int max_val) {
+    multimap *mm;
+    struct timespec ts;
+    mm_pair *pairs;
+    int *keys, *vals;
+    int i, num_threads;
+    long long int start_us, end_us, sequential_us = 0;
+
+    printf("Testing parallel bulk load:  %d pairs into an empty multimap.\n",
+           num_pairs);
+    printf("Keys in range [0, %d), values in range [0, %d).\n",
+           max_key, max_val);
+
+    pairs = malloc(num_pairs * sizeof(mm_pair));
+    keys = malloc(num_pairs * sizeof(int));
+    vals = malloc(num_pairs * sizeof(int));
+    for (i = 0; i < num_pairs; i++) {
+        keys[i] = pairs[i].key = rand() % max_key;
+        vals[i] = pairs[i].value = rand() % max_val;
+    }
+
+    /* num_threads is 0 for mm_bulk_load() */
+    for (num_threads = 0; num_threads <= MAX_THREADS;
+         num_threads = (num_threads == 0) ? 1 : 2 * num_threads) {
+        mm = init_multimap_with_config(&perf_config);
+        if (num_threads == 0)
+            mm_print_info(mm);
+
+        clock_get_realtime(&ts);
+        start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        if (num_threads == 0)
+            mm_bulk_load(mm, keys, vals, num_pairs);
+        else
+            mm_bulk_load_parallel(mm, pairs, num_pairs, num_threads);
+
+        clock_get_realtime(&ts);
+        end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        pairs_left = 0;
+        mm_traverse(mm, count_pair);
+        if (num_threads == 0) {
+            sequential_us = end_us - start_us;
+            printf("mm_bulk_load           %d pairs loaded in %.2f seconds\n",
+                   pairs_left, (double) sequential_us / 1000000.0);
+        }
+        else {
+            printf("parallel, %2d threads   %d pairs loaded in %.2f seconds"
+                   "\tspeedup:  %.2fx\n", num_threads, pairs_left,
+                   (double) (end_us - start_us) / 1000000.0,
+                   (double) sequential_us / (double) (end_us - start_us));
+        }
+
+        clear_multimap(mm);
+        free(mm);
+    }
+    printf("\n");
+
+    free(pairs);
+    free(keys);
+    free(vals);
+}
+
+
+/* Measures insert throughput into a multimap that already holds num_base
+ * pairs, adding num_pairs more random pairs either one at a time with
+ * mm_add_value(), or in batches of various sizes with mm_add_values().  Every
+ * run starts from an identical (bulk loaded) multimap and adds the same
+ * pairs, so they all end up with the same number of pairs.
+ */
+void test_multimap_batches(int num_base, int num_pairs, int max_key,
+                           int max_val) {
+    multimap *mm;
+    struct timespec ts;
+    int *keys, *vals;
+    mm_pair *pairs;
+    int i, done, run, batch;
+    long long int start_us, end_us;
+    const int batch_sizes[] = { 1, 100, 1000, 10000, 100000 };
+
+    printf("Testing multimap batched insert performance:  %d pairs added to "
+           "%d.\n", num_pairs, num_base);
+    printf("Keys in range [0, %d), values in range [0, %d).\n",
+           max_key, max_val);
+
+    keys = malloc(num_base * sizeof(int));
+    vals = malloc(num_base * sizeof(int));
+    for (i = 0; i < num_base; i++) {
+        keys[i] = rand() % max_key;
+        vals[i] = rand() % max_val;
+    }
+    pairs = malloc(num_pairs * sizeof(mm_pair));
+    for (i = 0; i < num_pairs; i++) {
+        pairs[i].key = rand() % max_key;
+        pairs[i].value = rand() % max_val;
+    }
+
+    for (run = 0; run < 5; run++) {
+        batch = batch_sizes[run];
+
+        mm = init_multimap_with_config(&perf_config);
+        if (run == 0)
+            mm_print_info(mm);
+        mm_bulk_load(mm, keys, vals, num_base);
+
+        clock_get_realtime(&ts);
+        start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        if (batch == 1) {
+            for (i = 0; i < num_pairs; i++)
+                mm_add_value(mm, pairs[i].key, pairs[i].value);
+        }
+        else {
+            for (done = 0; done < num_pairs; done += batch) {
+                mm_add_values(mm, pairs + done, (num_pairs - done < batch) ?
+                                                num_pairs - done : batch);
+            }
+        }
+
+        clock_get_realtime(&ts);
+        end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        pairs_left = 0;
+        mm_traverse(mm, count_pair);
+        printf("batches of %-6d  %d pairs in the map, %.2f seconds\t"
+               "\u03BCs per pair:  %.3f \u03BCs\n", batch, pairs_left,
+               (double) (end_us - start_us) / 1000000.0,
+               (double) (end_us - start_us) / (double) num_pairs);
+
+        clear_multimap(mm);
+        free(mm);
+    }
+    printf("\n");
+
+    free(keys);
+    free(vals);
+    free(pairs);
+}
+
+
+/* Compares two ways of probing the same multimap with the same pairs: one
+ * mm_contains_pair() call at a time (like probe_multimap()), and batches of
+ * batch_size pairs handed to mm_contains_pairs(), which can overlap their
+ * cache misses.  The multimap is bulk loaded with num_pairs random pairs.
+ * Both ways must of course find the same number of pairs.
+ */
+void test_multimap_probe_batches(int num_pairs, int num_probes,
+                                 int batch_size, int max_key, int max_val) {
+    multimap *mm;
+    struct timespec ts;
+    int *keys, *vals, *found;
+    int i, run, total_hits;
+    long long int start_us, end_us;
+
+    printf("Testing multimap batched probe performance:  %d pairs, %d probes "
+           "in batches of %d.\n", num_pairs, num_probes, batch_size);
+    printf("Keys in range [0, %d), values in range [0, %d).\n",
+           max_key, max_val);
+
+    keys = malloc(num_pairs * sizeof(int));
+    vals = malloc(num_pairs * sizeof(int));
+    for (i = 0; i < num_pairs; i++) {
+        keys[i] = rand() % max_key;
+        vals[i] = rand() % max_val;
+    }
+    mm = init_multimap_with_config(&perf_config);
+    mm_print_info(mm);
+    mm_bulk_load(mm, keys, vals, num_pairs);
+    free(keys);
+    free(vals);
+
+    keys = malloc(num_probes * sizeof(int));
+    vals = malloc(num_probes * sizeof(int));
+    found = malloc(num_probes * sizeof(int));
+    for (i = 0; i < num_probes; i++) {
+        keys[i] = rand() % max_key;
+        vals[i] = rand() % max_val;
+    }
+
+    for (run = 0; run < 2; run++) {
+        clock_get_realtime(&ts);
+        start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        if (run == 0) {
+            for (i = 0; i < num_probes; i++)
+                found[i] = mm_contains_pair(mm, keys[i], vals[i]);
+        }
+        else {
+            for (i = 0; i < num_probes; i += batch_size) {
+                mm_contains_pairs(mm, keys + i, vals + i, found + i,
+                    (num_probes - i < batch_size) ? num_probes - i : batch_size);
+            }
+        }
+
+        clock_get_realtime(&ts);
+        end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+        for (i = 0, total_hits = 0; i < num_probes; i++)
+            total_hits += found[i];
+        printf("%-14s %d out of %d test-pairs were in the map, %.2f seconds"
+               "\t\u03BCs per probe:  %.3f \u03BCs\n",
+               (run == 0) ? "one at a time" : "batched", total_hits,
+               num_probes, (double) (end_us - start_us) / 1000000.0,
+               (double) (end_us - start_us) / (double) num_probes);
+    }
+    printf("\n");
+
     clear_multimap(mm);
+    free(mm);
+    free(keys);
+    free(vals);
+    free(found);
+}
+
+
+/* One of the threads of test_multimap_threads(): which multimap it works
+ * on, and the lock it has to take around every operation, if any.
+ */
+typedef struct perf_thread {
+    multimap *mm;
+    pthread_mutex_t *lock;
+    unsigned int seed;
+    int num_ops;
+    int max_key;
+    int max_val;
+    int read_percent;
+    int hits;
+} perf_thread;
+
+/* Does the operations of one thread:  read_percent% of them look a random
+ * pair up, and the rest add or remove one, half and half.
+ */
+void * run_perf_thread(void *arg) {
+    perf_thread *thread = arg;
+    int i, key, value, op;
+
+    for (i = 0; i < thread->num_ops; i++) {
+        op = rand_r(&thread->seed) % 100;
+        key = rand_r(&thread->seed) % thread->max_key;
+        value = rand_r(&thread->seed) % thread->max_val;
+
+        if (thread->lock != NULL)
+            pthread_mutex_lock(thread->lock);
+        if (op < thread->read_percent)
+            thread->hits += mm_contains_pair(thread->mm, key, value);
+        else if (op % 2 == 0)
+            mm_add_value(thread->mm, key, value);
+        else
+            mm_remove_value(thread->mm, key, value);
+        if (thread->lock != NULL)
+            pthread_mutex_unlock(thread->lock);
+    }
+    return NULL;
 }
 
 
+/* Times a mix of mostly lookups and some changes made by more and more
+ * threads at once (num_ops between them), against a multimap behind one
+ * mutex and then against concurrent multimaps, with latches, with
+ * optimistic lock coupling and as a B-link tree (see mm_config).  How
+ * well the concurrent ones do depends on how many cores there are to run
+ * the threads on.
+ */
+void test_multimap_threads(int num_pairs, int num_ops, int max_key,
+                           int max_val, int read_percent) {
+    mm_config config = perf_config;
+    multimap *mm;
+    pthread_mutex_t lock;
+    perf_thread threads[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    struct timespec ts;
+    long long int start_us, end_us;
+    int run, num_threads, t, total_hits;
+    const char *run_str[] = { "one mutex", "latches", "optimistic",
+                              "B-link" };
+
+    printf("Testing multimap performance from many threads:  %d pairs, %d "
+           "operations,\n%d%% of them lookups.\n", num_pairs, num_ops,
+           read_percent);
+    pthread_mutex_init(&lock, NULL);
+
+    /* run is 0, then each of the MM_CONCURRENT_* */
+    for (run = 0; run <= MM_CONCURRENT_BLINK; run++) {
+        config.concurrent = run;
+        mm = init_multimap_with_config(&config);
+        mm_print_info(mm);
+        populate_multimap(mm, num_pairs, MODE_RAND, max_key, max_val);
+
+        for (num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+            for (t = 0; t < num_threads; t++) {
+                threads[t].mm = mm;
+                threads[t].lock = (run == 0) ? &lock : NULL;
+                threads[t].seed = rand();
+                threads[t].num_ops = num_ops / num_threads;
+                threads[t].max_key = max_key;
+                threads[t].max_val = max_val;
+                threads[t].read_percent = read_percent;
+                threads[t].hits = 0;
+            }
+
+            clock_get_realtime(&ts);
+            start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+            for (t = 0; t < num_threads; t++)
+                pthread_create(&ids[t], NULL, run_perf_thread, &threads[t]);
+            for (t = 0, total_hits = 0; t < num_threads; t++) {
+                pthread_join(ids[t], NULL);
+                total_hits += threads[t].hits;
+            }
+
+            clock_get_realtime(&ts);
+            end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+            printf("%-12s %2d threads, %d lookups hit, %.2f seconds"
+                   "\t%.2f million operations per second\n",
+                   run_str[run], num_threads,
+                   total_hits, (double) (end_us - start_us) / 1000000.0,
+                   (double) num_ops / (double) (end_us - start_us));
+        }
+
+        clear_multimap(mm);
+        free(mm);
+    }
+    printf("\n");
+    pthread_mutex_destroy(&lock);
+}
+
+
+/* One of the threads of test_multimap_ingest():  the pairs it adds, and the
+ * lock it has to take around each one, if any.  Pairs go into the sharded
+ * multimap instead, if there is one.
+ */
+typedef struct ingest_thread {
+    multimap *mm;
+    sharded_multimap *smm;
+    pthread_mutex_t *lock;
+    const int *keys;
+    const int *vals;
+    int num_pairs;
+} ingest_thread;
+
+void * run_ingest_thread(void *arg) {
+    ingest_thread *thread = arg;
+    int i;
+
+    for (i = 0; i < thread->num_pairs; i++) {
+        if (thread->smm != NULL) {
+            sm_add_value(thread->smm, thread->keys[i], thread->vals[i]);
+            continue;
+        }
+        if (thread->lock != NULL)
+            pthread_mutex_lock(thread->lock);
+        mm_add_value(thread->mm, thread->keys[i], thread->vals[i]);
+        if (thread->lock != NULL)
+            pthread_mutex_unlock(thread->lock);
+    }
+    return NULL;
+}
+
+
+/* Times filling an empty multimap with num_pairs random pairs, split up
+ * between more and more threads, the same four ways as
+ * test_multimap_threads(), and then into PERF_SHARDS multimaps of a sharded
+ * one (see mmshard.h).  Nothing but inserts means lots of splits, which is
+ * where the ways of locking differ the most.
+ */
+void test_multimap_ingest(int num_pairs, int max_key, int max_val) {
+    mm_config config = perf_config;
+    multimap *mm;
+    pthread_mutex_t lock;
+    sharded_multimap *smm;
+    ingest_thread threads[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    int *keys, *vals;
+    struct timespec ts;
+    long long int start_us, end_us;
+    int run, num_threads, t, i, sharded;
+    const char *run_str[] = { "one mutex", "latches", "optimistic",
+                              "B-link", "sharded" };
+
+    printf("Testing concurrent inserts:  %d pairs into an empty multimap.\n",
+           num_pairs);
+    pthread_mutex_init(&lock, NULL);
+
+    keys = malloc(sizeof(int) * num_pairs);
+    vals = malloc(sizeof(int) * num_pairs);
+    for (i = 0; i < num_pairs; i++) {
+        keys[i] = rand() % max_key;
+        vals[i] = rand() % max_val;
+    }
+
+    /* run is 0, then each of the MM_CONCURRENT_*, then sharded */
+    for (run = 0; run <= MM_CONCURRENT_BLINK + 1; run++) {
+        sharded = (run > MM_CONCURRENT_BLINK);
+        config.concurrent = sharded ? 0 : run;
+        for (num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+            mm = init_multimap_with_config(&config);
+            smm = NULL;
+            if (sharded)
+                smm = init_sharded_multimap(PERF_SHARDS, NULL, &config);
+            if (num_threads == 1) {
+                if (sharded)
+                    sm_print_info(smm);
+                else
+                    mm_print_info(mm);
+            }
+
+            for (t = 0, i = 0; t < num_threads; t++) {
+                threads[t].mm = mm;
+                threads[t].smm = smm;
+                threads[t].lock = (run == 0) ? &lock : NULL;
+                threads[t].keys = keys + i;
+                threads[t].vals = vals + i;
+                threads[t].num_pairs = num_pairs / num_threads +
+                                       (t < num_pairs % num_threads);
+                i += threads[t].num_pairs;
+            }
+
+            clock_get_realtime(&ts);
+            start_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+            for (t = 0; t < num_threads; t++)
+                pthread_create(&ids[t], NULL, run_ingest_thread, &threads[t]);
+            for (t = 0; t < num_threads; t++)
+                pthread_join(ids[t], NULL);
+
+            clock_get_realtime(&ts);
+            end_us = (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+
+            printf("%-12s %2d threads, %.2f seconds"
+                   "\t%.2f million inserts per second\n",
+                   run_str[run], num_threads,
+                   (double) (end_us - start_us) / 1000000.0,
+                   (double) num_pairs / (double) (end_us - start_us));
+
+            clear_multimap(mm);
+            free(mm);
+            if (sharded)
+                free_sharded_multimap(smm);
+        }
+    }
+    printf("\n");
+    free(keys);
+    free(vals);
+    pthread_mutex_destroy(&lock);
+}
+
+
+/* Usage:  perf-program [seed [node-size-in-bytes [fill-factor
+ *                                                 [page-backing]]]]
+ */
 int main(int argc, char **argv) {
-    srand((argc == 2) ? atoi(argv[1]) : 11);
+    srand((argc >= 2) ? atoi(argv[1]) : 11);
+    perf_config.node_size = (argc >= 3) ? atoi(argv[2]) : 0;
+    perf_config.fill_factor = (argc >= 4) ? atof(argv[3]) : 0;
+    perf_config.page_backing = (argc >= 5) ? atoi(argv[4]) : 0;
+    open_tlb_counter();
+
+    if (LOAD_ONLY) {
+        test_multimap_load_parallel(LOAD_PAIRS, 10000000, 50);
+        return 0;
+    }
 
     printf("This program measures multimap read performance by doing the"
            " following, for\n");
@@ -189,6 +927,11 @@ int main(int argc, char **argv) {
     printf("   to the data structure, because the same random seed is always"
            " used at the\n");
     printf("   start of the program.\n\n");
+    printf(" * A mixed workload of insertions and removals is also timed, as"
+           " is loading\n");
+    printf("   a multimap all at once, and so are a mixed workload and"
+           " inserts alone run\n");
+    printf("   by many threads at once.\n\n");
 
     /* Arguments:  num_pairs, num_probes, keygen_mode, max_key, max_value */
 
@@ -198,11 +941,34 @@ int main(int argc, char **argv) {
 
     test_multimap_perf(15000000, SCALE * 100000, MODE_RAND, 100000, 50);
 
+    /* A few keys with a hundred thousand values each. */
+    test_multimap_perf(1000000, SCALE * 1000000, MODE_RAND, 10, 100000000);
+
+    /* Lots of keys with a couple of values each. */
+    test_multimap_perf(2000000, SCALE * 1000000, MODE_RAND, 1000000, 4);
+
+    test_multimap_churn(1000000, SCALE * 200000, 100000, 50);
+    test_multimap_churn(1000000, SCALE * 200000, 500000, 1000);
+
 #if EXCLUDE_SLOW_TESTS == 0
     test_multimap_perf(100000, SCALE * 5000, MODE_INCR, 100000, 50);
     test_multimap_perf(100000, SCALE * 5000, MODE_DECR, 100000, 50);
 #endif
 
+    test_multimap_load(SCALE * 1000000, 100000, 50);
+    test_multimap_load_parallel(LOAD_PAIRS, 10000000, 50);
+    test_multimap_batches(1000000, SCALE * 1000000, 100000, 50);
+    test_multimap_probe_batches(15000000, SCALE * 1000000, 1024, 100000, 50);
+    test_multimap_probe_batches(15000000, SCALE * 1000000, 1024, 10000000,
+                                50);
+
+    /* Arguments:  num_pairs, num_ops, max_key, max_value, read_percent */
+    test_multimap_threads(1000000, SCALE * 400000, 100000, 50, 90);
+    test_multimap_threads(1000000, SCALE * 400000, 100000, 50, 100);
+
+    /* Arguments:  num_pairs, max_key, max_value */
+    test_multimap_ingest(SCALE * 400000, 1000000, 50);
+
     return 0;
 }
 
@@ -0,0 +1,285 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multimap.h"
+#include "mmshard.h"
+
+
+/* Each shard gets a cache line (or more) of its own, so that threads
+ * taking the locks of neighbouring shards don't fight over one line.
+ */
+#define SHARD_ALIGN (64)
+
+typedef struct shard {
+    multimap *mm;
+    pthread_mutex_t lock;
+} __attribute__((aligned(SHARD_ALIGN))) shard;
+
+struct sharded_multimap {
+    int n_shards;
+    int *bounds;      /* NULL when routing by hash, see mmshard.h */
+    shard *shards;
+};
+
+/* Where sm_traverse_ex() has got to on one shard, when merging them. */
+typedef struct shard_head {
+    mm_cursor *cursor;
+    int live;         /* zero once the shard has no pairs left */
+    int key;
+    int value;
+} shard_head;
+
+
+/* The shard a key belongs to:  the number of bounds <= key, or else the
+ * high bits of a multiplicative hash of the key, scaled to n_shards (so
+ * that runs of nearby keys still spread out evenly).
+ */
+static int shard_of(const sharded_multimap *smm, int key) {
+    int lo = 0, hi = smm->n_shards - 1;
+
+    if (smm->bounds == NULL) {
+        uint32_t hash = (uint32_t) key * 2654435761u;
+        return (int) (((uint64_t) hash * smm->n_shards) >> 32);
+    }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (smm->bounds[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+sharded_multimap * init_sharded_multimap(int n_shards, const int *bounds,
+                                         const mm_config *config) {
+    sharded_multimap *smm = malloc(sizeof(sharded_multimap));
+    int i;
+
+    if (n_shards < 1)
+        n_shards = 1;
+    smm->n_shards = n_shards;
+    smm->bounds = NULL;
+    if (bounds != NULL) {
+        smm->bounds = malloc(sizeof(int) * n_shards);
+        memcpy(smm->bounds, bounds, sizeof(int) * (n_shards - 1));
+    }
+
+    smm->shards = aligned_alloc(SHARD_ALIGN, sizeof(shard) * n_shards);
+    for (i = 0; i < n_shards; i++) {
+        smm->shards[i].mm = init_multimap_with_config(config);
+        pthread_mutex_init(&smm->shards[i].lock, NULL);
+    }
+    return smm;
+}
+
+
+void clear_sharded_multimap(sharded_multimap *smm) {
+    int i;
+
+    for (i = 0; i < smm->n_shards; i++)
+        clear_multimap(smm->shards[i].mm);
+}
+
+
+void free_sharded_multimap(sharded_multimap *smm) {
+    int i;
+
+    for (i = 0; i < smm->n_shards; i++) {
+        clear_multimap(smm->shards[i].mm);
+        free(smm->shards[i].mm);
+        pthread_mutex_destroy(&smm->shards[i].lock);
+    }
+    free(smm->shards);
+    free(smm->bounds);
+    free(smm);
+}
+
+
+void sm_add_value(sharded_multimap *smm, int key, int value) {
+    shard *s = &smm->shards[shard_of(smm, key)];
+
+    pthread_mutex_lock(&s->lock);
+    mm_add_value(s->mm, key, value);
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/* A counting sort of the pairs by shard (which keeps them in the order they
+ * were given within each shard), then one mm_add_values() per shard.
+ */
+void sm_add_values(sharded_multimap *smm, const mm_pair *pairs, size_t n) {
+    size_t *starts = calloc(smm->n_shards + 1, sizeof(size_t));
+    mm_pair *sorted = malloc(sizeof(mm_pair) * (n + 1));
+    size_t i;
+    int s;
+
+    for (i = 0; i < n; i++)
+        starts[shard_of(smm, pairs[i].key) + 1]++;
+    for (s = 0; s < smm->n_shards; s++)
+        starts[s + 1] += starts[s];
+    for (i = 0; i < n; i++)
+        sorted[starts[shard_of(smm, pairs[i].key)]++] = pairs[i];
+
+    /* each start has moved up to where the next shard's pairs start */
+    for (s = 0; s < smm->n_shards; s++) {
+        size_t first = (s == 0) ? 0 : starts[s - 1];
+
+        if (starts[s] == first)
+            continue;
+        pthread_mutex_lock(&smm->shards[s].lock);
+        mm_add_values(smm->shards[s].mm, &sorted[first], starts[s] - first);
+        pthread_mutex_unlock(&smm->shards[s].lock);
+    }
+    free(sorted);
+    free(starts);
+}
+
+
+int sm_remove_value(sharded_multimap *smm, int key, int value) {
+    shard *s = &smm->shards[shard_of(smm, key)];
+    int removed;
+
+    pthread_mutex_lock(&s->lock);
+    removed = mm_remove_value(s->mm, key, value);
+    pthread_mutex_unlock(&s->lock);
+    return removed;
+}
+
+
+int sm_remove_key(sharded_multimap *smm, int key) {
+    shard *s = &smm->shards[shard_of(smm, key)];
+    int removed;
+
+    pthread_mutex_lock(&s->lock);
+    removed = mm_remove_key(s->mm, key);
+    pthread_mutex_unlock(&s->lock);
+    return removed;
+}
+
+
+int sm_contains_key(sharded_multimap *smm, int key) {
+    shard *s = &smm->shards[shard_of(smm, key)];
+    int found;
+
+    pthread_mutex_lock(&s->lock);
+    found = mm_contains_key(s->mm, key);
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+
+int sm_contains_pair(sharded_multimap *smm, int key, int value) {
+    shard *s = &smm->shards[shard_of(smm, key)];
+    int found;
+
+    pthread_mutex_lock(&s->lock);
+    found = mm_contains_pair(s->mm, key, value);
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+
+/* Lets sm_traverse() go through sm_traverse_ex(). */
+typedef struct traverse_fn {
+    void (*f)(int key, int value);
+} traverse_fn;
+
+static int call_traverse_fn(void *ctx, int key, int value) {
+    ((traverse_fn *) ctx)->f(key, value);
+    return 0;
+}
+
+
+void sm_traverse(sharded_multimap *smm, void (*f)(int key, int value)) {
+    traverse_fn fn = { f };
+    sm_traverse_ex(smm, call_traverse_fn, &fn);
+}
+
+
+/* Passes a traversal's function on, noting whether it asked to stop, so
+ * that the shards after the one it stopped in are skipped.
+ */
+typedef struct stoppable_fn {
+    int (*f)(void *ctx, int key, int value);
+    void *ctx;
+    int stopped;
+} stoppable_fn;
+
+static int call_stoppable_fn(void *ctx, int key, int value) {
+    stoppable_fn *fn = ctx;
+    fn->stopped = fn->f(fn->ctx, key, value);
+    return fn->stopped;
+}
+
+
+/* With hashing, every shard has a cursor, and the one with the smallest
+ * next key hands out its pair each time; since a key is only ever in one
+ * shard, all of a key's values come out together.  Finding that cursor is
+ * a scan of all of them, which is cheap next to the pairs themselves for a
+ * few dozen shards.
+ */
+static void traverse_merged(sharded_multimap *smm,
+                            int (*f)(void *ctx, int key, int value),
+                            void *ctx) {
+    shard_head *heads = malloc(sizeof(shard_head) * smm->n_shards);
+    int i, best;
+
+    for (i = 0; i < smm->n_shards; i++) {
+        heads[i].cursor = mm_cursor_seek(smm->shards[i].mm, INT_MIN);
+        heads[i].live = mm_cursor_next(heads[i].cursor, &heads[i].key,
+                                       &heads[i].value);
+    }
+    for (;;) {
+        best = -1;
+        for (i = 0; i < smm->n_shards; i++) {
+            if (heads[i].live && (best < 0 || heads[i].key < heads[best].key))
+                best = i;
+        }
+        if (best < 0 || f(ctx, heads[best].key, heads[best].value))
+            break;
+        heads[best].live = mm_cursor_next(heads[best].cursor,
+                                          &heads[best].key,
+                                          &heads[best].value);
+    }
+    for (i = 0; i < smm->n_shards; i++)
+        mm_cursor_free(heads[i].cursor);
+    free(heads);
+}
+
+
+/* The shards are locked in order, so this can't deadlock with another
+ * traversal, and the operations above only ever hold one lock.  With key
+ * ranges the shards are just traversed one after the other.
+ */
+void sm_traverse_ex(sharded_multimap *smm,
+                    int (*f)(void *ctx, int key, int value), void *ctx) {
+    stoppable_fn fn = { f, ctx, 0 };
+    int i;
+
+    for (i = 0; i < smm->n_shards; i++)
+        pthread_mutex_lock(&smm->shards[i].lock);
+
+    if (smm->bounds == NULL) {
+        traverse_merged(smm, f, ctx);
+    }
+    else {
+        for (i = 0; i < smm->n_shards && !fn.stopped; i++)
+            mm_traverse_ex(smm->shards[i].mm, call_stoppable_fn, &fn);
+    }
+
+    for (i = smm->n_shards - 1; i >= 0; i--)
+        pthread_mutex_unlock(&smm->shards[i].lock);
+}
+
+
+void sm_print_info(sharded_multimap *smm) {
+    printf("Sharded:  %d shards, by %s, of:\n", smm->n_shards,
+           (smm->bounds != NULL) ? "key range" : "hash");
+    mm_print_info(smm->shards[0].mm);
+}
@@ -0,0 +1,62 @@
+/* A sharded multimap:  a front end that spreads the keys over a number of
+ * independent multimaps (shards), each behind a mutex of its own, so that
+ * threads working on different shards never wait for each other.  It works
+ * with any of the multimap implementations, through multimap.h only.
+ *
+ * Keys are routed to a shard either by a hash of the key, which spreads
+ * any set of keys evenly, or by key range, given as the keys the shards
+ * start at.  Either way every key lives in exactly one shard, and the
+ * traversals hand out the pairs in key order:  shard by shard for ranges,
+ * and merged from a cursor on every shard for hashing.
+ */
+
+#ifndef MMSHARD_H
+#define MMSHARD_H
+
+#include "multimap.h"
+
+
+typedef struct sharded_multimap sharded_multimap;
+
+
+/* Allocate and initialize a sharded multimap of n_shards shards, each one a
+ * multimap created with config (which may be NULL, see
+ * init_multimap_with_config()).  If bounds is NULL, keys are routed by
+ * hash; otherwise it holds the n_shards - 1 keys, in increasing order, that
+ * shards 1 and up start at:  shard i gets bounds[i - 1] <= key < bounds[i].
+ */
+sharded_multimap * init_sharded_multimap(int n_shards, const int *bounds,
+                                         const mm_config *config);
+
+/* Empties every shard, leaving the sharded multimap ready to be used
+ * again.
+ */
+void clear_sharded_multimap(sharded_multimap *smm);
+
+/* Releases all the memory of the sharded multimap, itself included. */
+void free_sharded_multimap(sharded_multimap *smm);
+
+/* The same as the mm_* operations of the same names, on whichever shard
+ * each key belongs to.  These can be called from many threads at once.
+ * sm_add_values() sorts the batch out by shard and hands each shard its
+ * part with one call to mm_add_values().
+ */
+void sm_add_value(sharded_multimap *smm, int key, int value);
+void sm_add_values(sharded_multimap *smm, const mm_pair *pairs, size_t n);
+int sm_remove_value(sharded_multimap *smm, int key, int value);
+int sm_remove_key(sharded_multimap *smm, int key);
+int sm_contains_key(sharded_multimap *smm, int key);
+int sm_contains_pair(sharded_multimap *smm, int key, int value);
+
+/* Passes every (key, value) pair, across all the shards, to the specified
+ * function in key order, like mm_traverse() and mm_traverse_ex().  Every
+ * shard is locked for the whole traversal.
+ */
+void sm_traverse(sharded_multimap *smm, void (*f)(int key, int value));
+void sm_traverse_ex(sharded_multimap *smm,
+                    int (*f)(void *ctx, int key, int value), void *ctx);
+
+/* Prints how the keys are sharded, and what the first shard is. */
+void sm_print_info(sharded_multimap *smm);
+
+#endif
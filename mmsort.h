@@ -0,0 +1,237 @@
+/* Sorting for the operations that take many (key, value) pairs at once,
+ * shared by the multimap implementations.  Only the keys are compared, and
+ * the sort is stable, so pairs with equal keys keep the order they were
+ * given in (which is the order their values end up in).
+ */
+
+#ifndef MMSORT_H
+#define MMSORT_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "multimap.h"
+
+
+/* Below this many pairs a plain insertion sort beats setting up the radix
+ * sort's histograms.
+ */
+#define SMALL_SORT (64)
+
+/* Below this many pairs per thread sort_pairs_parallel() just sorts them
+ * in the calling thread, since starting the threads would cost more.
+ */
+#define PARALLEL_SORT (1 << 15)
+
+
+/* One thread's part of a pass of sort_pairs_parallel(). */
+typedef struct sort_share {
+    const mm_pair *from;      /* every pair, in the order of the last pass */
+    mm_pair *to;
+    size_t first, last;       /* this thread's part of from */
+    int shift;                /* which byte of the key this pass is on */
+
+    /* How many of its pairs have each byte, then where the first of them
+     * goes in to.
+     */
+    size_t count[256];
+} sort_share;
+
+
+/* Returns nonzero if the pairs are already in key order. */
+static int pairs_sorted(const mm_pair *pairs, size_t n) {
+    size_t i;
+
+    for (i = 1; i < n; i++) {
+        if (pairs[i].key < pairs[i - 1].key)
+            return 0;
+    }
+    return 1;
+}
+
+
+/* Sorts the pairs by key.  This is an LSD radix sort, one byte of the key
+ * per pass: all four histograms are built in a single read of the input,
+ * and each pass is then one streaming read and one scattered write.  Passes
+ * where every key has the same byte (e.g. the high bytes of small keys) are
+ * skipped.  The sign bit is flipped so negative keys sort first.
+ */
+static void sort_pairs(mm_pair *pairs, size_t n) {
+    size_t count[4][256];
+    size_t i, sum, tmp;
+    mm_pair *from, *to, *swap;
+    unsigned int key;
+    int pass, b;
+
+    if (n < SMALL_SORT) {
+        for (i = 1; i < n; i++) {
+            mm_pair pair = pairs[i];
+            size_t j = i;
+
+            while (j > 0 && pairs[j - 1].key > pair.key) {
+                pairs[j] = pairs[j - 1];
+                j--;
+            }
+            pairs[j] = pair;
+        }
+        return;
+    }
+
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++) {
+        key = (unsigned int) pairs[i].key ^ 0x80000000u;
+        count[0][key & 0xff]++;
+        count[1][(key >> 8) & 0xff]++;
+        count[2][(key >> 16) & 0xff]++;
+        count[3][key >> 24]++;
+    }
+
+    from = pairs;
+    to = malloc(n * sizeof(mm_pair));
+    for (pass = 0; pass < 4; pass++) {
+        int shift = 8 * pass;
+
+        key = (unsigned int) pairs[0].key ^ 0x80000000u;
+        if (count[pass][(key >> shift) & 0xff] == n)
+            continue;
+
+        /* Turn the counts into the index each bucket starts at. */
+        for (b = 0, sum = 0; b < 256; b++) {
+            tmp = count[pass][b];
+            count[pass][b] = sum;
+            sum += tmp;
+        }
+
+        for (i = 0; i < n; i++) {
+            key = (unsigned int) from[i].key ^ 0x80000000u;
+            to[count[pass][(key >> shift) & 0xff]++] = from[i];
+        }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != pairs) {
+        memcpy(pairs, from, n * sizeof(mm_pair));
+        to = from;
+    }
+    free(to);
+}
+
+
+/* Runs fn on each of the nthreads shares (size bytes apart), all at once:
+ * one in the calling thread and the rest in threads of their own.  A share
+ * whose thread can't be created is run in the calling thread instead.
+ */
+static void run_shares(void * (*fn)(void *), void *shares, size_t size,
+                       int nthreads) {
+    pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+    int *started = malloc(sizeof(int) * nthreads);
+    int t;
+
+    for (t = 1; t < nthreads; t++) {
+        started[t] = pthread_create(&threads[t], NULL, fn,
+                                    (char *) shares + t * size) == 0;
+        if (!started[t])
+            fn((char *) shares + t * size);
+    }
+    fn(shares);
+    for (t = 1; t < nthreads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+    free(started);
+    free(threads);
+}
+
+
+static void * count_share(void *arg) {
+    sort_share *share = arg;
+    unsigned int key;
+    size_t i;
+
+    memset(share->count, 0, sizeof(share->count));
+    for (i = share->first; i < share->last; i++) {
+        key = (unsigned int) share->from[i].key ^ 0x80000000u;
+        share->count[(key >> share->shift) & 0xff]++;
+    }
+    return NULL;
+}
+
+
+static void * scatter_share(void *arg) {
+    sort_share *share = arg;
+    unsigned int key;
+    size_t i;
+
+    for (i = share->first; i < share->last; i++) {
+        key = (unsigned int) share->from[i].key ^ 0x80000000u;
+        share->to[share->count[(key >> share->shift) & 0xff]++] =
+            share->from[i];
+    }
+    return NULL;
+}
+
+
+/* The same sort as sort_pairs(), by nthreads threads.  Each pass, every
+ * thread counts the bytes in its part of the pairs; a bucket's pairs then
+ * go out thread by thread, so each thread knows where its pairs of every
+ * bucket start, and scatters them there without waiting on the others.
+ * Going by thread order within a bucket keeps the sort stable.
+ */
+static void sort_pairs_parallel(mm_pair *pairs, size_t n, int nthreads) {
+    sort_share *shares;
+    mm_pair *from, *to, *swap;
+    size_t sum, tmp;
+    int pass, t, b;
+
+    if (nthreads > 1 && n / nthreads < PARALLEL_SORT)
+        nthreads = (int) (n / PARALLEL_SORT);
+    if (nthreads <= 1) {
+        sort_pairs(pairs, n);
+        return;
+    }
+
+    shares = malloc(sizeof(sort_share) * nthreads);
+    from = pairs;
+    to = malloc(n * sizeof(mm_pair));
+    for (pass = 0; pass < 4; pass++) {
+        for (t = 0; t < nthreads; t++) {
+            shares[t].from = from;
+            shares[t].to = to;
+            shares[t].first = n * t / nthreads;
+            shares[t].last = n * (t + 1) / nthreads;
+            shares[t].shift = 8 * pass;
+        }
+        run_shares(count_share, shares, sizeof(sort_share), nthreads);
+
+        /* Skip the pass if every key has the same byte here. */
+        b = (((unsigned int) from[0].key ^ 0x80000000u) >> (8 * pass)) & 0xff;
+        for (t = 0, sum = 0; t < nthreads; t++)
+            sum += shares[t].count[b];
+        if (sum == n)
+            continue;
+
+        for (b = 0, sum = 0; b < 256; b++) {
+            for (t = 0; t < nthreads; t++) {
+                tmp = shares[t].count[b];
+                shares[t].count[b] = sum;
+                sum += tmp;
+            }
+        }
+        run_shares(scatter_share, shares, sizeof(sort_share), nthreads);
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != pairs) {
+        memcpy(pairs, from, n * sizeof(mm_pair));
+        to = from;
+    }
+    free(to);
+    free(shares);
+}
+
+#endif
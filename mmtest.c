@@ -1,7 +1,10 @@
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "multimap.h"
+#include "mmshard.h"
 
 
 int failures = 0;
@@ -44,6 +47,49 @@ int probe_keys[] = {
 };
 
 
+int remove_values[] = {
+    2, 20, 1,  /* key, value, how many pairs should be removed */
+    2, 20, 0,
+    4, 30, 0,
+    7, 10, 0,
+    3, 30, 1,  /* last value of key 3, so key 3 goes too */
+    -1
+};
+
+
+int probe_after_remove[] = {
+    2, 15, 1,  /* key, value, answer */
+    2, 20, 0,
+    3, 30, 0,
+    4, 50, 1,
+    1, 40, 1,
+    -1
+};
+
+
+/* How many keys the removal stress test uses.  It builds the multimap with
+ * tiny nodes, so that this is enough for a tree several levels deep.
+ */
+#define STRESS_KEYS 3000
+
+/* How many different values the heavy key test gives its key. */
+#define HEAVY_VALUES 5000
+
+/* How many values each key of the value shapes test is given. */
+#define SHAPE_VALUES 3000
+
+/* How many threads the concurrency test runs at once, and how many keys
+ * each of them adds (and removes again).
+ */
+#define TEST_THREADS 4
+#define THREAD_KEYS 3000
+
+/* How many pairs the parallel bulk load test loads:  enough for every one
+ * of up to 7 threads to get a share of the work.
+ */
+#define PARALLEL_PAIRS 400000
+
+
 int prev_key;
 
 void check_order(int key, int value) {
@@ -59,9 +105,851 @@ void check_order(int key, int value) {
 }
 
 
+void report(const char *what, int ok) {
+    printf(" * %s:  %s\n", what, ok ? "PASS" : "FAIL");
+    if (!ok)
+        failures++;
+}
+
+
+/* What mm_range() or mm_traverse_ex() has handed over so far; the walk is
+ * stopped once limit pairs have been seen.
+ */
+typedef struct walk_state {
+    int prev_key;
+    int count;
+    int limit;
+    int in_order;
+} walk_state;
+
+int check_walk(void *ctx, int key, int value) {
+    walk_state *state = ctx;
+
+    if (state->count > 0 && key < state->prev_key)
+        state->in_order = 0;
+    state->prev_key = key;
+    state->count++;
+    return state->count == state->limit;
+}
+
+
+/* Counts the pairs mm_traverse_ex() hands over, stopping after limit of
+ * them (0 for no limit); returns -1 if they came out of order.
+ */
+int count_pairs(multimap *mm, int limit) {
+    walk_state state = { 0, 0, limit, 1 };
+
+    mm_traverse_ex(mm, check_walk, &state);
+    return state.in_order ? state.count : -1;
+}
+
+
+/* What mm_traverse_values() has handed over so far: how many keys and
+ * values, and the sum of the values of key 2.  The walk is stopped once
+ * limit keys have been seen.
+ */
+typedef struct values_state {
+    int prev_key;
+    int keys;
+    int values;
+    int key2_sum;
+    int limit;
+    int in_order;
+} values_state;
+
+int check_values(void *ctx, int key, const int *values, int nVals) {
+    values_state *state = ctx;
+    int i;
+
+    if (state->keys > 0 && key <= state->prev_key)
+        state->in_order = 0;
+    state->prev_key = key;
+    state->keys++;
+    state->values += nVals;
+    for (i = 0; key == 2 && i < nVals; i++)
+        state->key2_sum += values[i];
+    return state->keys == state->limit;
+}
+
+
+/* Counts the pairs mm_range() hands over for [lo, hi), stopping after limit
+ * of them (0 for no limit); returns -1 if they came out of order or outside
+ * the range.
+ */
+int count_range(multimap *mm, int lo, int hi, int limit) {
+    walk_state state = { 0, 0, limit, 1 };
+
+    mm_range(mm, lo, hi, check_walk, &state);
+    if (!state.in_order ||
+        (state.count > 0 && (state.prev_key < lo || state.prev_key >= hi)))
+        return -1;
+    return state.count;
+}
+
+
+/* Counts the pairs a cursor hands over starting from key, checking that the
+ * first one has the key first_key (or that there are none, if it is -1).
+ */
+int count_cursor(multimap *mm, int key, int first_key) {
+    mm_cursor *cursor = mm_cursor_seek(mm, key);
+    int k, v, prev = key, count = 0, ok = 1;
+
+    while (mm_cursor_next(cursor, &k, &v)) {
+        if (count == 0 && k != first_key)
+            ok = 0;
+        if (k < prev)
+            ok = 0;
+        prev = k;
+        count++;
+    }
+    mm_cursor_free(cursor);
+    if (count == 0 && first_key != -1)
+        ok = 0;
+    return ok ? count : -1;
+}
+
+
+/* Builds a deep tree holding the even keys below STRESS_KEYS, with two
+ * values each, and checks range scans and cursors against it, including
+ * bounds that fall between keys and walks that stop early.
+ */
+void test_range_stress() {
+    mm_config config = { 64 };
+    multimap *mm;
+    int i, key;
+
+    mm = init_multimap_with_config(&config);
+    for (i = 0; i < STRESS_KEYS / 2; i++) {
+        key = 2 * ((i * 7919) % (STRESS_KEYS / 2));
+        mm_add_value(mm, key, key);
+        mm_add_value(mm, key, key + 1);
+    }
+
+    report("whole range", count_range(mm, 0, STRESS_KEYS, 0) == STRESS_KEYS);
+    report("range [100, 200)", count_range(mm, 100, 200, 0) == 100);
+    report("range [101, 201)", count_range(mm, 101, 201, 0) == 100);
+    report("range [-50, 1)", count_range(mm, -50, 1, 0) == 2);
+    report("empty range [500, 500)", count_range(mm, 500, 500, 0) == 0);
+    report("range past the end", count_range(mm, STRESS_KEYS, 2 * STRESS_KEYS,
+                                             0) == 0);
+    report("range stopped after 7 pairs",
+           count_range(mm, 1000, STRESS_KEYS, 7) == 7);
+    report("cursor from key 0", count_cursor(mm, 0, 0) == STRESS_KEYS);
+    report("cursor from key 1501",
+           count_cursor(mm, 1501, 1502) == STRESS_KEYS - 1502);
+    report("cursor from key 2000",
+           count_cursor(mm, 2000, 2000) == STRESS_KEYS - 2000);
+    report("cursor past the end", count_cursor(mm, STRESS_KEYS, -1) == 0);
+
+    clear_multimap(mm);
+    report("range over an empty multimap", count_range(mm, 0, 10, 0) == 0);
+    report("cursor over an empty multimap", count_cursor(mm, 0, -1) == 0);
+    free(mm);
+}
+
+
+/* Probes the multimap for n pairs with mm_contains_pairs(), plus the same
+ * pairs with their values changed and keys past the end, and checks that
+ * every answer matches mm_contains_pair().
+ */
+int check_contains_pairs(multimap *mm, const int *keys, const int *vals,
+                         int n) {
+    int *probe_keys, *probe_vals, *found;
+    int i, ok = 1;
+
+    if (n <= 0)
+        return 1;
+    probe_keys = malloc(3 * n * sizeof(int));
+    probe_vals = malloc(3 * n * sizeof(int));
+    found = malloc(3 * n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        probe_keys[i] = keys[i];
+        probe_vals[i] = vals[i];
+        probe_keys[n + i] = keys[i];
+        probe_vals[n + i] = vals[i] + 1;
+        probe_keys[2 * n + i] = keys[i] + STRESS_KEYS;
+        probe_vals[2 * n + i] = vals[i];
+    }
+    mm_contains_pairs(mm, probe_keys, probe_vals, found, 3 * n);
+    for (i = 0; i < 3 * n; i++) {
+        if (!found[i] != !mm_contains_pair(mm, probe_keys[i], probe_vals[i]))
+            ok = 0;
+    }
+
+    free(probe_keys);
+    free(probe_vals);
+    free(found);
+    return ok;
+}
+
+
+/* Bulk loads STRESS_KEYS keys with three values each, in a scrambled order,
+ * into a multimap of tiny half-full nodes, then checks that everything is
+ * there and that the multimap can still be changed normally.
+ */
+void test_bulk_load() {
+    mm_config config = { 64, 0.5 };
+    multimap *mm;
+    int *keys, *vals;
+    int i, n = 3 * STRESS_KEYS, ok = 1;
+
+    keys = malloc(n * sizeof(int));
+    vals = malloc(n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        keys[i] = (i * 7919) % STRESS_KEYS;
+        vals[i] = i;
+    }
+
+    mm = init_multimap_with_config(&config);
+    mm_bulk_load(mm, keys, vals, n);
+    report("all pairs loaded, in order", count_pairs(mm, 0) == n);
+    for (i = 0; i < n; i++)
+        ok &= mm_contains_pair(mm, keys[i], vals[i]);
+    report("every pair is found", ok);
+    report("no extra pairs are found",
+           !mm_contains_pair(mm, 5, 5) && !mm_contains_key(mm, STRESS_KEYS));
+    report("range [100, 200) holds 300 pairs",
+           count_range(mm, 100, 200, 0) == 300);
+    report("mm_contains_pairs agrees with mm_contains_pair",
+           check_contains_pairs(mm, keys, vals, n));
+
+    ok = 1;
+    for (i = 0; i < STRESS_KEYS; i += 2) {
+        ok &= mm_remove_key(mm, i) == 3;
+        mm_add_value(mm, i + STRESS_KEYS, i);
+    }
+    report("removing and adding after the load",
+           ok && count_pairs(mm, 0) == n - STRESS_KEYS);
+
+    mm_bulk_load(mm, keys, vals, STRESS_KEYS);
+    report("loading into a multimap that isn't empty",
+           count_pairs(mm, 0) == n && mm_contains_pair(mm, 0, 0));
+
+    clear_multimap(mm);
+    mm_bulk_load(mm, keys, vals, 0);
+    report("loading nothing", count_pairs(mm, 0) == 0);
+    free(mm);
+    free(keys);
+    free(vals);
+}
+
+
+/* What a traversal has seen, as a single number, for comparing two
+ * multimaps pair by pair.  The values of a key may come out in any order,
+ * so each pair is mixed on its own and the results are just added up.
+ */
+int hash_pair(void *ctx, int key, int value) {
+    unsigned int *hash = ctx;
+    unsigned int mix = (unsigned int) key * 1000003u ^ (unsigned int) value;
+
+    mix ^= mix >> 15;
+    mix *= 2654435761u;
+    *hash += mix ^ (mix >> 13);
+    return 0;
+}
+
+unsigned int hash_pairs(multimap *mm) {
+    unsigned int hash = 0;
+
+    mm_traverse_ex(mm, hash_pair, &hash);
+    return hash;
+}
+
+
+/* Adds the same scrambled pairs to two multimaps of tiny nodes, one pair at
+ * a time to one and in batches of different sizes to the other, and checks
+ * that they end up holding exactly the same pairs in the same order.
+ */
+void test_add_values() {
+    mm_config config = { 64 };
+    multimap *one, *batched;
+    mm_pair *pairs;
+    int i, n = 3 * STRESS_KEYS, done, batch;
+
+    pairs = malloc(n * sizeof(mm_pair));
+    for (i = 0; i < n; i++) {
+        pairs[i].key = (i * 7919) % STRESS_KEYS;
+        pairs[i].value = i % 7;
+    }
+
+    one = init_multimap_with_config(&config);
+    batched = init_multimap_with_config(&config);
+    for (i = 0; i < n; i++)
+        mm_add_value(one, pairs[i].key, pairs[i].value);
+    for (done = 0, batch = 1; done < n; done += batch, batch *= 3) {
+        if (batch > n - done)
+            batch = n - done;
+        mm_add_values(batched, pairs + done, batch);
+    }
+
+    report("all pairs added, in order", count_pairs(batched, 0) == n);
+    report("same pairs as adding one at a time",
+           hash_pairs(batched) == hash_pairs(one));
+    mm_add_values(batched, pairs, 0);
+    report("adding an empty batch", count_pairs(batched, 0) == n);
+
+    clear_multimap(one);
+    clear_multimap(batched);
+    free(one);
+    free(batched);
+    free(pairs);
+}
+
+
+/* Returns nonzero if the two multimaps hand out exactly the same pairs, in
+ * the same order.
+ */
+int same_pairs(multimap *a, multimap *b) {
+    mm_cursor *ca = mm_cursor_seek(a, INT_MIN);
+    mm_cursor *cb = mm_cursor_seek(b, INT_MIN);
+    int ka, va, kb, vb, more_a, more_b, same = 1;
+
+    do {
+        more_a = mm_cursor_next(ca, &ka, &va);
+        more_b = mm_cursor_next(cb, &kb, &vb);
+        if (more_a != more_b || (more_a && (ka != kb || va != vb)))
+            same = 0;
+    } while (same && more_a);
+    mm_cursor_free(ca);
+    mm_cursor_free(cb);
+    return same;
+}
+
+
+/* Loads the same scrambled pairs (negative keys, and keys with many values,
+ * included) with mm_bulk_load() and with mm_bulk_load_parallel() on
+ * different numbers of threads, and checks that the multimaps all hand out
+ * the same pairs in the same order.  Then loads them again into multimaps
+ * that aren't empty.
+ */
+void test_bulk_load_parallel() {
+    mm_config config = { 64, 0.5 };
+    int threads[] = { 1, 3, 4, 7 };
+    multimap *loaded, *parallel;
+    mm_pair *pairs;
+    int *keys, *vals;
+    int i, t, n = PARALLEL_PAIRS, ok = 1;
+
+    pairs = malloc(n * sizeof(mm_pair));
+    keys = malloc(n * sizeof(int));
+    vals = malloc(n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        keys[i] = pairs[i].key = (int) ((i * 7919L) % (n / 3)) - n / 6;
+        vals[i] = pairs[i].value = (i % 1000 == 0) ? i : i % 5;
+    }
+
+    loaded = init_multimap_with_config(&config);
+    mm_bulk_load(loaded, keys, vals, n);
+    for (t = 0; t < 4; t++) {
+        parallel = init_multimap_with_config(&config);
+        mm_bulk_load_parallel(parallel, pairs, n, threads[t]);
+        ok &= same_pairs(parallel, loaded);
+        clear_multimap(parallel);
+        free(parallel);
+    }
+    report("same pairs as mm_bulk_load, on 1, 3, 4 and 7 threads", ok);
+
+    parallel = init_multimap_with_config(&config);
+    mm_bulk_load_parallel(parallel, pairs, n, 4);
+    report("every pair is found", mm_contains_pair(parallel, keys[0], vals[0])
+           && mm_contains_pair(parallel, keys[n - 1], vals[n - 1]) &&
+           check_contains_pairs(parallel, keys, vals, n));
+    report("range [0, 1000) holds the same pairs",
+           count_range(parallel, 0, 1000, 0) ==
+           count_range(loaded, 0, 1000, 0));
+
+    mm_bulk_load_parallel(parallel, pairs, n / 2, 4);
+    mm_add_values(loaded, pairs, n / 2);
+    report("loading into a multimap that isn't empty",
+           count_pairs(parallel, 0) == n + n / 2 &&
+           same_pairs(parallel, loaded));
+
+    clear_multimap(parallel);
+    mm_bulk_load_parallel(parallel, pairs, 0, 4);
+    report("loading nothing", count_pairs(parallel, 0) == 0);
+
+    clear_multimap(loaded);
+    free(loaded);
+    free(parallel);
+    free(pairs);
+    free(keys);
+    free(vals);
+}
+
+
+/* Fills a multimap made of tiny nodes, then empties it again in a scrambled
+ * order (half the keys value by value, half all at once), checking after
+ * each round that exactly the right keys are left, in order.
+ */
+void test_removal_stress() {
+    mm_config config = { 64 };
+    multimap *mm;
+    int i, key, round, ok, pair_count;
+
+    mm = init_multimap_with_config(&config);
+    for (i = 0; i < STRESS_KEYS; i++) {
+        key = (i * 7919) % STRESS_KEYS;
+        mm_add_value(mm, key, key);
+        mm_add_value(mm, key, key + STRESS_KEYS);
+    }
+
+    for (round = 0; round < 4; round++) {
+        ok = 1;
+        for (i = round; i < STRESS_KEYS; i += 4) {
+            key = (i * 104729) % STRESS_KEYS;
+            if (key % 2 == 0) {
+                ok &= mm_remove_value(mm, key, key) == 1;
+                ok &= mm_contains_key(mm, key);
+                ok &= mm_remove_value(mm, key, key + STRESS_KEYS) == 1;
+            }
+            else {
+                ok &= mm_remove_key(mm, key) == 2;
+            }
+            ok &= !mm_contains_key(mm, key);
+        }
+        for (i = 0; i < STRESS_KEYS; i++) {
+            key = (i * 104729) % STRESS_KEYS;
+            ok &= (mm_contains_pair(mm, key, key) == (i % 4 > round));
+        }
+
+        pair_count = count_pairs(mm, 0);
+        ok &= pair_count == 2 * (STRESS_KEYS / 4) * (3 - round);
+
+        printf(" * round %d, %d pairs left:  %s\n", round, pair_count,
+               ok ? "PASS" : "FAIL");
+        if (!ok)
+            failures++;
+    }
+
+    clear_multimap(mm);
+    free(mm);
+}
+
+
+
+/* Gives one key thousands of values (each twice), then takes them away
+ * again, checking which pairs are there at every step.
+ */
+void test_heavy_key() {
+    multimap *mm = init_multimap();
+    int i, left, ok = 1;
+
+    for (i = 0; i < HEAVY_VALUES; i++) {
+        mm_add_value(mm, 7, i * 3);
+        mm_add_value(mm, 8, i);
+    }
+    for (i = HEAVY_VALUES - 1; i >= 0; i--)
+        mm_add_value(mm, 7, i * 3);
+
+    for (i = 0; i < HEAVY_VALUES; i++) {
+        ok &= mm_contains_pair(mm, 7, i * 3);
+        ok &= !mm_contains_pair(mm, 7, i * 3 + 1);
+    }
+    report("all values of a heavy key are found", ok);
+    report("a heavy key traverses all of its values",
+           count_pairs(mm, 0) == 3 * HEAVY_VALUES);
+
+    ok = 1;
+    for (left = HEAVY_VALUES; left > 0; left -= 7) {
+        for (i = left - 7; i < left; i++) {
+            if (i >= 0)
+                ok &= mm_remove_value(mm, 7, i * 3) == 2;
+        }
+        ok &= mm_contains_pair(mm, 7, 0) == (left > 7);
+        ok &= !mm_contains_pair(mm, 7, (left - 1) * 3);
+        ok &= mm_contains_pair(mm, 7, (left - 8) * 3) == (left > 7);
+    }
+    report("removing the values of a heavy key one by one", ok);
+    report("the heavy key is gone", !mm_contains_key(mm, 7));
+    report("the other key is untouched",
+           count_pairs(mm, 0) == HEAVY_VALUES);
+
+    clear_multimap(mm);
+    free(mm);
+}
+
+
+/* The ith value the value shapes test gives a key: many copies of a few
+ * small values, consecutive values, spread out values, or a few negative
+ * ones.
+ */
+int shape_value(int key, int i) {
+    switch (key) {
+    case 1:  return i % 50;
+    case 2:  return i;
+    case 3:  return i * 100003;
+    default: return -1000 - i % 7;
+    }
+}
+
+int hash_values(void *ctx, int key, const int *values, int nVals) {
+    int i;
+
+    for (i = 0; i < nVals; i++)
+        hash_pair(ctx, key, values[i]);
+    return 0;
+}
+
+/* Checks that mm_traverse_ex(), mm_traverse_values() and a cursor all hand
+ * over exactly the pairs that hash to expected.
+ */
+int check_shapes(multimap *mm, unsigned int expected) {
+    unsigned int by_values = 0, by_cursor = 0;
+    mm_cursor *cursor;
+    int key, value;
+
+    mm_traverse_values(mm, hash_values, &by_values);
+    cursor = mm_cursor_seek(mm, 0);
+    while (mm_cursor_next(cursor, &key, &value))
+        hash_pair(&by_cursor, key, value);
+    mm_cursor_free(cursor);
+
+    return hash_pairs(mm) == expected && by_values == expected &&
+           by_cursor == expected;
+}
+
+/* Gives keys values of different shapes, however the multimap ends up
+ * storing them, and checks that every pair can still be found and walked
+ * over, before and after taking away the values divisible by 3.
+ */
+void test_value_shapes() {
+    multimap *mm = init_multimap();
+    unsigned int expected = 0;
+    int i, key, value, ok = 1;
+
+    for (i = 0; i < SHAPE_VALUES; i++) {
+        for (key = 1; key <= 4; key++) {
+            mm_add_value(mm, key, shape_value(key, i));
+            hash_pair(&expected, key, shape_value(key, i));
+        }
+    }
+    for (i = 0; i < SHAPE_VALUES; i++) {
+        for (key = 1; key <= 4; key++) {
+            ok &= mm_contains_pair(mm, key, shape_value(key, i));
+            ok &= !mm_contains_pair(mm, key, shape_value(key, i) + 100000);
+        }
+    }
+    report("values of every shape are found", ok);
+    report("values of every shape are walked over",
+           check_shapes(mm, expected));
+
+    expected = 0;
+    ok = 1;
+    for (i = 0; i < SHAPE_VALUES; i++) {
+        for (key = 1; key <= 4; key++) {
+            value = shape_value(key, i);
+            if (value % 3 == 0)
+                mm_remove_value(mm, key, value);
+            else
+                hash_pair(&expected, key, value);
+        }
+    }
+    for (i = 0; i < SHAPE_VALUES; i++) {
+        for (key = 1; key <= 4; key++) {
+            value = shape_value(key, i);
+            ok &= mm_contains_pair(mm, key, value) == (value % 3 != 0);
+        }
+    }
+    report("removing values of every shape", ok);
+    report("what is left of them is walked over", check_shapes(mm, expected));
+
+    mm_shrink_to_fit(mm);
+    report("shrinking to fit keeps every pair", check_shapes(mm, expected));
+    for (key = 1; key <= 4; key++) {
+        mm_add_value(mm, key, 3);
+        hash_pair(&expected, key, 3);
+    }
+    report("values can still be added after shrinking",
+           check_shapes(mm, expected) && mm_contains_pair(mm, 3, 3));
+
+    clear_multimap(mm);
+    free(mm);
+}
+
+
+/* One of the threads of the concurrency test, and how many of the checks
+ * it made failed.
+ */
+typedef struct test_thread {
+    multimap *mm;
+    sharded_multimap *smm;  /* for sharded_worker() */
+    int id;
+    int errors;
+} test_thread;
+
+/* Adds keys interleaved with those of the other threads (so that they all
+ * split the same nodes) with two values each, plus one value of a key they
+ * all share, then checks its own pairs and takes half of them away again:
+ * for every other key one value, and for the rest the whole key.
+ */
+void * concurrent_worker(void *arg) {
+    test_thread *thread = arg;
+    multimap *mm = thread->mm;
+    int i, key;
+
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        mm_add_value(mm, key, key);
+        mm_add_value(mm, key, key + TEST_THREADS * THREAD_KEYS);
+        mm_add_value(mm, -1, thread->id * THREAD_KEYS + i);
+    }
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        thread->errors += !mm_contains_pair(mm, key, key);
+        thread->errors += !mm_contains_pair(mm, key,
+                                            key + TEST_THREADS * THREAD_KEYS);
+        thread->errors += !mm_contains_pair(mm, -1,
+                                            thread->id * THREAD_KEYS + i);
+    }
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        if (i % 2 == 0)
+            thread->errors += mm_remove_value(mm, key, key) != 1;
+        else
+            thread->errors += mm_remove_key(mm, key) != 2;
+        thread->errors += mm_contains_key(mm, key) != (i % 2 == 0);
+    }
+    return NULL;
+}
+
+
+/* Runs TEST_THREADS threads on one concurrent multimap (of the specified
+ * MM_CONCURRENT_* kind), made of tiny nodes so that they split and merge
+ * lots of them, then checks what they left.
+ */
+void test_concurrent(int concurrent) {
+    mm_config config = { 64, 0, 0, concurrent };
+    test_thread threads[TEST_THREADS];
+    pthread_t ids[TEST_THREADS];
+    multimap *mm;
+    int t, errors = 0;
+
+    mm = init_multimap_with_config(&config);
+    for (t = 0; t < TEST_THREADS; t++) {
+        threads[t].mm = mm;
+        threads[t].id = t;
+        threads[t].errors = 0;
+        pthread_create(&ids[t], NULL, concurrent_worker, &threads[t]);
+    }
+    for (t = 0; t < TEST_THREADS; t++) {
+        pthread_join(ids[t], NULL);
+        errors += threads[t].errors;
+    }
+
+    report("each thread finds its own pairs, and removes them", errors == 0);
+    report("the pairs left are all there, in order",
+           count_pairs(mm, 0) == TEST_THREADS * THREAD_KEYS * 3 / 2);
+    report("every thread's value of the shared key is there",
+           mm_contains_pair(mm, -1, 0) &&
+           mm_contains_pair(mm, -1, TEST_THREADS * THREAD_KEYS - 1) &&
+           mm_remove_key(mm, -1) == TEST_THREADS * THREAD_KEYS);
+
+    clear_multimap(mm);
+    free(mm);
+}
+
+
+/* concurrent_worker(), on a sharded multimap. */
+void * sharded_worker(void *arg) {
+    test_thread *thread = arg;
+    sharded_multimap *smm = thread->smm;
+    int i, key;
+
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        sm_add_value(smm, key, key);
+        sm_add_value(smm, key, key + TEST_THREADS * THREAD_KEYS);
+    }
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        thread->errors += !sm_contains_pair(smm, key, key);
+        thread->errors += !sm_contains_pair(smm, key,
+                                            key + TEST_THREADS * THREAD_KEYS);
+    }
+    for (i = 0; i < THREAD_KEYS; i++) {
+        key = i * TEST_THREADS + thread->id;
+        if (i % 2 == 0)
+            thread->errors += sm_remove_value(smm, key, key) != 1;
+        else
+            thread->errors += sm_remove_key(smm, key) != 2;
+        thread->errors += sm_contains_key(smm, key) != (i % 2 == 0);
+    }
+    return NULL;
+}
+
+
+/* Runs TEST_THREADS threads on a sharded multimap of n_shards shards,
+ * routed by hash if bounds is NULL and by key range otherwise, then checks
+ * that the traversal merges the shards back into key order.
+ */
+void test_sharded(int n_shards, const int *bounds) {
+    test_thread threads[TEST_THREADS];
+    pthread_t ids[TEST_THREADS];
+    sharded_multimap *smm;
+    mm_pair batch[100];
+    walk_state state = { 0, 0, 0, 1 };
+    int t, errors = 0;
+    int left = TEST_THREADS * THREAD_KEYS / 2;
+
+    smm = init_sharded_multimap(n_shards, bounds, NULL);
+    for (t = 0; t < TEST_THREADS; t++) {
+        threads[t].smm = smm;
+        threads[t].id = t;
+        threads[t].errors = 0;
+        pthread_create(&ids[t], NULL, sharded_worker, &threads[t]);
+    }
+    for (t = 0; t < TEST_THREADS; t++) {
+        pthread_join(ids[t], NULL);
+        errors += threads[t].errors;
+    }
+    report("each thread finds its own pairs, and removes them", errors == 0);
+
+    for (t = 0; t < 100; t++) {
+        batch[t].key = -1 - t % 50;
+        batch[t].value = t;
+    }
+    sm_add_values(smm, batch, 100);
+    sm_traverse_ex(smm, check_walk, &state);
+    report("the pairs left, and a batch, come out in order",
+           state.in_order && state.count == left + 100 &&
+           sm_contains_pair(smm, -50, 99));
+
+    state.count = 0;
+    state.limit = 150;
+    sm_traverse_ex(smm, check_walk, &state);
+    report("a traversal stops when asked to", state.count == 150);
+
+    clear_sharded_multimap(smm);
+    state.count = 0;
+    state.limit = 0;
+    sm_traverse_ex(smm, check_walk, &state);
+    report("nothing is left once it is cleared",
+           state.count == 0 && !sm_contains_key(smm, 0));
+    free_sharded_multimap(smm);
+}
+
+
+/* One of the threads reading a snapshot while its multimap changes, what
+ * the snapshot should hold, and how many of its checks failed.
+ */
+typedef struct snapshot_reader {
+    multimap *snap;
+    unsigned int hash;
+    int pairs;
+    int errors;
+} snapshot_reader;
+
+void * snapshot_worker(void *arg) {
+    snapshot_reader *reader = arg;
+    int round, i;
+
+    for (round = 0; round < 3; round++) {
+        reader->errors += hash_pairs(reader->snap) != reader->hash;
+        reader->errors += count_pairs(reader->snap, 0) != reader->pairs;
+        for (i = 0; i < STRESS_KEYS; i++)
+            reader->errors += !mm_contains_pair(reader->snap, i, i);
+    }
+    return NULL;
+}
+
+
+/* Takes a snapshot of a deep multimap (with a couple of heavy keys, so that
+ * every way of storing values gets copied), then changes the multimap all
+ * over while TEST_THREADS threads check that the snapshot doesn't change.
+ * Then does the same with a second snapshot, outliving the first one.
+ */
+void test_snapshot() {
+    mm_config config = { 64 };
+    snapshot_reader readers[TEST_THREADS];
+    pthread_t ids[TEST_THREADS];
+    multimap *mm, *snap, *later, *again;
+    unsigned int hash;
+    int i, key, t, errors = 0;
+    int pairs = 2 * STRESS_KEYS + 2 * HEAVY_VALUES;
+    int left = STRESS_KEYS / 2 + STRESS_KEYS + HEAVY_VALUES / 2 +
+               2 * HEAVY_VALUES;
+
+    mm = init_multimap_with_config(&config);
+    for (i = 0; i < STRESS_KEYS; i++) {
+        key = (i * 7919) % STRESS_KEYS;
+        mm_add_value(mm, key, key);
+        mm_add_value(mm, key, key + STRESS_KEYS);
+    }
+    for (i = 0; i < HEAVY_VALUES; i++) {
+        mm_add_value(mm, -1, i);
+        mm_add_value(mm, -2, i * 7919);
+    }
+
+    hash = hash_pairs(mm);
+    snap = mm_snapshot(mm);
+    if (snap == NULL) {
+        report("a snapshot is taken", 0);
+        return;
+    }
+    for (t = 0; t < TEST_THREADS; t++) {
+        readers[t].snap = snap;
+        readers[t].hash = hash;
+        readers[t].pairs = pairs;
+        readers[t].errors = 0;
+        pthread_create(&ids[t], NULL, snapshot_worker, &readers[t]);
+    }
+    for (i = 0; i < STRESS_KEYS; i++) {
+        key = (i * 104729) % STRESS_KEYS;
+        if (key % 2 == 0)
+            mm_remove_value(mm, key, key + STRESS_KEYS);
+        else
+            mm_remove_key(mm, key);
+        mm_add_value(mm, STRESS_KEYS + key, key);
+    }
+    for (i = 0; i < HEAVY_VALUES; i++) {
+        if (i % 2 == 0)
+            mm_remove_value(mm, -1, i);
+        mm_add_value(mm, -2, -i);
+    }
+    for (t = 0; t < TEST_THREADS; t++) {
+        pthread_join(ids[t], NULL);
+        errors += readers[t].errors;
+    }
+
+    report("the snapshot doesn't change while the multimap does",
+           errors == 0 && hash_pairs(snap) == hash &&
+           count_pairs(snap, 0) == pairs && mm_contains_pair(snap, 1, 1) &&
+           !mm_contains_key(snap, STRESS_KEYS));
+    report("the multimap has all of its changes",
+           count_pairs(mm, 0) == left && !mm_contains_key(mm, 1) &&
+           !mm_contains_pair(mm, -1, 0) && mm_contains_pair(mm, -2, -1));
+
+    again = mm_snapshot(snap);
+    report("a snapshot of the snapshot is the same",
+           again != NULL && hash_pairs(again) == hash);
+    clear_multimap(again);
+    free(again);
+
+    later = mm_snapshot(mm);
+    hash = hash_pairs(mm);
+    clear_multimap(snap);
+    free(snap);
+    for (i = 0; i < STRESS_KEYS; i++)
+        mm_remove_key(mm, STRESS_KEYS + i);
+    mm_remove_key(mm, -2);
+    report("a later snapshot outlives the first",
+           hash_pairs(later) == hash && count_pairs(later, 0) == left);
+    clear_multimap(later);
+    free(later);
+    report("the multimap is on its own again",
+           count_pairs(mm, 0) == STRESS_KEYS / 2 + HEAVY_VALUES / 2);
+
+    clear_multimap(mm);
+    free(mm);
+}
+
 
 int main() {
     multimap *mm;
+    int shard_bounds[] = { -20, 2500, 7000 };
+    values_state all_keys = { 0, 0, 0, 0, 0, 1 };
+    values_state two_keys = { 0, 0, 0, 0, 2, 1 };
+    int batch_keys[16], batch_vals[16];
     int i;
 
     failures = 0;
@@ -95,6 +983,13 @@ int main() {
         printf("\n");
     }
 
+    for (i = 0; probe_values[i] != -1; i += 3) {
+        batch_keys[i / 3] = probe_values[i];
+        batch_vals[i / 3] = probe_values[i + 1];
+    }
+    report("probing all of them at once gives the same answers",
+           check_contains_pairs(mm, batch_keys, batch_vals, i / 3));
+
     printf("\nProbing multimap for keys.\n");
     for (i = 0; probe_keys[i] != -1; i += 2) {
         int answer = probe_keys[i + 1];
@@ -118,6 +1013,96 @@ int main() {
     prev_key = -1;
     mm_traverse(mm, check_order);
 
+    printf("\nTraversing with a context.\n");
+    report("mm_traverse_ex sees 6 pairs", count_pairs(mm, 0) == 6);
+    report("mm_traverse_ex stops after 4 pairs", count_pairs(mm, 4) == 4);
+    mm_traverse_values(mm, check_values, &all_keys);
+    report("mm_traverse_values sees 4 keys, 6 values",
+           all_keys.in_order && all_keys.keys == 4 && all_keys.values == 6);
+    report("key 2 has values 20 and 15", all_keys.key2_sum == 35);
+    mm_traverse_values(mm, check_values, &two_keys);
+    report("mm_traverse_values stops after 2 keys",
+           two_keys.in_order && two_keys.keys == 2 && two_keys.values == 4);
+
+    printf("\nScanning ranges.\n");
+    report("range [2, 4) holds 3 pairs", count_range(mm, 2, 4, 0) == 3);
+    report("range [0, 100) holds 6 pairs", count_range(mm, 0, 100, 0) == 6);
+    report("range [5, 100) is empty", count_range(mm, 5, 100, 0) == 0);
+    report("cursor from key 2 sees 4 pairs", count_cursor(mm, 2, 2) == 4);
+    report("cursor from key 5 sees nothing", count_cursor(mm, 5, -1) == 0);
+
+    printf("\nRemoving pairs.\n");
+    for (i = 0; remove_values[i] != -1; i += 3) {
+        int answer = remove_values[i + 2];
+        int removed = mm_remove_value(mm, remove_values[i],
+                                      remove_values[i + 1]);
+
+        printf(" * (%d, %d) should remove %d:  %s\n", remove_values[i],
+               remove_values[i + 1], answer,
+               (removed == answer) ? "PASS" : "FAIL");
+        if (removed != answer)
+            failures++;
+    }
+    for (i = 0; probe_after_remove[i] != -1; i += 3) {
+        int answer = probe_after_remove[i + 2];
+        int probe = mm_contains_pair(mm, probe_after_remove[i],
+                                     probe_after_remove[i + 1]);
+
+        printf(" * (%d, %d) should%s be present:  %s\n",
+               probe_after_remove[i], probe_after_remove[i + 1],
+               answer ? "" : " NOT", (!probe == !answer) ? "PASS" : "FAIL");
+        if (!probe != !answer)
+            failures++;
+    }
+    report("key 3 is gone", !mm_contains_key(mm, 3));
+    report("removing key 1 removes 2 pairs", mm_remove_key(mm, 1) == 2);
+    report("key 1 is gone", !mm_contains_key(mm, 1));
+    report("removing key 1 again removes nothing", mm_remove_key(mm, 1) == 0);
+
+    printf("\nChecking traversal order.\n");
+    prev_key = -1;
+    mm_traverse(mm, check_order);
+
+    printf("\nScanning ranges of a deep tree.\n");
+    test_range_stress();
+
+    printf("\nBulk loading a deep tree.\n");
+    test_bulk_load();
+
+    printf("\nAdding batches of pairs to a deep tree.\n");
+    test_add_values();
+
+    printf("\nBulk loading a deep tree from several threads.\n");
+    test_bulk_load_parallel();
+
+    printf("\nRemoving lots of keys from a deep tree.\n");
+    test_removal_stress();
+
+    printf("\nAdding and removing thousands of values of one key.\n");
+    test_heavy_key();
+
+    printf("\nAdding and removing values of different shapes.\n");
+    test_value_shapes();
+
+    printf("\nAdding and removing keys from %d threads at once.\n",
+           TEST_THREADS);
+    test_concurrent(MM_CONCURRENT_LATCHES);
+
+    printf("\nThe same, with optimistic lock coupling.\n");
+    test_concurrent(MM_CONCURRENT_OPTIMISTIC);
+
+    printf("\nThe same, with a B-link tree.\n");
+    test_concurrent(MM_CONCURRENT_BLINK);
+
+    printf("\nThe same on a multimap of 8 shards, by hash.\n");
+    test_sharded(8, NULL);
+
+    printf("\nThe same on a multimap of 4 shards, by key range.\n");
+    test_sharded(4, shard_bounds);
+
+    printf("\nTaking snapshots of a deep tree while it changes.\n");
+    test_snapshot();
+
     printf("\nTesting finished, freeing multimap.\n");
     clear_multimap(mm);
     free(mm);
@@ -0,0 +1,1603 @@
+/* The values of one key, as stored by the b-tree and B+ tree multimaps
+ * (bTree.c and bPlusTree.c), along with everything those do to them: adding,
+ * removing, looking for and walking over values.
+ *
+ * A key with at most INLINE_VALUES values (which is most keys, in most
+ * workloads) keeps them in the key_node itself, in the room its array
+ * pointer and hash set pointer would otherwise take, so they cost no
+ * allocation and no extra cache miss to look at.  Six values fit there,
+ * which keeps a key_node at 32 bytes, two to a cache line; more would
+ * make every key_node bigger and so every tree node hold fewer keys.
+ * Past that they are spilled into an array, and moved back in once they
+ * fit again.
+ *
+ * Otherwise the values of a key usually live in one array, in two parts:
+ *
+ *     values:  | sorted prefix (nSorted)        | unsorted tail |
+ *
+ * New values are just appended to the tail.  Once the tail holds more than
+ * TAIL_VALUES values it is sorted and merged into the prefix, so the tail
+ * never takes more than a few cache lines to scan (with SIMD compares), and
+ * the rest can be binary searched.  Merging only ever happens when values
+ * are added or removed, so looking for a value never changes anything.
+ * (That is what lets a lookup of an optimistic bTree read the values of a
+ * key without any lock:  while value_epoch is set, whatever it might be
+ * reading is retired rather than freed, see mmepoch.h.)
+ *
+ * The array lives in a block whose size is a power of two, at least a cache
+ * line, and cache line aligned, so that it grows by doubling (with one
+ * copy each time, rather than a realloc every cache line) and its capacity
+ * is kept in the key_node rather than worked out.  Blocks of up to
+ * 64 << (SIZE_CLASSES - 1) bytes are carved out of slabs, one size class
+ * per block size, and freed blocks go on their class's free list to be
+ * handed out again.  The first slab of a class is small (MIN_SLAB bytes,
+ * or enough for one block), and each after it twice the one before, up to
+ * SLAB_SIZE, so that a small multimap takes little memory.
+ *
+ * The slabs and free lists belong to one multimap (its value_pool, kept
+ * under a mutex so that concurrent multimaps can share it, with a cache in
+ * front of it for each thread), and the slabs are given back to the system
+ * all at once when the multimap is cleared.  Slabs of SLAB_SIZE are mapped
+ * by pages_alloc() (see mmarena.h) with the multimap's page backing, on
+ * huge pages if it can; smaller ones come from the heap.  The array shrinks
+ * again, by halves, once a quarter of it is used, or all the way on
+ * kNode_shrink().
+ *
+ * A key with HASH_VALUES or more values also gets a hash set of its
+ * distinct values, so looking one up takes a probe or two however many
+ * there are.  The array is still kept (traversals walk it), but no longer
+ * sorted, since nothing searches it.  Once the key is down to a quarter of
+ * HASH_VALUES the set is dropped and the array sorted again.
+ *
+ * Small, dense values are packed instead, the way roaring bitmaps do it:
+ * whenever the array has just been sorted, it is packed into whichever of
+ * these takes the least space, if that is at most half of the array's:
+ *
+ *  - a bitmap over [base, base + 64 * nWords), one bit per value, so that
+ *    looking for a value is a bit test.  A value that is there more than
+ *    once is set in more than one layer: layer k has the values with more
+ *    than k copies.
+ *  - runs of consecutive values, if no value is there twice, which are
+ *    binary searched.
+ *
+ * Packed values take new values (and lose old ones) in place, until the
+ * array would be smaller again, when they are unpacked back into one.  They
+ * are walked over in order, each value as many times as it is there, so a
+ * traversal sees the same pairs whichever way a key is stored.
+ *
+ * A key_node copied for a snapshot can share its values with the one it was
+ * copied from (kNode_share()):  the pool counts how many key_nodes hold
+ * them, and the first change to either key gives it a copy of its own
+ * (kNode_own()), so that only the keys that change are ever copied.
+ */
+
+#ifndef MMVALUES_H
+#define MMVALUES_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "multimap.h"
+#include "mmarena.h"
+#include "mmepoch.h"
+
+
+#define LINE_SIZE (64) /* the size of a cache line in bytes */
+#define TAIL_VALUES (16) /* how long the unsorted tail may get (one line) */
+#define HASH_VALUES (1024) /* how many values a key needs for a hash set */
+#define INLINE_VALUES (6) /* how many values fit in the key_node itself */
+#define EMPTY_SLOT INT_MIN /* marks an empty slot of a hash set */
+#define MAX_WORDS (INT_MAX / 64) /* the most words a bitmap layer can have */
+#define SIZE_CLASSES (12) /* 64 byte blocks up to 128KB ones come from slabs */
+#define SLAB_SIZE HUGE_PAGE /* how many bytes a slab holds, at most */
+#define MIN_SLAB (16384) /* how many bytes the first slab of a class holds */
+#define CACHE_BYTES (8192) /* how much a thread takes from its pool at once */
+
+#define BITMAP_VALUES (-1) /* the nSorted of a key whose values are a bitmap */
+#define RUN_VALUES (-2) /* the nSorted of a key whose values are runs */
+
+typedef int multimap_value; /* just for readability */
+
+/* An open addressing (linear probing) hash set of values. */
+typedef struct value_set {
+    unsigned int mask;        /* the number of slots, less one */
+    int count;                /* how many values are in the slots */
+    int hasEmpty;             /* is EMPTY_SLOT itself in the set */
+    multimap_value slots[];
+} value_set;
+
+/* Values as bits, bit i of a layer standing for base + i. */
+typedef struct value_bitmap {
+    int base;                 /* a multiple of 64 */
+    int nWords;               /* how many 64 bit words a layer takes */
+    int nLayers;              /* how many copies the commonest value has */
+    uint64_t words[];         /* layer k is words[k * nWords] onwards */
+} value_bitmap;
+
+typedef struct value_run {
+    int first, last;
+} value_run;
+
+/* Values as sorted runs of consecutive values. */
+typedef struct value_runs {
+    int nRuns;
+    int maxRuns;              /* how many runs there is room for */
+    value_run runs[];
+} value_runs;
+
+typedef struct key_node {
+    int nVals;                /* how many values there are, copies and all */
+    int nSorted;              /* how many of them are in the sorted prefix,
+                                 or BITMAP_VALUES or RUN_VALUES if packed */
+    union {
+        /* the values, if there are at most INLINE_VALUES (and not packed) */
+        multimap_value inlineValues[INLINE_VALUES];
+
+        struct {
+            int capacity;           /* how many values the array has room for */
+            multimap_value *values; /* NULL if packed */
+            union {
+                value_set *set;     /* the distinct values, if there are many */
+                value_bitmap *bitmap;
+                value_runs *runs;
+            };
+        };
+    };
+} key_node;
+
+/* Where a walk over the values of a key is up to. */
+typedef struct value_iter {
+    const key_node *kNode;
+    int next;                 /* the next value, bit or run to look at */
+    int value;                /* packed: the value being handed out */
+    int left;                 /* packed: how many more times to hand it out */
+} value_iter;
+
+
+/* A block on a free list. */
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+/* The start of a slab; its blocks follow, from LINE_SIZE bytes in. */
+typedef struct value_slab {
+    struct value_slab *next;
+    size_t bytes;
+    int mapped;               /* zero if it came from the heap instead */
+} value_slab;
+
+/* The blocks one thread has taken from a pool, so that it only takes the
+ * pool's lock once a batch (see cache_batch()):  some given back, and a run
+ * not handed out yet, of each size class.
+ */
+typedef struct value_cache {
+    free_block *freeBlocks[SIZE_CLASSES];
+    int nFree[SIZE_CLASSES];
+    char *runNext[SIZE_CLASSES];
+    char *runEnd[SIZE_CLASSES];
+} value_cache;
+
+/* A values array (or set, bitmap or runs) that more than one key_node holds
+ * (see kNode_share()), and how many more.
+ */
+typedef struct shared_values {
+    const void *block;        /* NULL for an empty slot */
+    int extra;
+} shared_values;
+
+/* Where the blocks of one multimap come from:  its slabs, and the blocks
+ * it has given back, which are all freed at once by pool_release().  The
+ * threads of a concurrent multimap share it, under its lock, each through
+ * a cache of its own.  A cache belongs to a thread's epoch slot (see
+ * mmepoch.h) rather than the thread, so that what a thread leaves in it
+ * when it exits goes to the next thread given that slot, and stays in the
+ * pool either way.
+ */
+typedef struct value_pool {
+    int backing;              /* how its slabs are backed, MM_PAGES_* */
+    value_cache *caches[EPOCH_SLOTS]; /* by slot, made when first needed */
+    pthread_mutex_t lock;     /* guards everything below */
+    value_slab *slabs;        /* the newest first */
+    char *slabNext[SIZE_CLASSES];  /* the part of the newest slab of each */
+    char *slabEnd[SIZE_CLASSES];   /*     class not handed out yet */
+    size_t slabBytes[SIZE_CLASSES]; /* the size of its next slab, once any */
+    free_block *freeBlocks[SIZE_CLASSES];
+    shared_values *shared;    /* the shared values, linear probing */
+    size_t sharedMask;        /* its number of slots, less one */
+    size_t nShared;           /* how many it holds (read without the lock) */
+} value_pool;
+
+static _Thread_local mm_alloc_stats value_stats;
+
+/* Set by a multimap whose lookups read values without any lock, while this
+ * thread is in one of its operations:  arrays, sets, bitmaps and runs that
+ * are let go of are then retired to it instead of freed (see mmepoch.h).
+ */
+static _Thread_local epoch_domain *value_epoch;
+
+
+/* How many bytes the values array of a key with nVals values takes up: the
+ * smallest block size that fits them.
+ */
+static size_t values_space(size_t nVals) {
+    size_t bytes = nVals * sizeof(multimap_value);
+
+    if (bytes <= LINE_SIZE)
+        return LINE_SIZE;
+    return (size_t) 1 << (8 * sizeof(long) - __builtin_clzl(bytes - 1));
+}
+
+static size_t bitmap_space(size_t nWords, size_t nLayers) {
+    return sizeof(value_bitmap) + nWords * nLayers * sizeof(uint64_t);
+}
+
+static size_t runs_space(size_t nRuns) {
+    return sizeof(value_runs) + nRuns * sizeof(value_run);
+}
+
+
+/* The system allocator, counted in value_stats. */
+static void * counted_malloc(size_t bytes) {
+    value_stats.mallocs++;
+    return malloc(bytes);
+}
+
+static void * counted_calloc(size_t bytes) {
+    value_stats.mallocs++;
+    return calloc(1, bytes);
+}
+
+static void * counted_realloc(void *block, size_t bytes) {
+    value_stats.reallocs++;
+    return realloc(block, bytes);
+}
+
+static void counted_free(void *block) {
+    if (block != NULL) {
+        value_stats.frees++;
+        free(block);
+    }
+}
+
+
+/* Sets up an empty pool, whose slabs are backed the way backing says (see
+ * pages_backing()).
+ */
+static void pool_init(value_pool *pool, int backing) {
+    memset(pool, 0, sizeof(value_pool));
+    pool->backing = backing;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+
+/* Frees every slab (and cache) of the pool at once, leaving it empty (and
+ * usable).
+ */
+static void pool_release(value_pool *pool) {
+    int backing = pool->backing;
+    int i;
+
+    for (i = 0; i < EPOCH_SLOTS; i++)
+        free(pool->caches[i]);
+    free(pool->shared);
+    while (pool->slabs != NULL) {
+        value_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        pages_free_or_heap(slab, slab->bytes, slab->mapped);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pool_init(pool, backing);
+}
+
+
+/* Starts a new slab for blocks of size class sizeClass, twice as big as
+ * its last one.
+ */
+static void pool_grow(value_pool *pool, int sizeClass) {
+    size_t bytes = pool->slabBytes[sizeClass];
+    value_slab *slab;
+    int mapped = 0;
+
+    if (bytes == 0) {
+        bytes = MIN_SLAB;
+        while (bytes < LINE_SIZE + ((size_t) LINE_SIZE << sizeClass))
+            bytes *= 2;
+    }
+    if (bytes < SLAB_SIZE) {
+        slab = aligned_alloc(LINE_SIZE, bytes);
+        if (slab == NULL)
+            abort();
+    }
+    else {
+        slab = pages_alloc_or_heap(bytes, pool->backing, &mapped);
+    }
+    pool->slabBytes[sizeClass] = (2 * bytes < SLAB_SIZE) ? 2 * bytes :
+                                                          SLAB_SIZE;
+
+    value_stats.mallocs++;
+    slab->next = pool->slabs;
+    slab->bytes = bytes;
+    slab->mapped = mapped;
+    pool->slabs = slab;
+    pool->slabNext[sizeClass] = (char *) slab + LINE_SIZE;
+    pool->slabEnd[sizeClass] = (char *) slab + bytes;
+}
+
+
+/* How many blocks of bytes bytes a cache takes from its pool at once.  It
+ * gives half back once it has been given twice that many.
+ */
+static int cache_batch(size_t bytes) {
+    return (bytes < CACHE_BYTES) ? (int) (CACHE_BYTES / bytes) : 1;
+}
+
+
+/* The calling thread's cache in the pool, or NULL if it has to go to the
+ * pool itself (it shares the last epoch slot, or there's no memory for a
+ * cache).
+ */
+static value_cache * pool_cache(value_pool *pool) {
+    int slot = epoch_thread_slot();
+
+    if (slot == EPOCH_SLOTS)
+        return NULL;
+    if (pool->caches[slot] == NULL)
+        pool->caches[slot] = calloc(1, sizeof(value_cache));
+    return pool->caches[slot];
+}
+
+
+/* Takes up to batch blocks of size class sizeClass from the pool, whose
+ * lock the caller holds:  given back ones if it has any, and otherwise a
+ * run of new ones, from [*runNext, *runEnd).  Returns a list of the given
+ * back ones, and how many in *nFree.
+ */
+static free_block * pool_take(value_pool *pool, int sizeClass, int batch,
+                              int *nFree, char **runNext, char **runEnd) {
+    size_t bytes = (size_t) LINE_SIZE << sizeClass;
+    free_block *list = pool->freeBlocks[sizeClass];
+    free_block *last = list;
+    int n = 0;
+
+    *runNext = *runEnd = NULL;
+    if (list != NULL) {
+        for (n = 1; n < batch && last->next != NULL; n++)
+            last = last->next;
+        pool->freeBlocks[sizeClass] = last->next;
+        last->next = NULL;
+        *nFree = n;
+        return list;
+    }
+    if ((size_t) (pool->slabEnd[sizeClass] -
+                  pool->slabNext[sizeClass]) < bytes)
+        pool_grow(pool, sizeClass);
+    if ((size_t) (pool->slabEnd[sizeClass] -
+                  pool->slabNext[sizeClass]) / bytes < (size_t) batch)
+        batch = (pool->slabEnd[sizeClass] - pool->slabNext[sizeClass]) /
+                bytes;
+    *runNext = pool->slabNext[sizeClass];
+    *runEnd = *runNext + batch * bytes;
+    pool->slabNext[sizeClass] = *runEnd;
+    *nFree = 0;
+    return NULL;
+}
+
+
+/* Puts the n blocks of the list first ... last back in the pool. */
+static void pool_give(value_pool *pool, int sizeClass, free_block *first,
+                      free_block *last) {
+    pthread_mutex_lock(&pool->lock);
+    last->next = pool->freeBlocks[sizeClass];
+    pool->freeBlocks[sizeClass] = first;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Hands out a block of bytes bytes (as worked out by values_space()). */
+static multimap_value * block_alloc(value_pool *pool, size_t bytes) {
+    int sizeClass = __builtin_ctzl(bytes / LINE_SIZE);
+    value_cache *cache;
+    free_block *list;
+    char *runNext, *runEnd;
+    int n;
+
+    if (sizeClass >= SIZE_CLASSES) {
+        value_stats.mallocs++;
+        return aligned_alloc(LINE_SIZE, bytes);
+    }
+    cache = pool_cache(pool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        list = pool_take(pool, sizeClass, 1, &n, &runNext, &runEnd);
+        pthread_mutex_unlock(&pool->lock);
+        if (list != NULL)
+            value_stats.reused++;
+        return (list != NULL) ? (multimap_value *) list :
+                                (multimap_value *) runNext;
+    }
+
+    if (cache->freeBlocks[sizeClass] == NULL &&
+        cache->runNext[sizeClass] == cache->runEnd[sizeClass]) {
+        pthread_mutex_lock(&pool->lock);
+        cache->freeBlocks[sizeClass] =
+            pool_take(pool, sizeClass, cache_batch(bytes),
+                      &cache->nFree[sizeClass], &cache->runNext[sizeClass],
+                      &cache->runEnd[sizeClass]);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (cache->freeBlocks[sizeClass] != NULL) {
+        list = cache->freeBlocks[sizeClass];
+        cache->freeBlocks[sizeClass] = list->next;
+        cache->nFree[sizeClass]--;
+        value_stats.reused++;
+        return (multimap_value *) list;
+    }
+    runNext = cache->runNext[sizeClass];
+    cache->runNext[sizeClass] += bytes;
+    return (multimap_value *) runNext;
+}
+
+
+/* Puts a block back in its pool, ctx (or frees it, if it is a big one),
+ * through the calling thread's cache.
+ */
+static void block_reuse(void *ctx, void *block, size_t bytes) {
+    value_pool *pool = ctx;
+    int sizeClass = __builtin_ctzl(bytes / LINE_SIZE);
+    int batch = cache_batch(bytes);
+    free_block *freed = block, *last;
+    value_cache *cache;
+    int i;
+
+    if (sizeClass >= SIZE_CLASSES) {
+        counted_free(block);
+        return;
+    }
+    cache = pool_cache(pool);
+    if (cache == NULL) {
+        pool_give(pool, sizeClass, freed, freed);
+        return;
+    }
+
+    freed->next = cache->freeBlocks[sizeClass];
+    cache->freeBlocks[sizeClass] = freed;
+    if (++cache->nFree[sizeClass] < 2 * batch)
+        return;
+    for (i = 1, last = freed; i < batch; i++)
+        last = last->next;
+    cache->freeBlocks[sizeClass] = last->next;
+    cache->nFree[sizeClass] -= batch;
+    pool_give(pool, sizeClass, freed, last);
+}
+
+
+/* Gives everything in the calling thread's cache back to the pool, for
+ * the other threads to have, e.g. before the thread exits.
+ */
+static void pool_flush(value_pool *pool) {
+    value_cache *cache = pool_cache(pool);
+    size_t bytes;
+    free_block *last;
+    int sizeClass;
+
+    if (cache == NULL)
+        return;
+    for (sizeClass = 0; sizeClass < SIZE_CLASSES; sizeClass++) {
+        bytes = (size_t) LINE_SIZE << sizeClass;
+        while (cache->runNext[sizeClass] != cache->runEnd[sizeClass]) {
+            free_block *block = (free_block *) cache->runNext[sizeClass];
+            block->next = cache->freeBlocks[sizeClass];
+            cache->freeBlocks[sizeClass] = block;
+            cache->runNext[sizeClass] += bytes;
+        }
+        if (cache->freeBlocks[sizeClass] == NULL)
+            continue;
+        for (last = cache->freeBlocks[sizeClass]; last->next != NULL; )
+            last = last->next;
+        pool_give(pool, sizeClass, cache->freeBlocks[sizeClass], last);
+        cache->freeBlocks[sizeClass] = NULL;
+        cache->nFree[sizeClass] = 0;
+    }
+}
+
+
+/* Takes back a block handed out by block_alloc(), or retires it. */
+static void block_free(value_pool *pool, multimap_value *block,
+                       size_t bytes) {
+    if (block == NULL)
+        return;
+    if (value_epoch != NULL)
+        epoch_retire(value_epoch, block, bytes, block_reuse, pool);
+    else
+        block_reuse(pool, block, bytes);
+}
+
+
+/* The slot block would be in, in the pool's table of shared values, if
+ * nothing else were in the way.
+ */
+static size_t shared_home(const value_pool *pool, const void *block) {
+    return (size_t) ((uint64_t) (uintptr_t) block * 0x9E3779B97F4A7C15ull
+                     >> 32) & pool->sharedMask;
+}
+
+
+/* Where block is in the pool's table, or the empty slot where it would go.
+ * The caller holds the pool's lock.
+ */
+static size_t shared_slot(const value_pool *pool, const void *block) {
+    size_t slot = shared_home(pool, block);
+
+    while (pool->shared[slot].block != NULL &&
+           pool->shared[slot].block != block)
+        slot = (slot + 1) & pool->sharedMask;
+    return slot;
+}
+
+
+/* Doubles the pool's table (or starts it off), whose lock the caller
+ * holds.
+ */
+static void shared_grow(value_pool *pool) {
+    shared_values *old = pool->shared;
+    size_t oldSlots = (old != NULL) ? pool->sharedMask + 1 : 0;
+    size_t nSlots = (old != NULL) ? 2 * oldSlots : 64;
+    size_t i;
+
+    pool->shared = calloc(nSlots, sizeof(shared_values));
+    if (pool->shared == NULL)
+        abort();
+    pool->sharedMask = nSlots - 1;
+    for (i = 0; i < oldSlots; i++) {
+        if (old[i].block != NULL)
+            pool->shared[shared_slot(pool, old[i].block)] = old[i];
+    }
+    free(old);
+}
+
+
+/* Does more than one key_node hold block? */
+static int pool_shared(value_pool *pool, const void *block) {
+    int shared;
+
+    pthread_mutex_lock(&pool->lock);
+    shared = pool->shared != NULL &&
+             pool->shared[shared_slot(pool, block)].block != NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return shared;
+}
+
+
+/* Lets go of one hold on block, if more than one key_node holds it, and
+ * returns nonzero; returns zero (doing nothing) if the caller's is the only
+ * hold, so that block is the caller's to free.  A slot that is let go of
+ * is filled the same way set_erase() fills one.
+ */
+static int pool_unshare(value_pool *pool, const void *block) {
+    size_t hole, slot;
+
+    if (__atomic_load_n(&pool->nShared, __ATOMIC_RELAXED) == 0)
+        return 0;
+    pthread_mutex_lock(&pool->lock);
+    hole = shared_slot(pool, block);
+    if (pool->shared[hole].block == NULL) {
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    if (--pool->shared[hole].extra == 0) {
+        for (slot = (hole + 1) & pool->sharedMask;
+             pool->shared[slot].block != NULL;
+             slot = (slot + 1) & pool->sharedMask) {
+            size_t home = shared_home(pool, pool->shared[slot].block);
+
+            if (((slot - home) & pool->sharedMask) >=
+                ((slot - hole) & pool->sharedMask)) {
+                pool->shared[hole] = pool->shared[slot];
+                hole = slot;
+            }
+        }
+        pool->shared[hole].block = NULL;
+        __atomic_store_n(&pool->nShared, pool->nShared - 1,
+                         __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+
+/* counted_free(), for sets, bitmaps and runs, which are retired the same
+ * way as blocks.
+ */
+static void counted_release(void *ctx, void *block, size_t bytes) {
+    counted_free(block);
+}
+
+static void value_free(void *block) {
+    if (block != NULL && value_epoch != NULL)
+        epoch_retire(value_epoch, block, 0, counted_release, NULL);
+    else
+        counted_free(block);
+}
+
+/* counted_realloc(), except that the old bitmap or runs is retired rather
+ * than freed if need be, which means copying them to a new one.
+ */
+static void * value_realloc(void *block, size_t oldBytes, size_t bytes) {
+    void *moved;
+
+    if (value_epoch == NULL)
+        return counted_realloc(block, bytes);
+    moved = counted_malloc(bytes);
+    memcpy(moved, block, (oldBytes < bytes) ? oldBytes : bytes);
+    value_free(block);
+    return moved;
+}
+
+
+/* Moves the values of a key to a block with room for at least n of them. */
+static void kNode_resize(value_pool *pool, key_node *kNode, size_t n) {
+    size_t bytes = values_space(n);
+    multimap_value *values = block_alloc(pool, bytes);
+
+    if (kNode->values != NULL) {
+        memcpy(values, kNode->values, kNode->nVals * sizeof(multimap_value));
+        block_free(pool, kNode->values,
+                   kNode->capacity * sizeof(multimap_value));
+    }
+    kNode->values = values;
+    kNode->capacity = (int) (bytes / sizeof(multimap_value));
+}
+
+
+/* Gives the values array of a key back. */
+static void kNode_release(value_pool *pool, key_node *kNode) {
+    block_free(pool, kNode->values, kNode->capacity * sizeof(multimap_value));
+    kNode->values = NULL;
+    kNode->capacity = 0;
+}
+
+
+/* Are the values of a key in the key_node itself? */
+static int kNode_inline(const key_node *kNode) {
+    return kNode->nSorted >= 0 && kNode->nVals <= INLINE_VALUES;
+}
+
+
+/* The values of a key that are not packed, wherever they are. */
+static multimap_value * kNode_array(const key_node *kNode) {
+    return kNode_inline(kNode) ? (multimap_value *) kNode->inlineValues :
+                                 kNode->values;
+}
+
+
+/* What a key's values are kept in, once they are not in the key_node:
+ * its array, or if packed its bitmap or runs.
+ */
+static const void * kNode_storage(const key_node *kNode) {
+    return (kNode->values != NULL) ? (const void *) kNode->values :
+                                     (const void *) kNode->set;
+}
+
+
+/* Moves the values of a key out of the key_node, into an array with room
+ * for at least n of them.
+ */
+static void kNode_spill(value_pool *pool, key_node *kNode, size_t n) {
+    multimap_value inlineValues[INLINE_VALUES];
+
+    memcpy(inlineValues, kNode->inlineValues, sizeof(inlineValues));
+    kNode->values = NULL;
+    kNode->set = NULL;
+    kNode_resize(pool, kNode, n);
+    memcpy(kNode->values, inlineValues, kNode->nVals * sizeof(multimap_value));
+}
+
+
+/* Moves the values of a key (with no hash set) back into the key_node, once
+ * there are few enough of them.
+ */
+static void kNode_unspill(value_pool *pool, key_node *kNode) {
+    multimap_value *values = kNode->values;
+    int capacity = kNode->capacity;
+
+    memcpy(kNode->inlineValues, values, kNode->nVals * sizeof(multimap_value));
+    block_free(pool, values, capacity * sizeof(multimap_value));
+}
+
+
+/* Gives a key_node that was copied from another one values of its own, so
+ * that either of them can change without the other one noticing.
+ */
+static void kNode_copy(value_pool *pool, key_node *kNode) {
+    size_t bytes;
+    void *copy;
+
+    if (kNode_inline(kNode))
+        return;
+    if (kNode->values != NULL) {
+        copy = block_alloc(pool, kNode->capacity * sizeof(multimap_value));
+        memcpy(copy, kNode->values, kNode->nVals * sizeof(multimap_value));
+        kNode->values = copy;
+    }
+
+    if (kNode->nSorted == BITMAP_VALUES)
+        bytes = bitmap_space(kNode->bitmap->nWords, kNode->bitmap->nLayers);
+    else if (kNode->nSorted == RUN_VALUES)
+        bytes = runs_space(kNode->runs->maxRuns);
+    else if (kNode->set != NULL)
+        bytes = sizeof(value_set) +
+                (kNode->set->mask + 1) * sizeof(multimap_value);
+    else
+        return;
+    copy = counted_malloc(bytes);
+    memcpy(copy, kNode->set, bytes);
+    kNode->set = copy;
+}
+
+
+/* Frees the values of a key, unless another key_node still holds them. */
+static void kNode_free(value_pool *pool, key_node *kNode) {
+    if (kNode_inline(kNode) || pool_unshare(pool, kNode_storage(kNode)))
+        return;
+    kNode_release(pool, kNode);
+    value_free(kNode->set); /* or the bitmap or runs, whichever it has */
+}
+
+
+/* Gives a key_node that was copied from another one a hold on the same
+ * values, rather than values of its own (which kNode_own() gives it once
+ * either of them changes).
+ */
+static void kNode_share(value_pool *pool, const key_node *kNode) {
+    const void *block;
+    shared_values *slot;
+
+    if (kNode_inline(kNode))
+        return;
+    block = kNode_storage(kNode);
+    pthread_mutex_lock(&pool->lock);
+    if (2 * (pool->nShared + 1) > pool->sharedMask + 1)
+        shared_grow(pool);
+    slot = &pool->shared[shared_slot(pool, block)];
+    if (slot->block == NULL) {
+        slot->block = block;
+        slot->extra = 0;
+        __atomic_store_n(&pool->nShared, pool->nShared + 1,
+                         __ATOMIC_RELAXED);
+    }
+    slot->extra++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* Makes the values of a key its own, if another key_node holds them too,
+ * before they are changed.  They are copied before they are let go of, so
+ * that they can't be freed (by whoever else holds them) while being read.
+ */
+static void kNode_own(value_pool *pool, key_node *kNode) {
+    key_node old;
+
+    if (__atomic_load_n(&pool->nShared, __ATOMIC_RELAXED) == 0 ||
+        kNode_inline(kNode) || !pool_shared(pool, kNode_storage(kNode)))
+        return;
+    old = *kNode;
+    kNode_copy(pool, kNode);
+    kNode_free(pool, &old);
+}
+
+
+/* The slot a value would be in if nothing else were in the way. */
+static unsigned int set_home(const value_set *set, int value) {
+    return ((unsigned int) value * 2654435761u >> 7) & set->mask;
+}
+
+
+/* Where value is in a set, or the empty slot where it would go. */
+static unsigned int set_slot(const value_set *set, int value) {
+    unsigned int slot = set_home(set, value);
+
+    while (set->slots[slot] != value && set->slots[slot] != EMPTY_SLOT)
+        slot = (slot + 1) & set->mask;
+    return slot;
+}
+
+
+static value_set * set_create(unsigned int nSlots) {
+    value_set *set = counted_malloc(sizeof(value_set) +
+                                    nSlots * sizeof(multimap_value));
+    unsigned int i;
+
+    set->mask = nSlots - 1;
+    set->count = 0;
+    set->hasEmpty = 0;
+    for (i = 0; i < nSlots; i++)
+        set->slots[i] = EMPTY_SLOT;
+    return set;
+}
+
+
+static int set_contains(const value_set *set, int value) {
+    if (value == EMPTY_SLOT)
+        return set->hasEmpty;
+    return set->slots[set_slot(set, value)] == value;
+}
+
+
+/* Adds value to *setPtr, doubling the set once it gets half full. */
+static void set_insert(value_set **setPtr, int value) {
+    value_set *set = *setPtr;
+    unsigned int slot, i;
+
+    if (value == EMPTY_SLOT) {
+        set->hasEmpty = 1;
+        return;
+    }
+    slot = set_slot(set, value);
+    if (set->slots[slot] == value)
+        return;
+    set->slots[slot] = value;
+    set->count++;
+
+    if (2 * (unsigned int) set->count > set->mask + 1) {
+        value_set *bigger = set_create(2 * (set->mask + 1));
+
+        for (i = 0; i <= set->mask; i++) {
+            if (set->slots[i] != EMPTY_SLOT)
+                bigger->slots[set_slot(bigger, set->slots[i])] = set->slots[i];
+        }
+        bigger->count = set->count;
+        bigger->hasEmpty = set->hasEmpty;
+        value_free(set);
+        *setPtr = bigger;
+    }
+}
+
+
+/* Takes value out of a set.  Rather than leaving a tombstone, the values
+ * after it in its run of full slots are moved back into the hole whenever
+ * it lies between their home slot and where they are, so that every value
+ * can still be reached from its home slot.
+ */
+static void set_erase(value_set *set, int value) {
+    unsigned int hole, slot;
+
+    if (value == EMPTY_SLOT) {
+        set->hasEmpty = 0;
+        return;
+    }
+    hole = set_slot(set, value);
+    if (set->slots[hole] != value)
+        return;
+    set->count--;
+
+    for (slot = (hole + 1) & set->mask; set->slots[slot] != EMPTY_SLOT;
+         slot = (slot + 1) & set->mask) {
+        unsigned int home = set_home(set, set->slots[slot]);
+
+        if (((slot - home) & set->mask) >= ((slot - hole) & set->mask)) {
+            set->slots[hole] = set->slots[slot];
+            hole = slot;
+        }
+    }
+    set->slots[hole] = EMPTY_SLOT;
+}
+
+
+/* Is bit i of a layer of a bitmap set? */
+static int bitmap_test(const value_bitmap *bitmap, int layer, int i) {
+    return (bitmap->words[layer * bitmap->nWords + (i >> 6)] >> (i & 63)) & 1;
+}
+
+
+/* How many copies of base + i a bitmap holds. */
+static int bitmap_copies(const value_bitmap *bitmap, int i) {
+    int layer = 0;
+
+    while (layer < bitmap->nLayers && bitmap_test(bitmap, layer, i))
+        layer++;
+    return layer;
+}
+
+
+/* Which bit of a bitmap value is, or -1 if it is out of its range. */
+static int bitmap_bit(const value_bitmap *bitmap, int value) {
+    long long i = (long long) value - bitmap->base;
+
+    return (i >= 0 && i < 64LL * bitmap->nWords) ? (int) i : -1;
+}
+
+
+/* Which run value would be in: the last one starting at or before it, or
+ * -1 if there is none.
+ */
+static int runs_find(const value_runs *runs, int value) {
+    int lo = 0, hi = runs->nRuns;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (runs->runs[mid].first <= value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+
+/* Starts a walk over the values of a key. */
+static void values_begin(value_iter *iter, const key_node *kNode) {
+    iter->kNode = kNode;
+    iter->next = 0;
+    iter->left = 0;
+}
+
+
+/* Hands out the next value of a walk, returning zero once there are none
+ * left.  Packed values come out in order.
+ */
+static int values_next(value_iter *iter, int *value) {
+    const key_node *kNode = iter->kNode;
+
+    if (kNode->nSorted >= 0) {
+        if (iter->next >= kNode->nVals)
+            return 0;
+        *value = kNode_array(kNode)[iter->next++];
+        return 1;
+    }
+
+    if (iter->left == 0 && kNode->nSorted == BITMAP_VALUES) {
+        const value_bitmap *bitmap = kNode->bitmap;
+        int nBits = 64 * bitmap->nWords;
+
+        while (iter->next < nBits) {
+            uint64_t word = bitmap->words[iter->next >> 6] >>
+                            (iter->next & 63);
+            if (word == 0) {
+                iter->next = (iter->next | 63) + 1;
+                continue;
+            }
+            iter->next += __builtin_ctzll(word);
+            iter->value = bitmap->base + iter->next;
+            iter->left = bitmap_copies(bitmap, iter->next);
+            iter->next++;
+            break;
+        }
+    }
+    else if (iter->left == 0 && iter->next < kNode->runs->nRuns) {
+        const value_run *run = &kNode->runs->runs[iter->next++];
+
+        iter->value = run->first;
+        iter->left = run->last - run->first + 1;
+    }
+    if (iter->left == 0)
+        return 0;
+
+    *value = iter->value;
+    iter->left--;
+    if (kNode->nSorted == RUN_VALUES && iter->left > 0)
+        iter->value++;
+    return 1;
+}
+
+
+/* The values of a key as one array: the array itself, or packed values
+ * unpacked into *buffer, which is grown to fit (for the caller to free).
+ */
+static const multimap_value * kNode_values(const key_node *kNode,
+                                           multimap_value **buffer) {
+    value_iter iter;
+    int i = 0;
+
+    if (kNode->nSorted >= 0)
+        return kNode_array(kNode);
+
+    *buffer = realloc(*buffer, kNode->nVals * sizeof(multimap_value));
+    values_begin(&iter, kNode);
+    while (values_next(&iter, &(*buffer)[i]))
+        i++;
+    return *buffer;
+}
+
+
+static int compare_values(const void *a, const void *b) {
+    multimap_value x = *(const multimap_value *) a;
+    multimap_value y = *(const multimap_value *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* Sorts the tail and merges it into the sorted prefix.  The merge runs from
+ * the back, so only the tail needs copying out of the way first.  This, like
+ * promoting, packing and demoting, is only done to keys with an array.
+ */
+static void kNode_merge_tail(key_node *kNode) {
+    multimap_value small[TAIL_VALUES + 1];
+    multimap_value *tail, *values = kNode->values;
+    int nTail = kNode->nVals - kNode->nSorted;
+    int i, j, k;
+
+    if (nTail == 0)
+        return;
+
+    tail = (nTail <= TAIL_VALUES + 1) ? small :
+           counted_malloc(nTail * sizeof(multimap_value));
+    memcpy(tail, values + kNode->nSorted, nTail * sizeof(multimap_value));
+    if (nTail <= TAIL_VALUES + 1) {
+        for (i = 1; i < nTail; i++) {
+            multimap_value v = tail[i];
+            for (j = i; j > 0 && tail[j - 1] > v; j--)
+                tail[j] = tail[j - 1];
+            tail[j] = v;
+        }
+    }
+    else {
+        qsort(tail, nTail, sizeof(multimap_value), compare_values);
+    }
+
+    i = kNode->nSorted - 1;
+    j = nTail - 1;
+    k = kNode->nVals - 1;
+    while (j >= 0) {
+        if (i >= 0 && values[i] > tail[j])
+            values[k--] = values[i--];
+        else
+            values[k--] = tail[j--];
+    }
+    kNode->nSorted = kNode->nVals;
+
+    if (tail != small)
+        counted_free(tail);
+}
+
+
+/* Builds the hash set of a key that has reached HASH_VALUES values. */
+static void kNode_promote(key_node *kNode) {
+    unsigned int nSlots = 64;
+    int i;
+
+    while (nSlots < 2 * (unsigned int) kNode->nVals)
+        nSlots *= 2;
+    kNode->set = set_create(nSlots);
+    for (i = 0; i < kNode->nVals; i++)
+        set_insert(&kNode->set, kNode->values[i]);
+    kNode->nSorted = 0;
+}
+
+
+/* Packs the (sorted) values array of a key into a bitmap or runs, if
+ * either takes at most half the space.
+ */
+static void kNode_pack(value_pool *pool, key_node *kNode) {
+    const multimap_value *values = kNode->values;
+    int n = kNode->nVals, copies = 1, maxCopies = 1, nRuns = 1, i;
+    long long nWords;
+    size_t space = values_space(n), bitmapSpace, runsSpace;
+
+    if (n <= INLINE_VALUES)
+        return;
+    for (i = 1; i < n; i++) {
+        if (values[i] == values[i - 1]) {
+            if (++copies > maxCopies)
+                maxCopies = copies;
+        }
+        else {
+            copies = 1;
+            if (values[i] != values[i - 1] + 1)
+                nRuns++;
+        }
+    }
+    nWords = (((long long) values[n - 1] - (values[0] & ~63)) >> 6) + 1;
+    bitmapSpace = (nWords <= MAX_WORDS) ?
+                  bitmap_space(nWords, maxCopies) : SIZE_MAX;
+    runsSpace = (maxCopies == 1) ? runs_space(nRuns) : SIZE_MAX;
+
+    if (runsSpace <= bitmapSpace && 2 * runsSpace <= space) {
+        value_runs *runs = counted_malloc(runsSpace);
+
+        runs->nRuns = 0;
+        runs->maxRuns = nRuns;
+        for (i = 0; i < n; i++) {
+            if (i > 0 && values[i] == values[i - 1] + 1) {
+                runs->runs[runs->nRuns - 1].last = values[i];
+            }
+            else {
+                runs->runs[runs->nRuns].first = values[i];
+                runs->runs[runs->nRuns].last = values[i];
+                runs->nRuns++;
+            }
+        }
+        kNode->runs = runs;
+        kNode->nSorted = RUN_VALUES;
+    }
+    else if (2 * bitmapSpace <= space) {
+        value_bitmap *bitmap = counted_calloc(bitmapSpace);
+
+        bitmap->base = values[0] & ~63;
+        bitmap->nWords = (int) nWords;
+        bitmap->nLayers = maxCopies;
+        for (i = 0, copies = 0; i < n; i++) {
+            int bit = values[i] - bitmap->base;
+
+            copies = (i > 0 && values[i] == values[i - 1]) ? copies + 1 : 0;
+            bitmap->words[copies * bitmap->nWords + (bit >> 6)] |=
+                (uint64_t) 1 << (bit & 63);
+        }
+        kNode->bitmap = bitmap;
+        kNode->nSorted = BITMAP_VALUES;
+    }
+    else {
+        return;
+    }
+    kNode_release(pool, kNode);
+}
+
+
+/* Turns packed values back into a (sorted) array, or inline values. */
+static void kNode_unpack(value_pool *pool, key_node *kNode) {
+    multimap_value small[INLINE_VALUES];
+    size_t bytes = values_space(kNode->nVals);
+    multimap_value *values = (kNode->nVals <= INLINE_VALUES) ? small :
+                             block_alloc(pool, bytes);
+    value_iter iter;
+    int i = 0;
+
+    values_begin(&iter, kNode);
+    while (values_next(&iter, &values[i]))
+        i++;
+    value_free(kNode->bitmap);
+    kNode->nSorted = kNode->nVals;
+    if (values == small) {
+        memcpy(kNode->inlineValues, small, i * sizeof(multimap_value));
+        return;
+    }
+    kNode->bitmap = NULL;
+    kNode->values = values;
+    kNode->capacity = (int) (bytes / sizeof(multimap_value));
+
+    if (kNode->nVals >= HASH_VALUES)
+        kNode_promote(kNode);
+}
+
+
+/* Sorts the values of a key once its tail is full, then packs them or
+ * gives them a hash set if either is called for.
+ */
+static void kNode_settle(value_pool *pool, key_node *kNode) {
+    kNode_merge_tail(kNode);
+    kNode_pack(pool, kNode);
+    if (kNode->nSorted >= 0 && kNode->nVals >= HASH_VALUES)
+        kNode_promote(kNode);
+}
+
+
+/* Drops the hash set of a key that has shrunk, and sorts its values. */
+static void kNode_demote(value_pool *pool, key_node *kNode) {
+    value_free(kNode->set);
+    kNode->set = NULL;
+    kNode->nSorted = 0;
+    kNode_merge_tail(kNode);
+    kNode_pack(pool, kNode);
+}
+
+
+/* Adds a value to a key's bitmap, widening it or adding a layer if need
+ * be.  Returns zero (having unpacked the key instead) if the bitmap would
+ * then be bigger than an array.
+ */
+static int bitmap_add(value_pool *pool, key_node *kNode, int value) {
+    value_bitmap *bitmap = kNode->bitmap;
+    size_t limit = values_space(kNode->nVals + 1);
+    int bit = bitmap_bit(bitmap, value), layer;
+
+    if (bit < 0) {
+        long long lo = bitmap->base, hi = lo + 64LL * bitmap->nWords;
+        long long shift, nWords;
+        value_bitmap *wider;
+
+        if (value < lo)
+            lo = value & ~63;
+        else
+            hi = (long long) (value & ~63) + 64;
+        nWords = (hi - lo) >> 6;
+        if (nWords > MAX_WORDS ||
+            bitmap_space(nWords, bitmap->nLayers) > limit) {
+            kNode_unpack(pool, kNode);
+            return 0;
+        }
+
+        wider = counted_calloc(bitmap_space(nWords, bitmap->nLayers));
+        wider->base = (int) lo;
+        wider->nWords = (int) nWords;
+        wider->nLayers = bitmap->nLayers;
+        shift = (bitmap->base - lo) >> 6;
+        for (layer = 0; layer < bitmap->nLayers; layer++) {
+            memcpy(&wider->words[layer * nWords + shift],
+                   &bitmap->words[layer * bitmap->nWords],
+                   bitmap->nWords * sizeof(uint64_t));
+        }
+        value_free(bitmap);
+        kNode->bitmap = bitmap = wider;
+        bit = bitmap_bit(bitmap, value);
+    }
+
+    layer = bitmap_copies(bitmap, bit);
+    if (layer == bitmap->nLayers) {
+        if (bitmap_space(bitmap->nWords, layer + 1) > limit) {
+            kNode_unpack(pool, kNode);
+            return 0;
+        }
+        bitmap = value_realloc(bitmap, bitmap_space(bitmap->nWords, layer),
+                               bitmap_space(bitmap->nWords, layer + 1));
+        memset(&bitmap->words[layer * bitmap->nWords], 0,
+               bitmap->nWords * sizeof(uint64_t));
+        bitmap->nLayers++;
+        kNode->bitmap = bitmap;
+    }
+    bitmap->words[layer * bitmap->nWords + (bit >> 6)] |=
+        (uint64_t) 1 << (bit & 63);
+    kNode->nVals++;
+    return 1;
+}
+
+
+/* Makes room for one more run at index pos of a key's runs. */
+static void runs_open(key_node *kNode, int pos) {
+    value_runs *runs = kNode->runs;
+
+    if (runs->nRuns == runs->maxRuns) {
+        size_t oldSpace = runs_space(runs->maxRuns);
+
+        runs->maxRuns += runs->maxRuns / 2 + 1;
+        runs = value_realloc(runs, oldSpace, runs_space(runs->maxRuns));
+        kNode->runs = runs;
+    }
+    memmove(&runs->runs[pos + 1], &runs->runs[pos],
+            (runs->nRuns - pos) * sizeof(value_run));
+    runs->nRuns++;
+}
+
+
+/* Closes up run pos of a key's runs. */
+static void runs_close(value_runs *runs, int pos) {
+    memmove(&runs->runs[pos], &runs->runs[pos + 1],
+            (runs->nRuns - pos - 1) * sizeof(value_run));
+    runs->nRuns--;
+}
+
+
+/* Adds a value to a key's runs.  Returns zero (having unpacked the key
+ * instead) if it is already there, or the runs would need more space than
+ * an array.
+ */
+static int runs_add(value_pool *pool, key_node *kNode, int value) {
+    value_runs *runs = kNode->runs;
+    int pos = runs_find(runs, value);
+    int joinsLeft, joinsRight;
+
+    if (pos >= 0 && value <= runs->runs[pos].last) {
+        kNode_unpack(pool, kNode);
+        return 0;
+    }
+    joinsLeft = pos >= 0 && runs->runs[pos].last == value - 1;
+    joinsRight = pos + 1 < runs->nRuns && runs->runs[pos + 1].first == value + 1;
+
+    if (joinsLeft && joinsRight) {
+        runs->runs[pos].last = runs->runs[pos + 1].last;
+        runs_close(runs, pos + 1);
+    }
+    else if (joinsLeft) {
+        runs->runs[pos].last = value;
+    }
+    else if (joinsRight) {
+        runs->runs[pos + 1].first = value;
+    }
+    else {
+        if (runs_space(runs->nRuns + 1) > values_space(kNode->nVals + 1)) {
+            kNode_unpack(pool, kNode);
+            return 0;
+        }
+        runs_open(kNode, pos + 1);
+        kNode->runs->runs[pos + 1].first = value;
+        kNode->runs->runs[pos + 1].last = value;
+    }
+    kNode->nVals++;
+    return 1;
+}
+
+
+/* Adds a value to a key, spilling it out of the key_node or doubling the
+ * array if it is full.
+ */
+static void kNode_add(value_pool *pool, key_node *kNode, int value) {
+    kNode_own(pool, kNode);
+    if (kNode->nSorted == BITMAP_VALUES && bitmap_add(pool, kNode, value))
+        return;
+    if (kNode->nSorted == RUN_VALUES && runs_add(pool, kNode, value))
+        return;
+
+    if (kNode->nVals < INLINE_VALUES) {
+        kNode->inlineValues[kNode->nVals++] = value;
+        return;
+    }
+    if (kNode->nVals == INLINE_VALUES)
+        kNode_spill(pool, kNode, INLINE_VALUES + 1);
+    else if (kNode->nVals == kNode->capacity)
+        kNode_resize(pool, kNode, kNode->nVals + 1);
+    kNode->values[kNode->nVals++] = value;
+
+    if (kNode->set != NULL)
+        set_insert(&kNode->set, value);
+    else if (kNode->nVals - kNode->nSorted > TAIL_VALUES ||
+             kNode->nVals >= HASH_VALUES)
+        kNode_settle(pool, kNode);
+}
+
+
+/* Adds the values of count pairs (all with this key) to a key at once,
+ * growing the array just once and merging at most once.
+ */
+static void kNode_add_values(value_pool *pool, key_node *kNode,
+                             const mm_pair *pairs, size_t count) {
+    size_t i;
+
+    kNode_own(pool, kNode);
+    if (kNode->nSorted < 0) {
+        for (i = 0; i < count; i++)
+            kNode_add(pool, kNode, pairs[i].value);
+        return;
+    }
+
+    if (kNode->nVals + count <= INLINE_VALUES) {
+        for (i = 0; i < count; i++)
+            kNode->inlineValues[kNode->nVals + i] = pairs[i].value;
+        kNode->nVals += (int) count;
+        return;
+    }
+    if (kNode->nVals <= INLINE_VALUES)
+        kNode_spill(pool, kNode, kNode->nVals + count);
+    else if (kNode->nVals + count > (size_t) kNode->capacity)
+        kNode_resize(pool, kNode, kNode->nVals + count);
+    for (i = 0; i < count; i++)
+        kNode->values[kNode->nVals + i] = pairs[i].value;
+    kNode->nVals += (int) count;
+
+    if (kNode->set != NULL) {
+        for (i = 0; i < count; i++)
+            set_insert(&kNode->set, pairs[i].value);
+    }
+    else if (kNode->nVals - kNode->nSorted > TAIL_VALUES ||
+             kNode->nVals >= HASH_VALUES) {
+        kNode_settle(pool, kNode);
+    }
+}
+
+
+/* Takes every copy of value out of a key's bitmap, returning how many. */
+static int bitmap_remove(key_node *kNode, int value) {
+    value_bitmap *bitmap = kNode->bitmap;
+    int bit = bitmap_bit(bitmap, value), copies, layer, i;
+
+    if (bit < 0)
+        return 0;
+    copies = bitmap_copies(bitmap, bit);
+    for (layer = 0; layer < copies; layer++) {
+        bitmap->words[layer * bitmap->nWords + (bit >> 6)] &=
+            ~((uint64_t) 1 << (bit & 63));
+    }
+
+    /* drop the top layer if that was the last value in it */
+    while (copies > 0 && bitmap->nLayers > 1) {
+        uint64_t *top = &bitmap->words[(bitmap->nLayers - 1) *
+                                       bitmap->nWords];
+        for (i = 0; i < bitmap->nWords && top[i] == 0; i++)
+            ;
+        if (i < bitmap->nWords)
+            break;
+        bitmap->nLayers--;
+    }
+    kNode->nVals -= copies;
+    return copies;
+}
+
+
+/* Takes value out of a key's runs, returning how many copies (0 or 1). */
+static int runs_remove(key_node *kNode, int value) {
+    value_runs *runs = kNode->runs;
+    int pos = runs_find(runs, value);
+    value_run *run;
+
+    if (pos < 0 || value > runs->runs[pos].last)
+        return 0;
+    run = &runs->runs[pos];
+    if (run->first == run->last) {
+        runs_close(runs, pos);
+    }
+    else if (value == run->first) {
+        run->first++;
+    }
+    else if (value == run->last) {
+        run->last--;
+    }
+    else {
+        int last = run->last;
+
+        run->last = value - 1;
+        runs_open(kNode, pos + 1);
+        kNode->runs->runs[pos + 1].first = value + 1;
+        kNode->runs->runs[pos + 1].last = last;
+    }
+    kNode->nVals--;
+    return 1;
+}
+
+
+/* Removes every copy of value from a key.  An array is shrunk to fit what
+ * is left (or moved back into the key_node), and both of its parts stay in
+ * the order they were in; packed values are unpacked once an array would be
+ * smaller.  Everything is freed if nothing is left.  Returns how many values
+ * were removed.
+ */
+static int kNode_remove(value_pool *pool, key_node *kNode, int value) {
+    multimap_value *values;
+    int i, kept = 0, keptSorted = 0, removed, wasInline;
+
+    kNode_own(pool, kNode);
+    if (kNode->nSorted < 0) {
+        size_t space;
+
+        if (kNode->nSorted == BITMAP_VALUES) {
+            removed = bitmap_remove(kNode, value);
+            space = bitmap_space(kNode->bitmap->nWords,
+                                 kNode->bitmap->nLayers);
+        }
+        else {
+            removed = runs_remove(kNode, value);
+            space = runs_space(kNode->runs->maxRuns);
+        }
+        if (kNode->nVals == 0) {
+            value_free(kNode->bitmap);
+            kNode->bitmap = NULL;
+            kNode->nSorted = 0;
+        }
+        else if (removed > 0 && (space > values_space(kNode->nVals) ||
+                                 kNode->nVals <= INLINE_VALUES)) {
+            kNode_unpack(pool, kNode);
+        }
+        return removed;
+    }
+
+    values = kNode_array(kNode);
+    wasInline = kNode_inline(kNode);
+    for (i = 0; i < kNode->nVals; i++) {
+        if (values[i] != value)
+            values[kept++] = values[i];
+        if (i == kNode->nSorted - 1)
+            keptSorted = kept;
+    }
+    removed = kNode->nVals - kept;
+    kNode->nVals = kept;
+    kNode->nSorted = keptSorted;
+    if (removed == 0 || wasInline)
+        return removed;
+
+    if (kNode->set != NULL) {
+        set_erase(kNode->set, value);
+        if (kept < HASH_VALUES / 4)
+            kNode_demote(pool, kNode);
+    }
+    if (kNode->nSorted < 0)
+        return removed;
+    if (kept <= INLINE_VALUES)
+        kNode_unspill(pool, kNode);
+    else if (kept <= kNode->capacity / 4 &&
+             values_space(2 * kept) < kNode->capacity * sizeof(multimap_value))
+        kNode_resize(pool, kNode, 2 * kept);
+    return removed;
+}
+
+
+/* Is value anywhere in the first n values?  Four at a time, with SSE2. */
+static int scan_values(const multimap_value *values, int n, int value) {
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi32(value);
+    for (; i + 4 <= n; i += 4) {
+        __m128i four = _mm_loadu_si128((const __m128i *) (values + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(four, needle)))
+            return 1;
+    }
+#endif
+    for (; i < n; i++) {
+        if (values[i] == value)
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Is value one of the values of a key?  A bit test or a search of the runs
+ * if the values are packed, a scan if they are inline, a lookup in the hash
+ * set if the key has one, or else a branchless binary search of the sorted
+ * prefix (for the last value <= value), then a scan of the tail.
+ */
+static int kNode_contains(const key_node *kNode, int value) {
+    const multimap_value *base;
+    int n = kNode->nSorted;
+
+    if (n == BITMAP_VALUES) {
+        int bit = bitmap_bit(kNode->bitmap, value);
+        return bit >= 0 && bitmap_test(kNode->bitmap, 0, bit);
+    }
+    if (n == RUN_VALUES) {
+        int pos = runs_find(kNode->runs, value);
+        return pos >= 0 && value <= kNode->runs->runs[pos].last;
+    }
+    if (kNode->nVals <= INLINE_VALUES)
+        return scan_values(kNode->inlineValues, kNode->nVals, value);
+    if (kNode->set != NULL)
+        return set_contains(kNode->set, value);
+
+    base = kNode->values;
+    if (n > 0) {
+        while (n > 1) {
+            int half = n / 2;
+            base = (base[half] <= value) ? base + half : base;
+            n -= half;
+        }
+        if (*base == value)
+            return 1;
+    }
+    return scan_values(kNode->values + kNode->nSorted,
+                       kNode->nVals - kNode->nSorted, value);
+}
+
+
+/* Starts loading what kNode_contains will look at for value into cache:
+ * its word of a bitmap, its home slot in the hash set, or else (up to) the
+ * first maxBytes of the values or runs.  Inline values need nothing more.
+ */
+static void kNode_prefetch(const key_node *kNode, int value,
+                           size_t maxBytes) {
+    const char *values = (const char *) kNode->values;
+    size_t bytes = kNode->nVals * sizeof(multimap_value);
+    size_t b;
+
+    if (kNode_inline(kNode))
+        return;
+    if (kNode->nSorted == BITMAP_VALUES) {
+        int bit = bitmap_bit(kNode->bitmap, value);
+        if (bit >= 0)
+            __builtin_prefetch(&kNode->bitmap->words[bit >> 6]);
+        return;
+    }
+    if (kNode->nSorted == RUN_VALUES) {
+        values = (const char *) kNode->runs;
+        bytes = runs_space(kNode->runs->nRuns);
+    }
+    else if (kNode->set != NULL) {
+        __builtin_prefetch(&kNode->set->slots[set_home(kNode->set, value)]);
+        return;
+    }
+    for (b = 0; b < bytes && b < maxBytes; b += LINE_SIZE)
+        __builtin_prefetch(values + b);
+}
+
+
+/* Gives back the room an array has beyond what its values need. */
+static void kNode_shrink(value_pool *pool, key_node *kNode) {
+    if (kNode->nSorted >= 0 && kNode->nVals > INLINE_VALUES &&
+        values_space(kNode->nVals) < kNode->capacity * sizeof(multimap_value)) {
+        kNode_own(pool, kNode);
+        kNode_resize(pool, kNode, kNode->nVals);
+    }
+}
+
+#endif
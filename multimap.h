@@ -9,13 +9,110 @@
 #ifndef MULTIMAP_H
 #define MULTIMAP_H
 
+#include <stddef.h>
+
 
 typedef struct multimap multimap;
 
+/* A position in the multimap, for walking through its pairs in key order
+ * (see mm_cursor_seek()).
+ */
+typedef struct mm_cursor mm_cursor;
+
+
+/* Tuning knobs for init_multimap_with_config().  Implementations that have
+ * no use for a setting simply ignore it.
+ */
+typedef struct mm_config {
+    /* The size in bytes of one node of the data structure.  Tree-based
+     * implementations derive their fanout from this, e.g. pass 4096 to get
+     * page-sized nodes.  Zero means the implementation's default.
+     */
+    size_t node_size;
+
+    /* How full mm_bulk_load() packs each node, as a fraction of what fits,
+     * e.g. 0.7 leaves 30% of every node free for later insertions.  Values
+     * too small to keep the tree balanced are raised to the smallest that
+     * does.  Zero means completely full.
+     */
+    double fill_factor;
+
+    /* How the memory the multimap allocates in big blocks (the nodes of the
+     * trees, and the slabs small value arrays come from) is backed, one of
+     * the MM_PAGES_* below.  Zero means transparent huge pages.
+     */
+    int page_backing;
+
+    /* Nonzero to make the multimap safe to use from many threads at once
+     * without a lock around it, for mm_add_value(), mm_add_values(),
+     * mm_remove_value(), mm_remove_key(), mm_contains_key(),
+     * mm_contains_pair() and mm_contains_pairs().  Everything else (bulk
+     * loading, traversals, ranges and cursors, shrinking and clearing) still
+     * needs the multimap to itself.  One of the MM_CONCURRENT_* below, which
+     * implementations that have only one way of doing it treat alike; see
+     * mm_print_info() for what a multimap actually does.
+     */
+    int concurrent;
+} mm_config;
+
+/* Huge pages if the kernel will, through madvise(MADV_HUGEPAGE). */
+#define MM_PAGES_TRANSPARENT (0)
+
+/* Huge pages from the reserved pool (mmap() with MAP_HUGETLB), or
+ * MM_PAGES_TRANSPARENT if there are none to be had.
+ */
+#define MM_PAGES_HUGETLB (1)
+
+/* Ordinary small pages only (MADV_NOHUGEPAGE), to compare against. */
+#define MM_PAGES_SMALL (2)
+
+/* Reader-writer latches on the nodes, taken by lock coupling. */
+#define MM_CONCURRENT_LATCHES (1)
+
+/* Optimistic lock coupling: lookups take no latches at all, but check
+ * version counters on the nodes to see whether they raced a change.
+ */
+#define MM_CONCURRENT_OPTIMISTIC (2)
+
+/* A B-link tree (Lehman and Yao): every node links to the one to its right
+ * and knows the highest key it may hold, so that a split latches one node
+ * at a time and a lookup that races one just moves right.  Removals don't
+ * rebalance.  Only the B+ tree is built this way; the b-tree latches
+ * instead.
+ */
+#define MM_CONCURRENT_BLINK (3)
+
+
+/* How many times the storage for values has called the system allocator,
+ * counted over every multimap, by one thread (see mm_get_alloc_stats()).
+ */
+typedef struct mm_alloc_stats {
+    unsigned long mallocs;   /* malloc() and friends */
+    unsigned long reallocs;
+    unsigned long frees;
+
+    /* Blocks handed out again after being freed, without asking the system
+     * allocator, by implementations that keep their own free lists.
+     */
+    unsigned long reused;
+} mm_alloc_stats;
+
+
+/* A (key, value) pair, for the operations that take many pairs at once. */
+typedef struct mm_pair {
+    int key;
+    int value;
+} mm_pair;
+
 
 /* Allocate and initialize a multimap data structure. */
 multimap * init_multimap();
 
+/* Allocate and initialize a multimap data structure, configured according
+ * to the specified settings.
+ */
+multimap * init_multimap_with_config(const mm_config *config);
+
 /* Release all dynamically allocated memory associated with the multimap
  * data structure, but not the multimap itself.
  */
@@ -24,6 +121,44 @@ void clear_multimap(multimap *mm);
 /* Adds the specified (key, value) pair to the multimap. */
 void mm_add_value(multimap *mm, int key, int value);
 
+/* Adds the n pairs (keys[i], vals[i]) to the multimap.  The pairs do not have
+ * to be in any order, but if they are already sorted by key the sort is
+ * skipped.  An empty multimap is built directly from the sorted pairs, one
+ * node at a time and with the configured fill factor, which is much faster
+ * than adding them one by one; a multimap that is not empty just has the
+ * pairs added to it one at a time.
+ */
+void mm_bulk_load(multimap *mm, const int *keys, const int *vals, size_t n);
+
+/* The same as mm_bulk_load(), for the n pairs, but with nthreads threads
+ * doing the work:  the pairs are sorted in parallel, and the b-tree builds
+ * each level of an empty multimap in parallel too, every thread taking a
+ * range of the keys.  It ends up with the same multimap mm_bulk_load()
+ * would.  A multimap that is not empty has the pairs added with
+ * mm_add_values().
+ */
+void mm_bulk_load_parallel(multimap *mm, const mm_pair *pairs, size_t n,
+                           int nthreads);
+
+/* Adds the n pairs to the multimap, the same as calling mm_add_value() on
+ * each of them in turn, but faster for large batches: the batch is sorted
+ * by key, each key is looked up only once however many pairs it has, and
+ * keys that end up next to each other are inserted without starting from
+ * the root every time.
+ */
+void mm_add_values(multimap *mm, const mm_pair *pairs, size_t n);
+
+/* Removes every occurrence of the specified (key, value) pair from the
+ * multimap.  A key whose last value is removed is removed as well.  Returns
+ * the number of pairs that were removed.
+ */
+int mm_remove_value(multimap *mm, int key, int value);
+
+/* Removes the specified key and all of its values from the multimap.
+ * Returns the number of pairs that were removed.
+ */
+int mm_remove_key(multimap *mm, int key);
+
 /* Returns nonzero if the multimap contains the specified key-value, zero
  * otherwise.
  */
@@ -34,10 +169,90 @@ int mm_contains_key(multimap *mm, int key);
  */
 int mm_contains_pair(multimap *mm, int key, int value);
 
+/* Checks n (key, value) pairs at once, setting out[i] to what
+ * mm_contains_pair(mm, keys[i], vals[i]) would return.  Implementations can
+ * overlap the lookups, so this can be much faster than calling
+ * mm_contains_pair() n times.
+ */
+void mm_contains_pairs(multimap *mm, const int *keys, const int *vals,
+                       int *out, size_t n);
+
 /* Performs an in-order traversal of the multimap, passing each (key, value)
  * pair to the specified function.
  */
 void mm_traverse(multimap *mm, void (*f)(int key, int value));
 
+/* Like mm_traverse(), but also passes ctx along to the function, and stops
+ * the traversal as soon as the function returns nonzero.
+ */
+void mm_traverse_ex(multimap *mm, int (*f)(void *ctx, int key, int value),
+                    void *ctx);
+
+/* Performs an in-order traversal of the multimap one key at a time, passing
+ * each key along with all nVals of its values (in the same order that
+ * mm_traverse() would) to the specified function.  The values array is
+ * only valid for the duration of the call.  Stops as soon as the function
+ * returns nonzero.
+ */
+void mm_traverse_values(multimap *mm,
+                        int (*f)(void *ctx, int key, const int *values,
+                                 int nVals),
+                        void *ctx);
+
+/* Passes each (key, value) pair with lo <= key < hi to the specified
+ * function, in key order, along with ctx.  The walk stops early if the
+ * function returns nonzero.
+ */
+void mm_range(multimap *mm, int lo, int hi,
+              int (*f)(void *ctx, int key, int value), void *ctx);
+
+/* Returns a new cursor positioned just before the first pair whose key is
+ * >= the specified key.  The cursor must be released with mm_cursor_free(),
+ * and becomes invalid once the multimap is modified.
+ */
+mm_cursor * mm_cursor_seek(multimap *mm, int key);
+
+/* Moves the cursor to the next pair in key order and stores it in *key and
+ * *value.  Returns zero (leaving *key and *value alone) once there are no
+ * pairs left.
+ */
+int mm_cursor_next(mm_cursor *cursor, int *key, int *value);
+
+/* Releases a cursor returned by mm_cursor_seek(). */
+void mm_cursor_free(mm_cursor *cursor);
+
+/* Returns a read-only view of the multimap as it is now:  changes made to
+ * the multimap afterwards don't show up in it.  Only the lookups,
+ * traversals, ranges and cursors may be used on a snapshot, and since
+ * nothing changes it, from any number of threads at once, even while the
+ * multimap itself goes on being changed (from one thread at a time).
+ * Taking one needs the multimap to itself, and a concurrent multimap (see
+ * mm_config.concurrent) can't have any:  NULL is returned for it.  A
+ * snapshot is released the same way as a multimap, with clear_multimap()
+ * and free(), and that must be done before the multimap it was taken of is
+ * cleared.  The b-tree shares all of its nodes with its snapshots, so
+ * taking one costs next to nothing, and later changes copy just the nodes
+ * on their way down that are still shared (copy on write); the B+ tree
+ * copies its nodes.  Both share the values of every key until a change to
+ * that key copies them.  The binary tree copies the whole multimap.
+ */
+multimap * mm_snapshot(multimap *mm);
+
+/* Gives back whatever room the multimap has set aside for values that have
+ * not been added yet, e.g. once it has been loaded and will only be read.
+ */
+void mm_shrink_to_fit(multimap *mm);
+
+/* Stores in *stats how many allocator calls the calling thread has made
+ * for values so far, for all multimaps together.
+ */
+void mm_get_alloc_stats(mm_alloc_stats *stats);
+
+/* Prints a one-line description of how the multimap is implemented and
+ * configured (node size, search strategy, ...), so that results from the
+ * performance tests can be told apart.
+ */
+void mm_print_info(multimap *mm);
+
 #endif
 